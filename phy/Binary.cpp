@@ -0,0 +1,306 @@
+#include "Binary.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace phy {
+
+Hasher::Hasher() {
+	value = 14695981039346656037ull;
+}
+
+Hasher::~Hasher() {
+}
+
+void Hasher::push(const void *data, size_t size) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; i++) {
+		value ^= bytes[i];
+		value *= 1099511628211ull;
+	}
+}
+
+void Hasher::push(int32_t v) {
+	unsigned char bytes[4];
+	for (int i = 0; i < 4; i++) {
+		bytes[i] = (unsigned char)(((uint32_t)v >> (8*i)) & 0xFF);
+	}
+	push(bytes, 4);
+}
+
+void Hasher::push(uint64_t v) {
+	unsigned char bytes[8];
+	for (int i = 0; i < 8; i++) {
+		bytes[i] = (unsigned char)((v >> (8*i)) & 0xFF);
+	}
+	push(bytes, 8);
+}
+
+void Hasher::push(bool v) {
+	push((int32_t)v);
+}
+
+void Hasher::push(float v) {
+	push((double)v);
+}
+
+void Hasher::push(double v) {
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	push(bits);
+}
+
+void Hasher::push(const string &v) {
+	push((int32_t)v.size());
+	push(v.data(), v.size());
+}
+
+Writer::Writer() {
+}
+
+Writer::~Writer() {
+}
+
+void Writer::write(const void *ptr, size_t size) {
+	const char *bytes = (const char *)ptr;
+	data.insert(data.end(), bytes, bytes+size);
+}
+
+void Writer::write(int32_t v) {
+	char bytes[4];
+	for (int i = 0; i < 4; i++) {
+		bytes[i] = (char)(((uint32_t)v >> (8*i)) & 0xFF);
+	}
+	write(bytes, 4);
+}
+
+void Writer::write(uint64_t v) {
+	char bytes[8];
+	for (int i = 0; i < 8; i++) {
+		bytes[i] = (char)((v >> (8*i)) & 0xFF);
+	}
+	write(bytes, 8);
+}
+
+void Writer::write(double v) {
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	write(bits);
+}
+
+void Writer::write(const string &v) {
+	write((int32_t)v.size());
+	write(v.data(), v.size());
+}
+
+bool Writer::save(string path) const {
+	// Other processes may have the old file mapped, and truncating it under
+	// them would fault their reads. So write a new file next to it and move it
+	// into place, which also means concurrent writers never interleave.
+#ifndef WIN32
+	string tmp = path + ".XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	FILE *fptr = nullptr;
+	if (fd >= 0) {
+		// mkstemp() only gives access to the owner
+		fchmod(fd, 0644);
+		fptr = fdopen(fd, "wb");
+		if (fptr == nullptr) {
+			::close(fd);
+			remove(tmp.c_str());
+		}
+	}
+#else
+	string tmp = path + ".tmp";
+	FILE *fptr = fopen(tmp.c_str(), "wb");
+#endif
+	if (fptr == nullptr) {
+		printf("%s:%d error: unable to open file '%s' for writing.\n", __FILE__, __LINE__, path.c_str());
+		return false;
+	}
+	size_t count = fwrite(data.data(), 1, data.size(), fptr);
+	if (fclose(fptr) != 0 or count != data.size()) {
+		remove(tmp.c_str());
+		printf("%s:%d error: unable to write file '%s'.\n", __FILE__, __LINE__, path.c_str());
+		return false;
+	}
+
+#ifdef WIN32
+	// rename() doesn't replace an existing file here
+	remove(path.c_str());
+#endif
+	if (rename(tmp.c_str(), path.c_str()) != 0) {
+		remove(tmp.c_str());
+		printf("%s:%d error: unable to replace file '%s'.\n", __FILE__, __LINE__, path.c_str());
+		return false;
+	}
+	return true;
+}
+
+Reader::Reader() {
+	data = nullptr;
+	size = 0;
+	pos = 0;
+	failed = false;
+}
+
+Reader::Reader(const char *data, size_t size) {
+	this->data = data;
+	this->size = size;
+	this->pos = 0;
+	this->failed = false;
+}
+
+Reader::~Reader() {
+}
+
+bool Reader::read(void *ptr, size_t size) {
+	if (failed or this->size - pos < size) {
+		failed = true;
+		return false;
+	}
+	memcpy(ptr, data+pos, size);
+	pos += size;
+	return true;
+}
+
+bool Reader::read(int32_t *v) {
+	unsigned char bytes[4];
+	if (not read(bytes, 4)) {
+		return false;
+	}
+	uint32_t result = 0;
+	for (int i = 0; i < 4; i++) {
+		result |= ((uint32_t)bytes[i]) << (8*i);
+	}
+	*v = (int32_t)result;
+	return true;
+}
+
+bool Reader::read(uint64_t *v) {
+	unsigned char bytes[8];
+	if (not read(bytes, 8)) {
+		return false;
+	}
+	uint64_t result = 0;
+	for (int i = 0; i < 8; i++) {
+		result |= ((uint64_t)bytes[i]) << (8*i);
+	}
+	*v = result;
+	return true;
+}
+
+bool Reader::read(double *v) {
+	uint64_t bits;
+	if (not read(&bits)) {
+		return false;
+	}
+	memcpy(v, &bits, sizeof(bits));
+	return true;
+}
+
+bool Reader::read(string *v) {
+	int32_t length = 0;
+	if (not read(&length) or length < 0 or size - pos < (size_t)length) {
+		failed = true;
+		return false;
+	}
+	v->assign(data+pos, length);
+	pos += length;
+	return true;
+}
+
+bool Reader::done() const {
+	return pos >= size;
+}
+
+MappedFile::MappedFile() {
+	data = nullptr;
+	size = 0;
+	mapped = false;
+}
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+bool MappedFile::open(string path) {
+	close();
+
+#ifndef WIN32
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		::close(fd);
+		return false;
+	}
+
+	size = (size_t)info.st_size;
+	if (size == 0) {
+		::close(fd);
+		return true;
+	}
+
+	void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (ptr != MAP_FAILED) {
+		data = (const char *)ptr;
+		mapped = true;
+		return true;
+	}
+	size = 0;
+#endif
+
+	// Fall back to reading the whole file
+	FILE *fptr = fopen(path.c_str(), "rb");
+	if (fptr == nullptr) {
+		return false;
+	}
+	fseek(fptr, 0, SEEK_END);
+	long length = ftell(fptr);
+	fseek(fptr, 0, SEEK_SET);
+	if (length > 0) {
+		buffer.resize(length);
+		if (fread(buffer.data(), 1, length, fptr) != (size_t)length) {
+			buffer.clear();
+			fclose(fptr);
+			return false;
+		}
+	}
+	fclose(fptr);
+	data = buffer.data();
+	size = buffer.size();
+	return true;
+}
+
+void MappedFile::close() {
+#ifndef WIN32
+	if (mapped) {
+		munmap((void*)data, size);
+	}
+#endif
+	mapped = false;
+	buffer.clear();
+	data = nullptr;
+	size = 0;
+}
+
+Reader MappedFile::reader() const {
+	return Reader(data, size);
+}
+
+}
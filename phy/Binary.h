@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+namespace phy {
+
+// 64 bit FNV-1a hash used to fingerprint technologies and layouts for the
+// on-disk caches. This is not cryptographic, it just needs to notice when
+// the inputs to a cached computation change.
+struct Hasher {
+	Hasher();
+	~Hasher();
+
+	uint64_t value;
+
+	void push(const void *data, size_t size);
+	void push(int32_t v);
+	void push(uint64_t v);
+	void push(bool v);
+	void push(float v);
+	void push(double v);
+	void push(const string &v);
+};
+
+// Serialize values into a little-endian byte buffer.
+struct Writer {
+	Writer();
+	~Writer();
+
+	vector<char> data;
+
+	void write(const void *ptr, size_t size);
+	void write(int32_t v);
+	void write(uint64_t v);
+	void write(double v);
+	void write(const string &v);
+
+	// Replace the file at path with data. The new contents are written to a
+	// temporary file in the same directory and renamed over path, so readers
+	// that have the old file open or mapped keep seeing the old contents.
+	bool save(string path) const;
+};
+
+// Read values out of a byte buffer written by Writer. Every read checks that
+// the data is there and returns false otherwise, after which the reader stays
+// in the failed state.
+struct Reader {
+	Reader();
+	Reader(const char *data, size_t size);
+	~Reader();
+
+	const char *data;
+	size_t size;
+	size_t pos;
+	bool failed;
+
+	bool read(void *ptr, size_t size);
+	bool read(int32_t *v);
+	bool read(uint64_t *v);
+	bool read(double *v);
+	bool read(string *v);
+
+	bool done() const;
+};
+
+// A read-only memory mapped file
+struct MappedFile {
+	MappedFile();
+	~MappedFile();
+
+	const char *data;
+	size_t size;
+
+	// only used when the platform can't map the file
+	vector<char> buffer;
+
+	bool open(string path);
+	void close();
+
+	Reader reader() const;
+
+private:
+	// mmap'd regions can't be copied
+	MappedFile(const MappedFile &);
+	MappedFile &operator=(const MappedFile &);
+
+	bool mapped;
+};
+
+}
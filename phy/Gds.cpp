@@ -0,0 +1,712 @@
+#include "Gds.h"
+#include "Parallel.h"
+#include "Binary.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <ctime>
+#include <thread>
+#include <map>
+
+using namespace std;
+
+namespace phy {
+
+// GDSII record types with their data type in the low byte
+enum {
+	GDS_HEADER = 0x0002,
+	GDS_BGNLIB = 0x0102,
+	GDS_LIBNAME = 0x0206,
+	GDS_UNITS = 0x0305,
+	GDS_ENDLIB = 0x0400,
+	GDS_BGNSTR = 0x0502,
+	GDS_STRNAME = 0x0606,
+	GDS_ENDSTR = 0x0700,
+	GDS_BOUNDARY = 0x0800,
+	GDS_SREF = 0x0A00,
+	GDS_TEXT = 0x0C00,
+	GDS_LAYER = 0x0D02,
+	GDS_DATATYPE = 0x0E02,
+	GDS_PATH = 0x0900,
+	GDS_AREF = 0x0B00,
+	GDS_COLROW = 0x1302,
+	GDS_WIDTH = 0x0F03,
+	GDS_XY = 0x1003,
+	GDS_ENDEL = 0x1100,
+	GDS_SNAME = 0x1206,
+	GDS_TEXTTYPE = 0x1602,
+	GDS_STRING = 0x1906,
+	GDS_STRANS = 0x1A01,
+	GDS_MAG = 0x1B05,
+	GDS_ANGLE = 0x1C05,
+	GDS_PATHTYPE = 0x2102,
+	GDS_BOX = 0x2D00,
+	GDS_BOXTYPE = 0x2E02,
+};
+
+// The largest number of points in a single XY record
+static const int gdsMaxPoints = 8191;
+
+static void put16(vector<char> &buf, int v) {
+	buf.push_back((char)((v >> 8) & 0xFF));
+	buf.push_back((char)(v & 0xFF));
+}
+
+static void put32(vector<char> &buf, int32_t v) {
+	uint32_t u = (uint32_t)v;
+	buf.push_back((char)((u >> 24) & 0xFF));
+	buf.push_back((char)((u >> 16) & 0xFF));
+	buf.push_back((char)((u >> 8) & 0xFF));
+	buf.push_back((char)(u & 0xFF));
+}
+
+// GDSII uses an excess-64 base-16 floating point format with a 56 bit
+// mantissa
+static void putReal(vector<char> &buf, double v) {
+	uint64_t bits = 0;
+	if (v != 0.0) {
+		uint64_t sign = v < 0.0 ? 1 : 0;
+		v = fabs(v);
+		int exp = 64;
+		while (v >= 1.0) {
+			v /= 16.0;
+			exp++;
+		}
+		while (v < 1.0/16.0) {
+			v *= 16.0;
+			exp--;
+		}
+		uint64_t mantissa = (uint64_t)llround(ldexp(v, 56));
+		if (mantissa >= ((uint64_t)1 << 56)) {
+			mantissa >>= 4;
+			exp++;
+		}
+		bits = (sign << 63) | ((uint64_t)(exp & 0x7F) << 56) | mantissa;
+	}
+	for (int i = 7; i >= 0; i--) {
+		buf.push_back((char)((bits >> (8*i)) & 0xFF));
+	}
+}
+
+static void putRecord(vector<char> &buf, int type, int length=0) {
+	put16(buf, 4+length);
+	put16(buf, type);
+}
+
+static void putInt16(vector<char> &buf, int type, int v) {
+	putRecord(buf, type, 2);
+	put16(buf, v);
+}
+
+static void putString(vector<char> &buf, int type, string v) {
+	if (v.size()%2 != 0) {
+		v.push_back('\0');
+	}
+	putRecord(buf, type, (int)v.size());
+	buf.insert(buf.end(), v.begin(), v.end());
+}
+
+static void putTime(vector<char> &buf, int type, const struct tm &t) {
+	int fields[6] = {t.tm_year+1900, t.tm_mon+1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec};
+	putRecord(buf, type, 24);
+	// modification time followed by access time
+	for (int i = 0; i < 12; i++) {
+		put16(buf, fields[i%6]);
+	}
+}
+
+static void putXY(vector<char> &buf, const vector<vec2i> &v) {
+	putRecord(buf, GDS_XY, 8*(int)v.size());
+	for (auto p = v.begin(); p != v.end(); p++) {
+		put32(buf, (*p)[0]);
+		put32(buf, (*p)[1]);
+	}
+}
+
+// Returns false if the polygon has too many points to be written
+static bool putBoundary(vector<char> &buf, const Paint &paint, vector<vec2i> v) {
+	// GDSII polygons are explicitly closed
+	v.push_back(v[0]);
+	if ((int)v.size() > gdsMaxPoints) {
+		printf("%s:%d error: polygon with %d points is too large for GDSII.\n", __FILE__, __LINE__, (int)v.size());
+		return false;
+	}
+	putRecord(buf, GDS_BOUNDARY);
+	putInt16(buf, GDS_LAYER, paint.major);
+	putInt16(buf, GDS_DATATYPE, paint.minor);
+	putXY(buf, v);
+	putRecord(buf, GDS_ENDEL);
+	return true;
+}
+
+static string cellName(const Library *lib, int macro) {
+	if (lib != nullptr and not lib->macros[macro].name.empty()) {
+		return lib->macros[macro].name;
+	}
+	return "cell" + to_string(macro);
+}
+
+// Serialize one cell into buf. Instances are only written when lib is given.
+// Returns false if some of the geometry couldn't be written.
+static bool encodeCell(vector<char> &buf, const Tech &tech, const Layout &cell, string name, const Library *lib, const struct tm &now) {
+	putTime(buf, GDS_BGNSTR, now);
+	putString(buf, GDS_STRNAME, name);
+
+	bool ok = true;
+	for (auto layer = cell.layers.begin(); layer != cell.layers.end(); layer++) {
+		if (layer->first < 0 or layer->first >= (int)tech.paint.size()) {
+			continue;
+		}
+		const Paint &paint = tech.paint[layer->first];
+
+		for (auto r = layer->second.geo.begin(); r != layer->second.geo.end(); r++) {
+			ok = putBoundary(buf, paint, {r->ll, vec2i(r->ur[0], r->ll[1]), r->ur, vec2i(r->ll[0], r->ur[1])}) and ok;
+		}
+
+		for (auto p = layer->second.poly.begin(); p != layer->second.poly.end(); p++) {
+			if (not p->v.empty()) {
+				ok = putBoundary(buf, paint, p->v) and ok;
+			}
+		}
+
+		for (auto l = layer->second.lbl.begin(); l != layer->second.lbl.end(); l++) {
+			putRecord(buf, GDS_TEXT);
+			putInt16(buf, GDS_LAYER, paint.major);
+			putInt16(buf, GDS_TEXTTYPE, paint.minor);
+			putXY(buf, vector<vec2i>(1, l->pos));
+			putString(buf, GDS_STRING, l->txt);
+			putRecord(buf, GDS_ENDEL);
+		}
+	}
+
+	if (lib != nullptr) {
+		for (auto i = cell.inst.begin(); i != cell.inst.end(); i++) {
+			if (i->macro < 0 or i->macro >= (int)lib->macros.size()) {
+				continue;
+			}
+
+			putRecord(buf, GDS_SREF);
+			putString(buf, GDS_SNAME, cellName(lib, i->macro));
+			// GDSII reflects across the x axis before rotating, so mirroring x is
+			// a reflection followed by a 180 degree rotation.
+			bool reflect = (i->dir[0] < 0) != (i->dir[1] < 0);
+			bool rotate = i->dir[0] < 0;
+			if (reflect or rotate) {
+				putRecord(buf, GDS_STRANS, 2);
+				put16(buf, reflect ? 0x8000 : 0);
+				if (rotate) {
+					putRecord(buf, GDS_ANGLE, 8);
+					putReal(buf, 180.0);
+				}
+			}
+			putXY(buf, vector<vec2i>(1, i->pos));
+			putRecord(buf, GDS_ENDEL);
+		}
+	}
+
+	putRecord(buf, GDS_ENDSTR);
+	return ok;
+}
+
+// Write the cells to path, encoding them in parallel batches so that memory
+// use is bounded by the batch rather than the whole library.
+static bool writeCells(string path, const Tech &tech, string libName, const vector<const Layout*> &cells, const vector<string> &names, const Library *lib) {
+	FILE *fptr = fopen(path.c_str(), "wb");
+	if (fptr == nullptr) {
+		printf("%s:%d error: unable to open file '%s' for writing.\n", __FILE__, __LINE__, path.c_str());
+		return false;
+	}
+
+	// localtime() isn't thread safe, so every cell shares this timestamp
+	time_t clock = time(nullptr);
+	struct tm now = *localtime(&clock);
+
+	vector<char> buf;
+	putInt16(buf, GDS_HEADER, 600);
+	putTime(buf, GDS_BGNLIB, now);
+	putString(buf, GDS_LIBNAME, libName.empty() ? "lib" : libName);
+	putRecord(buf, GDS_UNITS, 16);
+	// Tech::dbunit is the size of a database unit in micrometers, which is the
+	// user unit
+	putReal(buf, tech.dbunit);
+	putReal(buf, tech.dbunit*1e-6);
+	bool ok = fwrite(buf.data(), 1, buf.size(), fptr) == buf.size();
+
+	int threads = max(1, (int)thread::hardware_concurrency());
+	int batch = 16*threads;
+	// cleared when some geometry couldn't be encoded, the rest of the file is
+	// still written
+	bool complete = true;
+	vector<vector<char> > bufs;
+	for (int start = 0; ok and start < (int)cells.size(); start += batch) {
+		int count = min(batch, (int)cells.size()-start);
+		bufs.assign(count, vector<char>());
+		vector<char> encoded(count, 0);
+		parallelFor(count, [&](int i) {
+			encoded[i] = encodeCell(bufs[i], tech, *cells[start+i], names[start+i], lib, now);
+		}, threads);
+
+		for (int i = 0; ok and i < count; i++) {
+			complete = complete and encoded[i];
+			ok = fwrite(bufs[i].data(), 1, bufs[i].size(), fptr) == bufs[i].size();
+		}
+	}
+
+	buf.clear();
+	putRecord(buf, GDS_ENDLIB);
+	ok = ok and fwrite(buf.data(), 1, buf.size(), fptr) == buf.size();
+	ok = (fclose(fptr) == 0) and ok;
+	if (not ok) {
+		printf("%s:%d error: unable to write file '%s'.\n", __FILE__, __LINE__, path.c_str());
+	}
+	return ok and complete;
+}
+
+// Find every macro referenced from cell, directly or through other macros
+static void referencedMacros(const Library &lib, const Layout &cell, vector<bool> &used) {
+	for (auto i = cell.inst.begin(); i != cell.inst.end(); i++) {
+		if (i->macro >= 0 and i->macro < (int)lib.macros.size() and not used[i->macro]) {
+			used[i->macro] = true;
+			referencedMacros(lib, lib.macros[i->macro], used);
+		}
+	}
+}
+
+bool saveGDS(string path, const Layout &layout, const Library *lib, string libName) {
+	vector<const Layout*> cells;
+	vector<string> names;
+	if (lib != nullptr) {
+		vector<bool> used(lib->macros.size(), false);
+		referencedMacros(*lib, layout, used);
+		for (int i = 0; i < (int)used.size(); i++) {
+			if (used[i]) {
+				cells.push_back(&lib->macros[i]);
+				names.push_back(cellName(lib, i));
+			}
+		}
+	}
+	cells.push_back(&layout);
+	names.push_back(layout.name.empty() ? "top" : layout.name);
+
+	return writeCells(path, *layout.tech, libName, cells, names, lib);
+}
+
+bool saveGDS(string path, const Library &lib, string libName) {
+	vector<const Layout*> cells;
+	vector<string> names;
+	for (int i = 0; i < (int)lib.macros.size(); i++) {
+		cells.push_back(&lib.macros[i]);
+		names.push_back(cellName(&lib, i));
+	}
+
+	return writeCells(path, *lib.tech, libName, cells, names, &lib);
+}
+
+static int get16(const char *data) {
+	return (int16_t)(((uint16_t)(unsigned char)data[0] << 8) | (uint16_t)(unsigned char)data[1]);
+}
+
+static int32_t get32(const char *data) {
+	uint32_t u = 0;
+	for (int i = 0; i < 4; i++) {
+		u = (u << 8) | (uint32_t)(unsigned char)data[i];
+	}
+	return (int32_t)u;
+}
+
+static double getReal(const char *data) {
+	uint64_t bits = 0;
+	for (int i = 0; i < 8; i++) {
+		bits = (bits << 8) | (uint64_t)(unsigned char)data[i];
+	}
+	if ((bits & (((uint64_t)1 << 63) - 1)) == 0) {
+		return 0.0;
+	}
+	double mantissa = ldexp((double)(bits & (((uint64_t)1 << 56) - 1)), -56);
+	int exp = (int)((bits >> 56) & 0x7F) - 64;
+	double result = mantissa*pow(16.0, exp);
+	return (bits >> 63) ? -result : result;
+}
+
+static string getString(const char *data, int length) {
+	string result(data, length);
+	while (not result.empty() and result.back() == '\0') {
+		result.pop_back();
+	}
+	return result;
+}
+
+// A single record of a GDSII stream
+struct GdsRecord {
+	int type;
+	const char *data;
+	int length;
+};
+
+// Walk the records of a GDSII stream
+struct GdsCursor {
+	GdsCursor(const char *data, size_t size) {
+		this->data = data;
+		this->size = size;
+		this->pos = 0;
+	}
+	~GdsCursor() {}
+
+	const char *data;
+	size_t size;
+	size_t pos;
+
+	bool next(GdsRecord *record) {
+		if (size - pos < 4) {
+			return false;
+		}
+		int length = (int)(uint16_t)get16(data+pos);
+		if (length < 4 or size - pos < (size_t)length) {
+			return false;
+		}
+		record->type = (int)(uint16_t)get16(data+pos+2);
+		record->data = data+pos+4;
+		record->length = length-4;
+		pos += length;
+		return true;
+	}
+};
+
+// The location of a structure in the stream found during the first pass
+struct GdsStruct {
+	string name;
+	size_t begin;
+	size_t end;
+};
+
+// Everything the decoder needs to turn elements into layout
+struct GdsContext {
+	const Tech *tech;
+	// multiply file coordinates by this to get database units
+	double scale;
+	// (major, minor) -> paint index, only for the requested layers
+	map<pair<int, int>, int> layers;
+	// structure name -> index into Library::macros
+	map<string, int> macros;
+};
+
+static int scaled(const GdsContext &ctx, int32_t v) {
+	return ctx.scale == 1.0 ? v : (int)llround(v*ctx.scale);
+}
+
+static bool orientation(int reflect, double angle, vec2i *dir) {
+	int quarter = (int)llround(angle/90.0);
+	quarter = ((quarter%4) + 4)%4;
+	if (fabs(angle - 90.0*llround(angle/90.0)) > 1e-6 or quarter == 1 or quarter == 3) {
+		return false;
+	}
+	// reflect across the x axis, then rotate
+	*dir = vec2i(1, reflect ? -1 : 1);
+	if (quarter == 2) {
+		*dir = vec2i(-(*dir)[0], -(*dir)[1]);
+	}
+	return true;
+}
+
+// Decode the elements of a structure into layout
+static void decodeStruct(const GdsContext &ctx, const char *data, size_t size, Layout &layout) {
+	GdsCursor cursor(data, size);
+	GdsRecord rec;
+
+	int element = -1;
+	int draw = -1;
+	int layer = 0, datatype = 0;
+	int reflect = 0;
+	double angle = 0.0, mag = 1.0;
+	int width = 0, pathtype = 0;
+	int cols = 1, rows = 1;
+	string sname, text;
+	vector<vec2i> xy;
+
+	while (cursor.next(&rec)) {
+		switch (rec.type) {
+		case GDS_BOUNDARY: case GDS_BOX: case GDS_PATH: case GDS_TEXT: case GDS_SREF: case GDS_AREF:
+			element = rec.type;
+			draw = -1;
+			layer = datatype = 0;
+			reflect = 0;
+			angle = 0.0;
+			mag = 1.0;
+			width = pathtype = 0;
+			cols = rows = 1;
+			sname.clear();
+			text.clear();
+			xy.clear();
+			break;
+		case GDS_LAYER:
+			if (rec.length >= 2) layer = get16(rec.data);
+			break;
+		case GDS_DATATYPE: case GDS_TEXTTYPE: case GDS_BOXTYPE:
+			if (rec.length >= 2) datatype = get16(rec.data);
+			break;
+		case GDS_XY:
+			for (int i = 0; i+8 <= rec.length; i += 8) {
+				xy.push_back(vec2i(scaled(ctx, get32(rec.data+i)), scaled(ctx, get32(rec.data+i+4))));
+			}
+			break;
+		case GDS_SNAME:
+			sname = getString(rec.data, rec.length);
+			break;
+		case GDS_STRING:
+			text = getString(rec.data, rec.length);
+			break;
+		case GDS_STRANS:
+			if (rec.length >= 2) reflect = (get16(rec.data) & 0x8000) != 0;
+			break;
+		case GDS_ANGLE:
+			if (rec.length >= 8) angle = getReal(rec.data);
+			break;
+		case GDS_MAG:
+			if (rec.length >= 8) mag = getReal(rec.data);
+			break;
+		case GDS_WIDTH:
+			if (rec.length >= 4) width = abs(scaled(ctx, get32(rec.data)));
+			break;
+		case GDS_PATHTYPE:
+			if (rec.length >= 2) pathtype = get16(rec.data);
+			break;
+		case GDS_COLROW:
+			if (rec.length >= 4) {
+				cols = get16(rec.data);
+				rows = get16(rec.data+2);
+			}
+			break;
+		case GDS_ENDEL: {
+			if (element == GDS_BOUNDARY or element == GDS_BOX or element == GDS_PATH or element == GDS_TEXT) {
+				auto pos = ctx.layers.find(pair<int, int>(layer, datatype));
+				draw = pos == ctx.layers.end() ? -1 : pos->second;
+			}
+
+			if ((element == GDS_BOUNDARY or element == GDS_BOX) and draw >= 0 and xy.size() >= 4) {
+				if (xy.size() > 1 and xy.back() == xy[0]) {
+					xy.pop_back();
+				}
+				// Rectangles go straight into the geometry
+				Rect box(-1, xy[0], xy[0]);
+				for (auto p = xy.begin(); p != xy.end(); p++) {
+					box.bound(*p);
+				}
+				bool isRect = xy.size() == 4;
+				for (int i = 0; isRect and i < 4; i++) {
+					vec2i a = xy[i], b = xy[(i+1)%4];
+					isRect = (a[0] == b[0]) != (a[1] == b[1]);
+				}
+				if (isRect) {
+					layout.push(draw, box);
+				} else {
+					layout.push(draw, Poly(-1, xy));
+				}
+			} else if (element == GDS_PATH and draw >= 0 and not xy.empty()) {
+				// Only manhattan paths can be represented as rectangles. Segments
+				// are extended by half the width at the bends so that the outer
+				// corner is covered, the pathtype only applies at the two ends.
+				int half = width/2;
+				int extend = pathtype == 2 ? half : 0;
+				for (int i = 0; i+1 < (int)xy.size(); i++) {
+					vec2i a = xy[i], b = xy[i+1];
+					if (a[0] != b[0] and a[1] != b[1]) {
+						printf("%s:%d error: skipping non-manhattan path segment in '%s'.\n", __FILE__, __LINE__, layout.name.c_str());
+						continue;
+					}
+					int axis = a[0] == b[0] ? 1 : 0;
+					int extA = i == 0 ? extend : half;
+					int extB = i+2 == (int)xy.size() ? extend : half;
+					if (b[axis] < a[axis]) {
+						swap(extA, extB);
+					}
+					Rect r(-1, a, b);
+					r.normalize();
+					r.ll[axis] -= extA;
+					r.ur[axis] += extB;
+					r.ll[1-axis] -= half;
+					r.ur[1-axis] += half;
+					layout.push(draw, r);
+				}
+			} else if (element == GDS_TEXT and draw >= 0 and not xy.empty()) {
+				layout.label(draw, Label(-1, xy[0], text));
+			} else if ((element == GDS_SREF or element == GDS_AREF) and not xy.empty()) {
+				auto macro = ctx.macros.find(sname);
+				vec2i dir;
+				if (macro == ctx.macros.end()) {
+					printf("%s:%d error: reference to undefined structure '%s' in '%s'.\n", __FILE__, __LINE__, sname.c_str(), layout.name.c_str());
+				} else if (fabs(mag - 1.0) > 1e-9 or not orientation(reflect, angle, &dir)) {
+					printf("%s:%d error: unsupported transform of '%s' in '%s'.\n", __FILE__, __LINE__, sname.c_str(), layout.name.c_str());
+				} else if (element == GDS_SREF) {
+					layout.inst.push_back(Instance(macro->second, xy[0], dir));
+				} else if (xy.size() >= 3 and cols > 0 and rows > 0) {
+					// Array references are expanded into one instance per element
+					vec2i colStep = (xy[1] - xy[0])/cols;
+					vec2i rowStep = (xy[2] - xy[0])/rows;
+					for (int r = 0; r < rows; r++) {
+						for (int c = 0; c < cols; c++) {
+							layout.inst.push_back(Instance(macro->second, xy[0] + colStep*c + rowStep*r, dir));
+						}
+					}
+				}
+			}
+			element = -1;
+		} break;
+		default:
+			break;
+		}
+	}
+}
+
+bool loadGDS(Library &lib, string path, vector<int> layers) {
+	MappedFile file;
+	if (not file.open(path)) {
+		printf("%s:%d error: unable to open file '%s' for reading.\n", __FILE__, __LINE__, path.c_str());
+		return false;
+	}
+
+	GdsContext ctx;
+	ctx.tech = lib.tech;
+	ctx.scale = 1.0;
+
+	if (layers.empty()) {
+		for (int i = 0; i < (int)lib.tech->paint.size(); i++) {
+			layers.push_back(i);
+		}
+	}
+	for (auto l = layers.begin(); l != layers.end(); l++) {
+		if (*l >= 0 and *l < (int)lib.tech->paint.size()) {
+			const Paint &paint = lib.tech->paint[*l];
+			int draw = lib.tech->findPaint(paint.major, paint.minor);
+			if (draw == *l) {
+				ctx.layers.insert(pair<pair<int, int>, int>(pair<int, int>(paint.major, paint.minor), draw));
+			}
+		}
+	}
+
+	// Find the structures and the units
+	vector<GdsStruct> structs;
+	GdsCursor cursor(file.data, file.size);
+	GdsRecord rec;
+	bool done = false;
+	while (not done and cursor.next(&rec)) {
+		if (rec.type == GDS_UNITS and rec.length >= 16) {
+			double meters = getReal(rec.data+8);
+			double target = lib.tech->dbunit*1e-6;
+			if (meters > 0.0 and target > 0.0 and fabs(meters/target - 1.0) > 1e-9) {
+				ctx.scale = meters/target;
+			}
+		} else if (rec.type == GDS_BGNSTR) {
+			GdsStruct s;
+			s.begin = cursor.pos;
+			s.end = cursor.pos;
+			structs.push_back(s);
+		} else if (rec.type == GDS_STRNAME and not structs.empty()) {
+			structs.back().name = getString(rec.data, rec.length);
+		} else if (rec.type == GDS_ENDSTR and not structs.empty()) {
+			structs.back().end = cursor.pos;
+		} else if (rec.type == GDS_ENDLIB) {
+			done = true;
+		}
+	}
+	if (not done) {
+		printf("%s:%d error: '%s' is truncated or is not a GDSII file.\n", __FILE__, __LINE__, path.c_str());
+		return false;
+	}
+
+	// Assign every structure an index in the library before decoding so that
+	// references can be resolved in parallel
+	vector<int> index;
+	int next = (int)lib.macros.size();
+	for (auto s = structs.begin(); s != structs.end(); s++) {
+		int idx = lib.find(s->name);
+		if (idx < 0) {
+			auto pos = ctx.macros.find(s->name);
+			idx = pos != ctx.macros.end() ? pos->second : next++;
+		}
+		ctx.macros[s->name] = idx;
+		index.push_back(idx);
+	}
+
+	vector<Layout> cells(structs.size(), Layout(*lib.tech));
+	parallelFor((int)structs.size(), [&](int i) {
+		cells[i].name = structs[i].name;
+		decodeStruct(ctx, file.data + structs[i].begin, structs[i].end - structs[i].begin, cells[i]);
+	});
+
+	lib.macros.resize(next, Layout(*lib.tech));
+	for (int i = 0; i < (int)structs.size(); i++) {
+		lib.macros[index[i]] = cells[i];
+	}
+	lib.invalidate();
+	return true;
+}
+
+// FlatView only handles rectangles, so copy the polygons and labels of cell
+// and its instances into layout placed at pos + dir*x.
+static void flattenShapes(const Library &lib, const Layout &cell, vec2i pos, vec2i dir, Layout &layout) {
+	for (auto l = cell.layers.begin(); l != cell.layers.end(); l++) {
+		for (auto p = l->second.poly.begin(); p != l->second.poly.end(); p++) {
+			Poly gon = *p;
+			layout.push(l->first, gon.shift_inplace(pos, dir));
+		}
+		for (auto t = l->second.lbl.begin(); t != l->second.lbl.end(); t++) {
+			Label lbl = *t;
+			layout.label(l->first, lbl.shift_inplace(pos, dir));
+		}
+	}
+
+	for (auto i = cell.inst.begin(); i != cell.inst.end(); i++) {
+		if (i->macro >= 0 and i->macro < (int)lib.macros.size()) {
+			flattenShapes(lib, lib.macros[i->macro], pos + dir*i->pos, dir*i->dir, layout);
+		}
+	}
+}
+
+bool loadGDS(Layout &layout, string path, string name, vector<int> layers) {
+	Library lib(*layout.tech);
+	if (not loadGDS(lib, path, layers)) {
+		return false;
+	}
+
+	int top = -1;
+	if (name.empty()) {
+		// The top cell is the one that no other cell references. Writers don't
+		// agree on where it goes, so prefer the last one if there are several.
+		vector<bool> used(lib.macros.size(), false);
+		for (auto m = lib.macros.begin(); m != lib.macros.end(); m++) {
+			for (auto i = m->inst.begin(); i != m->inst.end(); i++) {
+				if (i->macro >= 0 and i->macro < (int)used.size()) {
+					used[i->macro] = true;
+				}
+			}
+		}
+		for (int i = (int)used.size()-1; i >= 0 and top < 0; i--) {
+			if (not used[i]) {
+				top = i;
+			}
+		}
+		if (top < 0) {
+			printf("%s:%d error: no top cell found in '%s'.\n", __FILE__, __LINE__, path.c_str());
+			return false;
+		}
+	} else {
+		top = lib.find(name);
+		if (top < 0) {
+			printf("%s:%d error: cell '%s' not found in '%s'.\n", __FILE__, __LINE__, name.c_str(), path.c_str());
+			return false;
+		}
+	}
+
+	const Layout &cell = lib.macros[top];
+	layout.clear();
+	layout.name = cell.name;
+	FlatView view(lib, cell);
+	view.visit([&](int draw, const Rect &rect) {
+		layout.push(draw, rect);
+	});
+	flattenShapes(lib, cell, vec2i(0, 0), vec2i(1, 1), layout);
+	return true;
+}
+
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+#include "Layout.h"
+#include "Library.h"
+
+using namespace std;
+
+namespace phy {
+
+// Write a single cell as a GDSII stream. Each Tech::paint layer is written
+// to its major/minor GDS layer and datatype. When lib is given, instances
+// are written as references and the macros they reference are written
+// along with the cell. Otherwise, instances are skipped. Returns false if
+// anything couldn't be written, such as a polygon with more points than a
+// GDSII record can hold.
+bool saveGDS(string path, const Layout &layout, const Library *lib=nullptr, string libName="");
+
+// Write every macro in the library as its own cell
+bool saveGDS(string path, const Library &lib, string libName="");
+
+// Read every cell of a GDSII file into the library, replacing macros with the
+// same name. GDS layers are resolved with Tech::findPaint(major, minor) and
+// only the paint layers listed in layers are kept, or all of them if layers
+// is empty. Structure references become instances of the referenced macro.
+bool loadGDS(Library &lib, string path, vector<int> layers=vector<int>());
+
+// Read one cell, or the top cell of the file if name is empty, flattening
+// its hierarchy into layout. The top cell is the one that no other cell in
+// the file references.
+bool loadGDS(Layout &layout, string path, string name="", vector<int> layers=vector<int>());
+
+}
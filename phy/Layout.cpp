@@ -1,6 +1,14 @@
 #include "Layout.h"
+#include "Parallel.h"
+#include "Binary.h"
 #include <algorithm>
 #include <limits>
+#include <set>
+#include <functional>
+#include <atomic>
+#include <map>
+#include <queue>
+#include <tuple>
 
 using namespace std;
 
@@ -657,6 +665,9 @@ bool operator<(const Bound &b, int p) {
 	return (b.pos < p);
 }
 
+// The last version given to a layer, see Layer::touch()
+static atomic<uint64_t> layerVersion(0);
+
 Layer::Layer(const Tech &tech) {
 	this->tech = &tech;
 	draw = Layer::UNKNOWN;
@@ -665,12 +676,14 @@ Layer::Layer(const Tech &tech) {
 	isSubstrate = false;
 	isPin = false;
 	isWell = false;
+	touch();
 }
 
 Layer::Layer(const Tech &tech, bool value) {
 	this->tech = &tech;
 	draw = Layer::UNKNOWN;
 	dirty = false;
+	touch();
 	isRouting = value;
 	isSubstrate = not value;
 	isPin = false;
@@ -691,11 +704,56 @@ Layer::Layer(const Tech &tech, int draw) {
 	this->isSubstrate = tech.isSubstrate(draw);
 	this->isPin = tech.isPin(draw);
 	this->isWell = tech.isWell(draw);
+	touch();
+}
+
+Layer::Layer(const Layer &copy) {
+	*this = copy;
+}
+
+Layer::Layer(Layer &&copy) {
+	*this = std::move(copy);
 }
 
 Layer::~Layer() {
 }
 
+Layer &Layer::operator=(const Layer &copy) {
+	tech = copy.tech;
+	draw = copy.draw;
+	geo = copy.geo;
+	poly = copy.poly;
+	lbl = copy.lbl;
+	box = copy.box;
+	isRouting = copy.isRouting;
+	isSubstrate = copy.isSubstrate;
+	isPin = copy.isPin;
+	isWell = copy.isWell;
+	version = copy.version;
+	cache.reset();
+	dirty = not geo.empty();
+	return *this;
+}
+
+Layer &Layer::operator=(Layer &&copy) {
+	tech = copy.tech;
+	draw = copy.draw;
+	geo = std::move(copy.geo);
+	poly = std::move(copy.poly);
+	lbl = std::move(copy.lbl);
+	box = copy.box;
+	isRouting = copy.isRouting;
+	isSubstrate = copy.isSubstrate;
+	isPin = copy.isPin;
+	isWell = copy.isWell;
+	version = copy.version;
+	cache = std::move(copy.cache);
+	dirty = copy.dirty;
+	// copy no longer has the contents of its version
+	copy.touch();
+	return *this;
+}
+
 bool Layer::isFill() const {
 	if (draw < 0) {
 		return false;
@@ -713,18 +771,22 @@ void Layer::clear() {
 	poly.clear();
 	lbl.clear();
 	box = Rect();
-	for (int i = 0; i < 2; i++) {
-		for (int j = 0; j < 2; j++) {
-			bound[i][j].clear();
-		}
-	}
+	cache.reset();
 	dirty = false;
+	touch();
+}
+
+void Layer::touch() {
+	version = layerVersion.fetch_add(1, memory_order_relaxed)+1;
 }
 
 void Layer::sync() const {
+	if (cache == nullptr) {
+		cache = make_unique<LayerBounds>();
+	}
 	for (int axis = 0; axis < 2; axis++) {
 		for (int fromTo = 0; fromTo < 2; fromTo++) {
-			vector<Bound> &bounds = bound[axis][fromTo];
+			vector<Bound> &bounds = cache->bound[axis][fromTo];
 
 			bounds.clear();
 			bounds.reserve(geo.size());
@@ -737,11 +799,17 @@ void Layer::sync() const {
 	dirty = false;
 }
 
+const vector<Bound> &Layer::bounds(int axis, int fromTo) const {
+	static const vector<Bound> none;
+	return cache == nullptr ? none : cache->bound[axis][fromTo];
+}
+
 void Layer::push(Rect rect) {
 	if (rect.ll[0] < rect.ur[0] and rect.ll[1] < rect.ur[1]) {
 		geo.push_back(rect);
 		box.bound(rect);
 		dirty = true;
+		touch();
 	}
 }
 
@@ -751,12 +819,14 @@ void Layer::push(vector<Rect> rects) {
 		box.bound(*r);
 	}
 	dirty = true;
+	touch();
 }
 
 void Layer::push(Poly gon) {
 	poly.push_back(gon);
 	box.bound(gon);
 	dirty = true;
+	touch();
 }
 
 void Layer::push(vector<Poly> gons) {
@@ -765,19 +835,23 @@ void Layer::push(vector<Poly> gons) {
 		box.bound(*g);
 	}
 	dirty = true;
+	touch();
 }
 
 void Layer::erase(int idx) {
 	geo.erase(geo.begin()+idx);
 	dirty = true;
+	touch();
 }
 
 void Layer::label(Label lbl) {
 	this->lbl.push_back(lbl);
+	touch();
 }
 
 void Layer::label(vector<Label> lbls) {
 	this->lbl.insert(this->lbl.end(), lbls.begin(), lbls.end());
+	touch();
 }
 
 void Layer::normalize() {
@@ -786,6 +860,7 @@ void Layer::normalize() {
 		push(r);
 		if (poly[i].empty()) {
 			poly.erase(poly.begin()+i);
+			touch();
 		}
 	}
 }
@@ -838,6 +913,7 @@ Layer &Layer::shift_inplace(vec2i pos, vec2i dir) {
 	}
 	box.shift_inplace(pos, dir);
 	dirty = true;
+	touch();
 	return *this;
 }
 
@@ -963,6 +1039,15 @@ bool Layer::overlaps(const Layer &l0) const {
 	return false;
 }
 
+vector<int> Layer::remap(const Mapping<int> &m) const {
+	vector<int> result;
+	result.reserve(geo.size());
+	for (auto r = geo.begin(); r != geo.end(); r++) {
+		result.push_back(m.map(r->net));
+	}
+	return result;
+}
+
 void Layer::print() const {
 	printf("layer %s(%d)\n", (draw < 0 ? "" : tech->paint[draw].name.c_str()), draw);
 	int j = 0;
@@ -1096,6 +1181,101 @@ Layer not_interact(const Layer &l0, const Layer &l1) {
 	return result;
 }
 
+Layer difference(const Layer &l0, const Layer &l1) {
+	Layer result(*l0.tech);
+	result.draw = l0.draw;
+	result.isRouting = l0.isRouting and not l1.isRouting;
+	result.isSubstrate = l0.isSubstrate or not l1.isSubstrate;
+	result.isPin = l0.isPin;
+
+	vector<Rect> pieces, next;
+	for (auto r0 = l0.geo.begin(); r0 != l0.geo.end(); r0++) {
+		pieces.assign(1, *r0);
+		for (auto r1 = l1.geo.begin(); r1 != l1.geo.end() and not pieces.empty(); r1++) {
+			next.clear();
+			for (auto p = pieces.begin(); p != pieces.end(); p++) {
+				if (p->ll[0] >= r1->ur[0] or r1->ll[0] >= p->ur[0] or p->ll[1] >= r1->ur[1] or r1->ll[1] >= p->ur[1]) {
+					next.push_back(*p);
+					continue;
+				}
+
+				// the full width below and above r1, then the left and right
+				// sides in between
+				int lo = max(p->ll[1], r1->ll[1]);
+				int hi = min(p->ur[1], r1->ur[1]);
+				if (p->ll[1] < r1->ll[1]) {
+					next.push_back(Rect(p->net, p->ll, vec2i(p->ur[0], r1->ll[1])));
+				}
+				if (r1->ur[1] < p->ur[1]) {
+					next.push_back(Rect(p->net, vec2i(p->ll[0], r1->ur[1]), p->ur));
+				}
+				if (p->ll[0] < r1->ll[0]) {
+					next.push_back(Rect(p->net, vec2i(p->ll[0], lo), vec2i(r1->ll[0], hi)));
+				}
+				if (r1->ur[0] < p->ur[0]) {
+					next.push_back(Rect(p->net, vec2i(r1->ur[0], lo), vec2i(p->ur[0], hi)));
+				}
+			}
+			swap(pieces, next);
+		}
+		for (auto p = pieces.begin(); p != pieces.end(); p++) {
+			result.push(*p);
+		}
+	}
+
+	for (auto b0 = l0.lbl.begin(); b0 != l0.lbl.end(); b0++) {
+		bool found = false;
+		for (auto r1 = l1.geo.begin(); r1 != l1.geo.end() and not found; r1++) {
+			found = r1->contains(b0->pos, false);
+		}
+		if (not found) {
+			result.label(*b0);
+		}
+	}
+
+	return result;
+}
+
+Layer and_interact(const Layer &l0, const Layer &l1, const Layer &l2) {
+	Layer result(*l0.tech);
+	result.draw = l0.draw;
+	result.isRouting = l0.isRouting and l1.isRouting;
+	result.isSubstrate = l0.isSubstrate or l1.isSubstrate;
+	for (auto r0 = l0.geo.begin(); r0 != l0.geo.end(); r0++) {
+		for (auto r1 = l1.geo.begin(); r1 != l1.geo.end(); r1++) {
+			if (not r0->overlaps(*r1)) {
+				continue;
+			}
+
+			Rect r(r0->net, max(r0->ll, r1->ll), min(r0->ur, r1->ur));
+			if (r.ll[0] >= r.ur[0] or r.ll[1] >= r.ur[1]) {
+				continue;
+			}
+			for (auto r2 = l2.geo.begin(); r2 != l2.geo.end(); r2++) {
+				if (r.overlaps(*r2)) {
+					result.push(r);
+					break;
+				}
+			}
+		}
+	}
+
+	for (auto b0 = l0.lbl.begin(); b0 != l0.lbl.end(); b0++) {
+		bool found = false;
+		for (auto r1 = l1.geo.begin(); r1 != l1.geo.end() and not found; r1++) {
+			found = r1->contains(b0->pos);
+		}
+		for (auto r2 = l2.geo.begin(); r2 != l2.geo.end() and found; r2++) {
+			if (r2->contains(b0->pos)) {
+				result.label(*b0);
+				break;
+			}
+		}
+	}
+
+	return result;
+}
+
 Layer operator|(const Layer &l0, const Layer &l1) {
 	//l0.sync();
 	//l1.sync();
@@ -1134,6 +1314,317 @@ Layer operator~(const Layer &l) {
 	return result;
 }
 
+Layer intersect(const vector<const Layer*> &layers) {
+	const Layer &l0 = *layers[0];
+	Layer result(*l0.tech);
+	result.draw = l0.draw;
+	result.isRouting = l0.isRouting;
+	result.isSubstrate = l0.isSubstrate;
+	result.isPin = l0.isPin;
+	result.isWell = l0.isWell;
+	for (int i = 1; i < (int)layers.size(); i++) {
+		result.isRouting = result.isRouting and layers[i]->isRouting;
+		result.isSubstrate = result.isSubstrate or layers[i]->isSubstrate;
+		result.isPin = result.isPin or layers[i]->isPin;
+		result.isWell = result.isWell and layers[i]->isWell;
+	}
+
+	for (auto b0 = l0.lbl.begin(); b0 != l0.lbl.end(); b0++) {
+		bool found = true;
+		for (int i = 1; i < (int)layers.size() and found; i++) {
+			found = false;
+			for (auto r = layers[i]->geo.begin(); r != layers[i]->geo.end() and not found; r++) {
+				found = r->contains(b0->pos);
+			}
+		}
+		if (found) {
+			result.label(*b0);
+		}
+	}
+
+	// Only rectangles that overlap the bounding box of every operand can
+	// contribute to the result.
+	vec2i lo(numeric_limits<int>::min(), numeric_limits<int>::min());
+	vec2i hi(numeric_limits<int>::max(), numeric_limits<int>::max());
+	for (int i = 0; i < (int)layers.size(); i++) {
+		if (layers[i]->geo.empty()) {
+			return result;
+		}
+		Rect box = layers[i]->geo[0];
+		for (auto r = layers[i]->geo.begin()+1; r != layers[i]->geo.end(); r++) {
+			box.bound(*r);
+		}
+		lo = max(lo, box.ll);
+		hi = min(hi, box.ur);
+	}
+	if (lo[0] >= hi[0] or lo[1] >= hi[1]) {
+		return result;
+	}
+
+	vector<vector<Rect> > cand(layers.size());
+	for (int i = 0; i < (int)layers.size(); i++) {
+		for (auto r = layers[i]->geo.begin(); r != layers[i]->geo.end(); r++) {
+			if (r->ll[0] < hi[0] and lo[0] < r->ur[0] and r->ll[1] < hi[1] and lo[1] < r->ur[1]) {
+				cand[i].push_back(*r);
+			}
+		}
+		if (cand[i].empty()) {
+			return result;
+		}
+	}
+
+	vector<int> order;
+	for (int i = 0; i < (int)layers.size(); i++) {
+		order.push_back(i);
+	}
+	stable_sort(order.begin(), order.end(), [&](int i, int j) {
+		return cand[i].size() < cand[j].size();
+	});
+
+	// Every piece comes from exactly one rectangle of layers[0], so it takes
+	// its net from that rectangle regardless of the order.
+	vector<Rect> curr = cand[order[0]], next;
+	for (int k = 1; k < (int)order.size(); k++) {
+		int i = order[k];
+		next.clear();
+		for (auto r0 = curr.begin(); r0 != curr.end(); r0++) {
+			for (auto r1 = cand[i].begin(); r1 != cand[i].end(); r1++) {
+				vec2i ll = max(r0->ll, r1->ll);
+				vec2i ur = min(r0->ur, r1->ur);
+				if (ll[0] < ur[0] and ll[1] < ur[1]) {
+					next.push_back(Rect(i == 0 ? r1->net : r0->net, ll, ur));
+				}
+			}
+		}
+		if (next.empty()) {
+			return result;
+		}
+		swap(curr, next);
+	}
+
+	result.push(curr);
+	return result;
+}
+
+Layer unite(const vector<const Layer*> &layers) {
+	const Layer &l0 = *layers[0];
+	Layer result(*l0.tech);
+	result.draw = l0.draw;
+	result.isRouting = l0.isRouting;
+	result.isSubstrate = l0.isSubstrate;
+	for (int i = 1; i < (int)layers.size(); i++) {
+		result.isRouting = result.isRouting and layers[i]->isRouting;
+		result.isSubstrate = result.isSubstrate or layers[i]->isSubstrate;
+	}
+	for (int i = 0; i < (int)layers.size(); i++) {
+		result.label(layers[i]->lbl);
+	}
+
+	// Each operand's rectangles ordered by their left edge. A synced operand
+	// already has this order in its bounds.
+	vector<vector<int> > order(layers.size());
+	for (int i = 0; i < (int)layers.size(); i++) {
+		const Layer &l = *layers[i];
+		vector<int> &idx = order[i];
+		idx.reserve(l.geo.size());
+		if (not l.dirty and l.bounds(0, 0).size() == l.geo.size()) {
+			for (auto b = l.bounds(0, 0).begin(); b != l.bounds(0, 0).end(); b++) {
+				idx.push_back(b->idx);
+			}
+		} else {
+			for (int j = 0; j < (int)l.geo.size(); j++) {
+				idx.push_back(j);
+			}
+			stable_sort(idx.begin(), idx.end(), [&l](int a, int b) {
+				return l.geo[a].ll[0] < l.geo[b].ll[0];
+			});
+		}
+	}
+
+	// k-way merge of the operands by left edge: {x, {operand, position}}
+	typedef pair<int, pair<int, int> > Head;
+	priority_queue<Head, vector<Head>, greater<Head> > heads;
+	for (int i = 0; i < (int)layers.size(); i++) {
+		if (not order[i].empty()) {
+			heads.push(Head(layers[i]->geo[order[i][0]].ll[0], {i, 0}));
+		}
+	}
+
+	// right edges of the rectangles that the sweep line is inside of: {x, net, y0, y1}
+	typedef tuple<int, int, int, int> Tail;
+	priority_queue<Tail, vector<Tail>, greater<Tail> > tails;
+
+	// for each net, the vertical spans of the rectangles under the sweep line
+	// and the strips of their union that are still open, keyed by span and
+	// storing where they started.
+	map<int, multiset<pair<int, int> > > active;
+	map<int, map<pair<int, int>, int> > strips;
+	set<int> changed;
+	vector<pair<int, int> > cover;
+
+	while (not heads.empty() or not tails.empty()) {
+		int x = numeric_limits<int>::max();
+		if (not heads.empty()) {
+			x = min(x, heads.top().first);
+		}
+		if (not tails.empty()) {
+			x = min(x, get<0>(tails.top()));
+		}
+
+		while (not tails.empty() and get<0>(tails.top()) == x) {
+			const Tail &t = tails.top();
+			auto a = active.find(get<1>(t));
+			a->second.erase(a->second.find({get<2>(t), get<3>(t)}));
+			changed.insert(get<1>(t));
+			tails.pop();
+		}
+		while (not heads.empty() and heads.top().first == x) {
+			int i = heads.top().second.first;
+			int j = heads.top().second.second;
+			heads.pop();
+			const Rect &r = layers[i]->geo[order[i][j]];
+			active[r.net].insert({r.ll[1], r.ur[1]});
+			tails.push(Tail(r.ur[0], r.net, r.ll[1], r.ur[1]));
+			changed.insert(r.net);
+			if (++j < (int)order[i].size()) {
+				heads.push(Head(layers[i]->geo[order[i][j]].ll[0], {i, j}));
+			}
+		}
+
+		// Close the strips whose span changed and open the new ones. Strips
+		// that keep the same span continue, so each output rectangle is as
+		// wide as possible.
+		for (auto n = changed.begin(); n != changed.end(); n++) {
+			auto a = active.find(*n);
+			cover.clear();
+			for (auto s = a->second.begin(); s != a->second.end(); s++) {
+				if (not cover.empty() and s->first <= cover.back().second) {
+					cover.back().second = max(cover.back().second, s->second);
+				} else {
+					cover.push_back(*s);
+				}
+			}
+			if (a->second.empty()) {
+				active.erase(a);
+			}
+
+			map<pair<int, int>, int> &open = strips[*n];
+			for (auto s = open.begin(); s != open.end(); ) {
+				if (binary_search(cover.begin(), cover.end(), s->first)) {
+					s++;
+					continue;
+				}
+				result.push(Rect(*n, vec2i(s->second, s->first.first), vec2i(x, s->first.second)));
+				s = open.erase(s);
+			}
+			for (auto c = cover.begin(); c != cover.end(); c++) {
+				open.insert({*c, x});
+			}
+			if (open.empty()) {
+				strips.erase(*n);
+			}
+		}
+		changed.clear();
+	}
+	return result;
+}
+
+Layer material(const vector<const Layer*> &draw, const vector<const Layer*> &mask, const vector<const Layer*> &excl) {
+	Layer result(*draw[0]->tech);
+	result.draw = draw.back()->draw;
+	// the flags that the chain of operators would have produced
+	for (int i = 0; i < (int)draw.size(); i++) {
+		result.isSubstrate = result.isSubstrate or draw[i]->isSubstrate;
+	}
+	for (int i = 0; i < (int)mask.size(); i++) {
+		result.isSubstrate = result.isSubstrate or mask[i]->isSubstrate;
+		result.isPin = result.isPin or mask[i]->isPin;
+	}
+	for (int i = 0; i < (int)excl.size(); i++) {
+		result.isSubstrate = result.isSubstrate or not excl[i]->isSubstrate;
+	}
+
+	for (int i = 0; i < (int)draw.size(); i++) {
+		result.push(draw[i]->geo);
+	}
+	result.merge();
+
+	vector<Rect> src, pieces, next;
+	swap(src, result.geo);
+	result.box = Rect();
+	for (auto r0 = src.begin(); r0 != src.end(); r0++) {
+		pieces.assign(1, *r0);
+		for (int i = 0; i < (int)mask.size() and not pieces.empty(); i++) {
+			next.clear();
+			for (auto p = pieces.begin(); p != pieces.end(); p++) {
+				for (auto r1 = mask[i]->geo.begin(); r1 != mask[i]->geo.end(); r1++) {
+					vec2i ll = max(p->ll, r1->ll);
+					vec2i ur = min(p->ur, r1->ur);
+					if (ll[0] < ur[0] and ll[1] < ur[1]) {
+						next.push_back(Rect(p->net, ll, ur));
+					}
+				}
+			}
+			swap(pieces, next);
+		}
+
+		for (int i = 0; i < (int)excl.size() and not pieces.empty(); i++) {
+			for (auto r1 = excl[i]->geo.begin(); r1 != excl[i]->geo.end() and not pieces.empty(); r1++) {
+				next.clear();
+				for (auto p = pieces.begin(); p != pieces.end(); p++) {
+					if (p->ll[0] >= r1->ur[0] or r1->ll[0] >= p->ur[0] or p->ll[1] >= r1->ur[1] or r1->ll[1] >= p->ur[1]) {
+						next.push_back(*p);
+						continue;
+					}
+
+					// same split as difference()
+					int lo = max(p->ll[1], r1->ll[1]);
+					int hi = min(p->ur[1], r1->ur[1]);
+					if (p->ll[1] < r1->ll[1]) {
+						next.push_back(Rect(p->net, p->ll, vec2i(p->ur[0], r1->ll[1])));
+					}
+					if (r1->ur[1] < p->ur[1]) {
+						next.push_back(Rect(p->net, vec2i(p->ll[0], r1->ur[1]), p->ur));
+					}
+					if (p->ll[0] < r1->ll[0]) {
+						next.push_back(Rect(p->net, vec2i(p->ll[0], lo), vec2i(r1->ll[0], hi)));
+					}
+					if (r1->ur[0] < p->ur[0]) {
+						next.push_back(Rect(p->net, vec2i(r1->ur[0], lo), vec2i(p->ur[0], hi)));
+					}
+				}
+				swap(pieces, next);
+			}
+		}
+
+		for (auto p = pieces.begin(); p != pieces.end(); p++) {
+			result.push(*p);
+		}
+	}
+
+	for (int i = 0; i < (int)draw.size(); i++) {
+		for (auto b0 = draw[i]->lbl.begin(); b0 != draw[i]->lbl.end(); b0++) {
+			bool found = true;
+			for (int j = 0; j < (int)mask.size() and found; j++) {
+				found = false;
+				for (auto r1 = mask[j]->geo.begin(); r1 != mask[j]->geo.end() and not found; r1++) {
+					found = r1->contains(b0->pos);
+				}
+			}
+			for (int j = 0; j < (int)excl.size() and found; j++) {
+				for (auto r1 = excl[j]->geo.begin(); r1 != excl[j]->geo.end() and found; r1++) {
+					found = not r1->contains(b0->pos, false);
+				}
+			}
+			if (found) {
+				result.label(*b0);
+			}
+		}
+	}
+
+	return result;
+}
+
 Evaluation::Evaluation(const Tech &tech) : empty(tech) {
 	this->layout = nullptr;
 }
@@ -1170,7 +1661,7 @@ void Evaluation::init() {
 	}*/
 }
 
-bool Evaluation::has(int idx) {
+bool Evaluation::has(int idx) const {
 	if (idx >= 0) {
 		return (layout->find(idx) != layout->layers.end());
 	}
@@ -1192,6 +1683,19 @@ const Layer &Evaluation::at(int idx) const {
 	}
 }
 
+void Evaluation::sync() const {
+	for (auto i = layout->layers.begin(); i != layout->layers.end(); i++) {
+		if (i->second.dirty) {
+			i->second.sync();
+		}
+	}
+	for (auto i = layers.begin(); i != layers.end(); i++) {
+		if (i->second.dirty) {
+			i->second.sync();
+		}
+	}
+}
+
 Layer &Evaluation::set(int idx) {
 	return layers.insert(pair<int, Layer>(idx, Layer(*layout->tech, idx))).first->second;
 }
@@ -1213,8 +1717,23 @@ void Evaluation::evaluate() {
 
 			switch (rule.type) {
 			case Rule::NOT: set(i->first) = ~at(arg[0]); break;
-			case Rule::AND: set(i->first) = at(arg[0]) & at(arg[1]); break;
-			case Rule::OR:  set(i->first) = at(arg[0]) | at(arg[1]); break;
+			case Rule::AND:
+			case Rule::OR: {
+				vector<const Layer*> ops;
+				for (auto j = arg.begin(); j != arg.end(); j++) {
+					ops.push_back(&at(*j));
+				}
+				Layer result = rule.type == Rule::AND ? intersect(ops) : unite(ops);
+				set(i->first) = result;
+			} break;
+			case Rule::DIFFERENCE: {
+				Layer result = difference(at(arg[0]), at(arg[1]));
+				for (int j = 2; j < (int)arg.size(); j++) {
+					result = difference(result, at(arg[j]));
+				}
+				set(i->first) = result;
+			} break;
+			case Rule::AND_INTERACT: set(i->first) = and_interact(at(arg[0]), at(arg[1]), at(arg[2])); break;
 			case Rule::INTERACT: set(i->first) = interact(at(arg[0]), at(arg[1])); break;
 			case Rule::NOT_INTERACT: set(i->first) = not_interact(at(arg[0]), at(arg[1])); break;
 			default: printf("%s:%d error: unsupported operation (rule[%d].type=%d).\n", __FILE__, __LINE__, flip(i->first), rule.type);
@@ -1251,18 +1770,22 @@ Net::Net(string name) {
 Net::~Net() {
 }
 
-void Net::set(string name) {
+void Net::set(string_view name) {
 	auto pos = std::lower_bound(names.begin(), names.end(), name);
 	if (pos == names.end() or *pos != name) {
-		names.insert(pos, name);
+		names.insert(pos, string(name));
 	}
 }
 
-bool Net::has(string name) const {
+bool Net::has(string_view name) const {
 	auto pos = std::lower_bound(names.begin(), names.end(), name);
 	return (pos != names.end() and *pos == name);
 }
 
+size_t NameHash::operator()(string_view name) const {
+	return hash<string_view>()(name);
+}
+
 Instance::Instance(int macro, vec2i pos, vec2i dir) {
 	this->macro = macro;
 	this->pos = pos;
@@ -1278,62 +1801,220 @@ Instance &Instance::shift_inplace(vec2i pos, vec2i dir) {
 	return *this;
 }
 
-Layout::Layout(const Tech &tech) {
+LayerTable::LayerTable(const Tech &tech) {
 	this->tech = &tech;
+	base = 0;
+	count = 0;
 }
 
-Layout::~Layout() {
+LayerTable::~LayerTable() {
 }
 
-map<int, Layer>::const_iterator Layout::find(int draw) const {
-	return layers.find(draw);
+int LayerTable::size() const {
+	return count;
 }
 
-map<int, Layer>::iterator Layout::find(int draw) {
-	return layers.find(draw);
+bool LayerTable::empty() const {
+	return count == 0;
 }
 
-map<int, Layer>::iterator Layout::at(int draw) {
-	auto result = layers.insert(pair<int, Layer>(draw, Layer(*tech, draw)));
-	return result.first;
+void LayerTable::clear() {
+	base = 0;
+	slots.clear();
+	present.clear();
+	count = 0;
 }
 
-Layer Layout::get(Level level) {
-	const Material &mat = tech->at(level);
+LayerTable::iterator LayerTable::begin() {
+	return iterator(this, next(0));
+}
+
+LayerTable::iterator LayerTable::end() {
+	return iterator(this, (int)slots.size());
+}
+
+LayerTable::const_iterator LayerTable::begin() const {
+	return const_iterator(this, next(0));
+}
+
+LayerTable::const_iterator LayerTable::end() const {
+	return const_iterator(this, (int)slots.size());
+}
+
+LayerTable::iterator LayerTable::find(int draw) {
+	int slot = draw+base;
+	if (slot < 0 or slot >= (int)slots.size() or ((present[slot>>6]>>(slot&63))&1) == 0) {
+		return end();
+	}
+	return iterator(this, slot);
+}
+
+LayerTable::const_iterator LayerTable::find(int draw) const {
+	int slot = draw+base;
+	if (slot < 0 or slot >= (int)slots.size() or ((present[slot>>6]>>(slot&63))&1) == 0) {
+		return end();
+	}
+	return const_iterator(this, slot);
+}
 
-	auto draw = layers.find(mat.draw);
-	auto label = layers.find(mat.label);
-	if (draw == layers.end() and label == layers.end()) {
-		return Layer(*tech);
+pair<LayerTable::iterator, bool> LayerTable::insert(value_type layer) {
+	int slot = layer.first+base;
+	if (slot < 0) {
+		// Make room for more operations in front, this only happens a few times
+		// per layout since materials rarely reference operations.
+		int shift = -slot;
+		vector<value_type> fill;
+		for (int i = 0; i < shift; i++) {
+			fill.push_back(value_type(layer.first+i, Layer(*tech)));
+		}
+		slots.insert(slots.begin(), fill.begin(), fill.end());
+
+		vector<uint64_t> prev = present;
+		present.assign((slots.size()+63)/64, 0);
+		for (int i = 0; i < (int)prev.size()*64; i++) {
+			if ((prev[i>>6]>>(i&63))&1) {
+				present[(i+shift)>>6] |= (uint64_t)1 << ((i+shift)&63);
+			}
+		}
+		base += shift;
+		slot = 0;
+	} else if (slot >= (int)slots.size()) {
+		slots.reserve(slot+1);
+		for (int i = (int)slots.size(); i <= slot; i++) {
+			slots.push_back(value_type(i-base, Layer(*tech)));
+		}
+		present.resize((slots.size()+63)/64, 0);
 	}
 
-	Layer result(*tech);
-	if (label != layers.end()) {
-		result = result | label->second;
-		result.draw = mat.label;
+	if ((present[slot>>6]>>(slot&63))&1) {
+		return pair<iterator, bool>(iterator(this, slot), false);
 	}
-	if (draw != layers.end()) {
-		result = result | draw->second;
-		result.draw = mat.draw;
+
+	slots[slot].second = std::move(layer.second);
+	present[slot>>6] |= (uint64_t)1 << (slot&63);
+	count++;
+	return pair<iterator, bool>(iterator(this, slot), true);
+}
+
+LayerTable::iterator LayerTable::erase(iterator pos) {
+	int slot = pos.slot;
+	present[slot>>6] &= ~((uint64_t)1 << (slot&63));
+	slots[slot].second = Layer(*tech);
+	count--;
+	return iterator(this, next(slot+1));
+}
+
+int LayerTable::erase(int draw) {
+	auto pos = find(draw);
+	if (pos == end()) {
+		return 0;
 	}
+	erase(pos);
+	return 1;
+}
 
-	for (auto i = mat.mask.begin(); i != mat.mask.end(); i++) {
-		auto mask = layers.find(*i);
-		if (mask == layers.end()) {
-			return Layer(*tech);
+int LayerTable::next(int slot) const {
+	while (slot < (int)slots.size()) {
+		uint64_t word = present[slot>>6] >> (slot&63);
+		if (word != 0) {
+			return slot + countr_zero(word);
 		}
+		slot = (slot|63)+1;
+	}
+	return (int)slots.size();
+}
+
+CachedLayer::CachedLayer(const Tech &tech) : layer(tech) {
+}
+
+CachedLayer::~CachedLayer() {
+}
 
-		result = result & mask->second;
+Layout::Layout(const Tech &tech) : layers(tech) {
+	this->tech = &tech;
+	indexed = 0;
+}
+
+Layout::~Layout() {
+}
+
+LayerTable::const_iterator Layout::find(int draw) const {
+	return layers.find(draw);
+}
+
+LayerTable::iterator Layout::find(int draw) {
+	return layers.find(draw);
+}
+
+LayerTable::iterator Layout::at(int draw) {
+	auto pos = layers.find(draw);
+	if (pos == layers.end()) {
+		pos = layers.insert(LayerTable::value_type(draw, Layer(*tech, draw))).first;
 	}
+	return pos;
+}
+
+const Layer &Layout::get(Level level) {
+	const Material &mat = tech->at(level);
+
+	// The layers this material is built from in the order of
+	// CachedLayer::sources
+	int count = 2 + (int)mat.mask.size() + (int)mat.excl.size();
+	auto source = [&](int i) -> const Layer* {
+		int draw = -1;
+		if (i == 0) {
+			draw = mat.draw;
+		} else if (i == 1) {
+			draw = mat.label;
+		} else if (i-2 < (int)mat.mask.size()) {
+			draw = mat.mask[i-2];
+		} else {
+			draw = mat.excl[i-2-(int)mat.mask.size()];
+		}
+		auto pos = layers.find(draw);
+		return pos == layers.end() ? nullptr : &pos->second;
+	};
 
-	for (auto i = mat.excl.begin(); i != mat.excl.end(); i++) {
-		auto excl = layers.find(*i);
-		if (excl != layers.end()) {
-			result = result & ~excl->second;
+	auto cached = materials.find(level);
+	if (cached != materials.end()) {
+		bool valid = true;
+		for (int i = 0; i < count and valid; i++) {
+			const Layer *layer = source(i);
+			valid = (layer == nullptr ? 0 : layer->version) == cached->second.sources[i];
 		}
+		if (valid) {
+			return cached->second.layer;
+		}
+	} else {
+		cached = materials.insert(pair<Level, CachedLayer>(level, CachedLayer(*tech))).first;
 	}
 
-	return result;
+	vector<uint64_t> &sources = cached->second.sources;
+	sources.assign(count, 0);
+	vector<const Layer*> draw, mask, excl;
+	for (int i = 0; i < count; i++) {
+		const Layer *layer = source(i);
+		if (layer != nullptr) {
+			sources[i] = layer->version;
+		}
+		if (i < 2) {
+			// the label layer goes first so that draw takes precedence
+			if (layer != nullptr) {
+				draw.insert(draw.begin(), layer);
+			}
+		} else if (i-2 < (int)mat.mask.size()) {
+			mask.push_back(layer);
+		} else if (layer != nullptr) {
+			excl.push_back(layer);
+		}
+	}
+
+	if (draw.empty() or std::find(mask.begin(), mask.end(), nullptr) != mask.end()) {
+		cached->second.layer = Layer(*tech);
+	} else {
+		cached->second.layer = material(draw, mask, excl);
+	}
+	return cached->second.layer;
 }
 
 void Layout::push(int layer, Rect rect) {
@@ -1591,17 +2272,47 @@ void Layout::push(Instance inst, Rect box) {
 	this->box.bound(box.shift(inst.pos, inst.dir));
 }
 
-int Layout::netAt(string name) {
-	for (int i = 0; i < (int)nets.size(); i++) {
-		if (nets[i].has(name)) {
-			return i;
-		}
+int Layout::netAt(string_view name) {
+	indexNets();
+
+	auto pos = netIndex.find(name);
+	if (pos != netIndex.end()) {
+		return pos->second;
 	}
+
 	int result = (int)nets.size();
-	nets.push_back(name);
+	nets.push_back(Net(string(name)));
+	netIndex.emplace(string(name), result);
+	indexed++;
 	return result;
 }
 
+void Layout::nameNet(int net, string_view name) {
+	nets[net].set(name);
+	if (net >= indexed) {
+		return;
+	}
+
+	auto pos = netIndex.find(name);
+	if (pos == netIndex.end()) {
+		netIndex.emplace(string(name), net);
+	} else if (net < pos->second) {
+		pos->second = net;
+	}
+}
+
+void Layout::indexNets(bool reset) {
+	if (reset or indexed > (int)nets.size()) {
+		netIndex.clear();
+		indexed = 0;
+	}
+	for (; indexed < (int)nets.size(); indexed++) {
+		for (auto n = nets[indexed].names.begin(); n != nets[indexed].names.end(); n++) {
+			netIndex.emplace(*n, indexed);
+		}
+	}
+}
+
 void Layout::normalize() {
 	for (auto layer = layers.begin(); layer != layers.end(); layer++) {
 		layer->second.normalize();
@@ -1809,6 +2520,7 @@ void Layout::trace() {
 	vector<int> mapping(traces.size(), -1);
 
 	nets.clear();
+	indexNets(true);
 	for (auto layer = layers.begin(); layer != layers.end(); layer++) {
 		for (auto r = layer->second.geo.begin(); r != layer->second.geo.end(); r++) {
 			r->net = -1;
@@ -1844,7 +2556,7 @@ void Layout::trace() {
 								mapping[n] = netAt(lbl->txt);
 							}
 							lbl->net = mapping[n];
-							nets[mapping[n]].set(lbl->txt);
+							nameNet(mapping[n], lbl->txt);
 							break;
 						}
 					}
@@ -1894,6 +2606,11 @@ void Layout::trace() {
 		}
 	}
 
+	// the nets were assigned in place
+	for (auto layer = layers.begin(); layer != layers.end(); layer++) {
+		layer->second.touch();
+	}
+
 	/*for (auto layer = layers.begin(); layer != layers.end(); layer++) {
 		printf("layer %s(%d)\n", tech->paint[layer->second.draw].name.c_str(), layer->second.draw);
 		for (auto rect = layer->second.geo.begin(); rect != layer->second.geo.end(); rect++) {
@@ -1915,7 +2632,74 @@ void Layout::clear() {
 	name.clear();
 	box = Rect();
 	layers.clear();
+	materials.clear();
 	nets.clear();
+	indexNets(true);
+}
+
+static void hashRect(Hasher &h, const Rect &r) {
+	h.push((int32_t)r.net);
+	h.push((int32_t)r.ll[0]);
+	h.push((int32_t)r.ll[1]);
+	h.push((int32_t)r.ur[0]);
+	h.push((int32_t)r.ur[1]);
+}
+
+uint64_t Layout::hash() const {
+	Hasher h;
+	hashRect(h, box);
+
+	h.push((int32_t)nets.size());
+	for (auto n = nets.begin(); n != nets.end(); n++) {
+		h.push((int32_t)n->names.size());
+		for (auto name = n->names.begin(); name != n->names.end(); name++) {
+			h.push(*name);
+		}
+		h.push(n->isVdd);
+		h.push(n->isGND);
+		h.push(n->isInput);
+		h.push(n->isOutput);
+		h.push(n->isSub);
+	}
+
+	h.push((int32_t)layers.size());
+	for (auto layer = layers.begin(); layer != layers.end(); layer++) {
+		h.push((int32_t)layer->first);
+		h.push((int32_t)layer->second.geo.size());
+		for (auto r = layer->second.geo.begin(); r != layer->second.geo.end(); r++) {
+			hashRect(h, *r);
+		}
+		h.push((int32_t)layer->second.poly.size());
+		for (auto p = layer->second.poly.begin(); p != layer->second.poly.end(); p++) {
+			h.push((int32_t)p->net);
+			h.push((int32_t)p->v.size());
+			for (auto v = p->v.begin(); v != p->v.end(); v++) {
+				h.push((int32_t)(*v)[0]);
+				h.push((int32_t)(*v)[1]);
+			}
+		}
+		h.push((int32_t)layer->second.lbl.size());
+		for (auto l = layer->second.lbl.begin(); l != layer->second.lbl.end(); l++) {
+			h.push((int32_t)l->net);
+			h.push((int32_t)l->pos[0]);
+			h.push((int32_t)l->pos[1]);
+			h.push(l->txt);
+		}
+	}
+
+	h.push((int32_t)inst.size());
+	for (auto i = inst.begin(); i != inst.end(); i++) {
+		h.push((int32_t)i->macro);
+		h.push((int32_t)i->ports.size());
+		for (auto p = i->ports.begin(); p != i->ports.end(); p++) {
+			h.push((int32_t)*p);
+		}
+		h.push((int32_t)i->pos[0]);
+		h.push((int32_t)i->pos[1]);
+		h.push((int32_t)i->dir[0]);
+		h.push((int32_t)i->dir[1]);
+	}
+	return h.value;
 }
 
 void Layout::print() {
@@ -1960,19 +2744,104 @@ struct StackElem {
 	int pos;
 };
 
-bool operator==(const StackElem &e0, const StackElem &e1) {
-	return e0.pos == e1.pos and e0.net == e1.net;
-}
-
 bool operator<(const StackElem &e0, const StackElem &e1) {
 	return e0.pos < e1.pos or (e0.pos == e1.pos and e0.net < e1.net);
 }
 
+// The rectangles of one layer that currently cross the sweep line in
+// minOffset(). Positions are grouped by net, and only the extreme position of
+// each net is kept in the ordered lo and hi sets. This lets us find the
+// nearest rectangle on a different net in O(log n) without scanning past all
+// of the rectangles that share a net with the one we're placing.
+struct ActiveSet {
+	// net -> positions of the active rectangles on that net
+	map<int, multiset<int> > nets;
+	// the minimum and maximum active position of each net
+	set<StackElem> lo;
+	set<StackElem> hi;
+
+	void insert(int net, int pos) {
+		multiset<int> &active = nets[net];
+		if (active.empty()) {
+			lo.insert(StackElem(net, pos));
+			hi.insert(StackElem(net, pos));
+		} else {
+			if (pos < *active.begin()) {
+				lo.erase(StackElem(net, *active.begin()));
+				lo.insert(StackElem(net, pos));
+			}
+			if (pos > *active.rbegin()) {
+				hi.erase(StackElem(net, *active.rbegin()));
+				hi.insert(StackElem(net, pos));
+			}
+		}
+		active.insert(pos);
+	}
+
+	void erase(int net, int pos) {
+		auto n = nets.find(net);
+		if (n == nets.end()) {
+			return;
+		}
+		auto p = n->second.find(pos);
+		if (p == n->second.end()) {
+			return;
+		}
+
+		int oldLo = *n->second.begin();
+		int oldHi = *n->second.rbegin();
+		n->second.erase(p);
+		if (n->second.empty()) {
+			lo.erase(StackElem(net, oldLo));
+			hi.erase(StackElem(net, oldHi));
+			nets.erase(n);
+			return;
+		}
+
+		if (*n->second.begin() != oldLo) {
+			lo.erase(StackElem(net, oldLo));
+			lo.insert(StackElem(net, *n->second.begin()));
+		}
+		if (*n->second.rbegin() != oldHi) {
+			hi.erase(StackElem(net, oldHi));
+			hi.insert(StackElem(net, *n->second.rbegin()));
+		}
+	}
+
+	// Find the minimum active position, skipping the rectangles on net if
+	// skipNet is set. Return false if there isn't one.
+	bool first(int *pos, bool skipNet, int net) const {
+		auto i = lo.begin();
+		if (i != lo.end() and skipNet and i->net == net) {
+			i++;
+		}
+		if (i == lo.end()) {
+			return false;
+		}
+		*pos = i->pos;
+		return true;
+	}
+
+	// Find the maximum active position, skipping the rectangles on net if
+	// skipNet is set. Return false if there isn't one.
+	bool last(int *pos, bool skipNet, int net) const {
+		auto i = hi.rbegin();
+		if (i != hi.rend() and skipNet and i->net == net) {
+			i++;
+		}
+		if (i == hi.rend()) {
+			return false;
+		}
+		*pos = i->pos;
+		return true;
+	}
+};
+
 // Compute the offset from (0,0) of the l0 geometry to (0,0) of the l1 geometry
 // along axis at which l0 and l1 abut and save into offset. Require spacing on
 // the opposite axis for non-intersection (default is 0). Return false if the two geometries
 // will never intersect.
-bool minOffset(int *offset, int axis, const Layer &l0, int l0Shift, const Layer &l1, int l1Shift, vec2i spacing, bool mergeNet, Mapping<int> l0Map, Mapping<int> l1Map) {
+bool minOffset(int *offset, int axis, const Layer &l0, const vector<int> &l0Nets, int l0Shift, const Layer &l1, const vector<int> &l1Nets, int l1Shift, vec2i spacing, bool mergeNet) {
 	if (l0.dirty) {
 		l0.sync();
 	}
@@ -1981,9 +2850,11 @@ bool minOffset(int *offset, int axis, const Layer &l0, int l0Shift, const Layer
 	}
 
 	bool conflict = false;
+	// rectangles on the same net don't conflict when the two layers are merged
+	bool skipNet = (l0.draw == l1.draw and mergeNet);
 
 	// indexed as [layer]
-	vector<StackElem> stack[2] = {vector<StackElem>(), vector<StackElem>()};
+	ActiveSet stack[2];
 	// indexed as [layer][fromTo]
 	int idx[2][2] = {{0, 0}, {0, 0}};
 	while (true) {
@@ -1996,7 +2867,7 @@ bool minOffset(int *offset, int axis, const Layer &l0, int l0Shift, const Layer
 		for (int layer = 0; layer < 2; layer++) {
 			for (int fromTo = 0; fromTo < 2; fromTo++) {
 				int boundIdx = idx[layer][fromTo];
-				const vector<Bound> &bounds = layer ? l1.bound[1-axis][fromTo] : l0.bound[1-axis][fromTo];
+				const vector<Bound> &bounds = layer ? l1.bounds(1-axis, fromTo) : l0.bounds(1-axis, fromTo);
 				int shift = layer ? l1Shift : l0Shift;
 
 				if (boundIdx < (int)bounds.size()) {
@@ -2015,53 +2886,40 @@ bool minOffset(int *offset, int axis, const Layer &l0, int l0Shift, const Layer
 		}
 
 		int boundIdx = idx[minLayer][minFromTo];
-		const Bound &bound = minLayer ? l1.bound[1-axis][minFromTo][boundIdx] : l0.bound[1-axis][minFromTo][boundIdx];
-		Rect rect = minLayer ? l1.geo[bound.idx].apply(l1Map) : l0.geo[bound.idx].apply(l0Map);
+		const Bound &bound = minLayer ? l1.bounds(1-axis, minFromTo)[boundIdx] : l0.bounds(1-axis, minFromTo)[boundIdx];
+		const Rect &rect = minLayer ? l1.geo[bound.idx] : l0.geo[bound.idx];
+		int net = minLayer ? l1Nets[bound.idx] : l0Nets[bound.idx];
 
 		// Since we're measuring distance from layer 0 to layer 1, then we need to
 		// look at layer 0's to boundary and layer 1's from boundary. From is index
 		// 0 and to is index 1, so we need 1-layer.
-		StackElem elem(rect.net, rect[1-minLayer][axis]);
+		StackElem elem(net, rect[1-minLayer][axis]);
 
-		auto loc = lower_bound(stack[minLayer].begin(), stack[minLayer].end(), elem);
 		if (minFromTo) {
 			// When the index found is the end of a rectangle, we remove that bound
 			// from the stack.
-			if (loc != stack[minLayer].end() and *loc == elem) {
-				stack[minLayer].erase(loc);
-			}
+			stack[minLayer].erase(elem.net, elem.pos);
 		} else {
 			// When the index found is the start of a rectangle, then we add that
 			// rectangle to the associated stack.
-			stack[minLayer].insert(loc, elem);
+			stack[minLayer].insert(elem.net, elem.pos);
 			// Then we need to check the distances to the opposite layer along the
 			// opposite axis. We need to compute the distances from left to right or
 			// bottom to top
-			if (minLayer == 0) {
+			int pos = 0;
+			if (minLayer == 0 and stack[1].first(&pos, skipNet, elem.net)) {
 				// from layer 0 to layer 1
-				for (int i = 0; i < (int)stack[1].size(); i++) {
-					if (l0.draw != l1.draw or stack[1][i].net != elem.net or not mergeNet) {
-						int diff = elem.pos + spacing[axis] - stack[1][i].pos;
-						if (diff > *offset) {
-							*offset = diff;
-							conflict = true;
-							//printf("layers: %d(%d) -> %d(%d)\n", l0.draw, elem.net, l1.draw, stack[1][i].net);
-						}
-						break;
-					}
+				int diff = elem.pos + spacing[axis] - pos;
+				if (diff > *offset) {
+					*offset = diff;
+					conflict = true;
 				}
-			} else if (minLayer == 1) {
+			} else if (minLayer == 1 and stack[0].last(&pos, skipNet, elem.net)) {
 				// from layer 1 to layer 0
-				for (int i = (int)stack[0].size()-1; i >= 0; i--) {
-					if (l0.draw != l1.draw or stack[0][i].net != elem.net or not mergeNet) {
-						int diff = stack[0][i].pos + spacing[axis] - elem.pos;
-						if (diff > *offset) {
-							*offset = diff;
-							conflict = true;
-							//printf("layers: %d(%d) -> %d(%d)\n", l0.draw, stack[0][i].net, l1.draw, elem.net);
-						}
-						break;
-					}
+				int diff = pos + spacing[axis] - elem.pos;
+				if (diff > *offset) {
+					*offset = diff;
+					conflict = true;
 				}
 			}
 		}
@@ -2072,42 +2930,264 @@ bool minOffset(int *offset, int axis, const Layer &l0, int l0Shift, const Layer
 	return conflict;
 }
 
-// TODO(edward.bingham) I need to be able to support comparing two cells with net mappings...
-bool minOffset(int *offset, int axis, const Layout &left, int leftShift, const Layout &right, int rightShift, int substrateMode, int routingMode, bool horizSpacing, Mapping<int> leftMap, Mapping<int> rightMap) {
-	Evaluation e0(left);
-	Evaluation e1(right);
+bool minOffset(int *offset, int axis, const Layer &l0, int l0Shift, const Layer &l1, int l1Shift, vec2i spacing, bool mergeNet, const Mapping<int> &l0Map, const Mapping<int> &l1Map) {
+	return minOffset(offset, axis, l0, l0.remap(l0Map), l0Shift, l1, l1.remap(l1Map), l1Shift, spacing, mergeNet);
+}
+
+// A piece of a layer's facing edge. For the left layer of minOffset() this is
+// the farthest extent of the geometry along the axis, and for the right layer
+// it is the nearest.
+struct EdgeSegment {
+	EdgeSegment() {
+		lo = 0;
+		hi = 0;
+		net = -1;
+		pos = 0;
+	}
+	EdgeSegment(int lo, int hi, int net, int pos) {
+		this->lo = lo;
+		this->hi = hi;
+		this->net = net;
+		this->pos = pos;
+	}
+	~EdgeSegment() {}
+
+	// the extent of the segment along the opposite axis
+	int lo;
+	int hi;
+
+	int net;
+	// the location of the edge along the axis
+	int pos;
+};
+
+// Compute the facing edge profile of layer. When side is 0, this keeps the
+// maximum to boundary at each point along the opposite axis, and when side is
+// 1 it keeps the minimum from boundary. If byNet is set, then each net gets
+// its own profile.
+static vector<EdgeSegment> edgeProfile(const Layer &layer, const vector<int> &nets, int axis, int side, bool byNet) {
+	// net -> (position along the opposite axis, +/- the rectangle's index)
+	map<int, vector<pair<int, int> > > events;
+	vector<EdgeSegment> result;
+	for (int i = 0; i < (int)layer.geo.size(); i++) {
+		const Rect &r = layer.geo[i];
+		int net = byNet ? nets[i] : -1;
+		if (r.ll[1-axis] < r.ur[1-axis]) {
+			vector<pair<int, int> > &e = events[net];
+			e.push_back(pair<int, int>(r.ll[1-axis], i+1));
+			e.push_back(pair<int, int>(r.ur[1-axis], -i-1));
+		} else {
+			// Degenerate rectangles can't be covered by the sweep below, but they
+			// still interact with the other layer when there is spacing.
+			result.push_back(EdgeSegment(r.ll[1-axis], r.ur[1-axis], net, r[1-side][axis]));
+		}
+	}
+
+	for (auto n = events.begin(); n != events.end(); n++) {
+		sort(n->second.begin(), n->second.end());
+		multiset<int> active;
+		for (int i = 0; i < (int)n->second.size(); ) {
+			int curr = n->second[i].first;
+			for (; i < (int)n->second.size() and n->second[i].first == curr; i++) {
+				int idx = n->second[i].second;
+				if (idx > 0) {
+					active.insert(layer.geo[idx-1][1-side][axis]);
+				} else {
+					active.erase(active.find(layer.geo[-idx-1][1-side][axis]));
+				}
+			}
+
+			if (active.empty() or i >= (int)n->second.size()) {
+				continue;
+			}
+
+			int pos = side ? *active.begin() : *active.rbegin();
+			int next = n->second[i].first;
+			if (not result.empty() and result.back().net == n->first and result.back().hi == curr and result.back().pos == pos) {
+				result.back().hi = next;
+			} else {
+				result.push_back(EdgeSegment(curr, next, n->first, pos));
+			}
+		}
+	}
+	return result;
+}
+
+static int clampInt(int64_t value) {
+	if (value < (int64_t)std::numeric_limits<int>::min()) {
+		return std::numeric_limits<int>::min();
+	} else if (value > (int64_t)std::numeric_limits<int>::max()) {
+		return std::numeric_limits<int>::max();
+	}
+	return (int)value;
+}
+
+OffsetCurve::OffsetCurve() {
+}
+
+OffsetCurve::~OffsetCurve() {
+}
+
+bool OffsetCurve::empty() const {
+	return steps.empty();
+}
 
-	/*printf("e0 layers:\n");
-	for (int i = 0; i < (int)e0.layout->layers.size(); i++) {
-		printf("%d: %s\n", e0.layout->layers[i].draw, tech->print(e0.layout->layers[i].draw).c_str());
+int OffsetCurve::at(int shift) const {
+	auto pos = upper_bound(steps.begin(), steps.end(), pair<int, int>(shift, std::numeric_limits<int>::max()));
+	if (pos == steps.begin()) {
+		return OffsetCurve::NONE;
 	}
-	for (auto i = e0.layers.begin(); i != e0.layers.end(); i++) {
-		printf("%d: %s\n", i->first, tech->print(i->first).c_str());
+	pos--;
+	return pos->second;
+}
+
+bool OffsetCurve::at(int *offset, int shift) const {
+	int value = at(shift);
+	if (value != OffsetCurve::NONE and value > *offset) {
+		*offset = value;
+		return true;
+	}
+	return false;
+}
+
+void OffsetCurve::push(vector<pair<vec2i, int> > intervals) {
+	if (intervals.empty()) {
+		return;
 	}
-	printf("e1 layers:\n");
-	for (int i = 0; i < (int)e1.layout->layers.size(); i++) {
-		printf("%d: %s\n", e1.layout->layers[i].draw, tech->print(e1.layout->layers[i].draw).c_str());
+
+	for (auto s = steps.begin(); s != steps.end(); s++) {
+		if (s->second != OffsetCurve::NONE) {
+			int hi = (s+1) == steps.end() ? std::numeric_limits<int>::max() : (s+1)->first-1;
+			intervals.push_back(pair<vec2i, int>(vec2i(s->first, hi), s->second));
+		}
 	}
-	for (auto i = e1.layers.begin(); i != e1.layers.end(); i++) {
-		printf("%d: %s\n", i->first, tech->print(i->first).c_str());
+
+	// position -> (+/- 1 for add or remove, offset)
+	vector<pair<int64_t, pair<int, int> > > events;
+	events.reserve(intervals.size()*2);
+	for (auto i = intervals.begin(); i != intervals.end(); i++) {
+		if (i->first[0] <= i->first[1]) {
+			events.push_back(pair<int64_t, pair<int, int> >(i->first[0], pair<int, int>(1, i->second)));
+			events.push_back(pair<int64_t, pair<int, int> >((int64_t)i->first[1]+1, pair<int, int>(-1, i->second)));
+		}
 	}
-	printf("\n");*/
+	sort(events.begin(), events.end());
 
+	steps.clear();
+	multiset<int> active;
+	for (int i = 0; i < (int)events.size(); ) {
+		int64_t curr = events[i].first;
+		for (; i < (int)events.size() and events[i].first == curr; i++) {
+			if (events[i].second.first > 0) {
+				active.insert(events[i].second.second);
+			} else {
+				active.erase(active.find(events[i].second.second));
+			}
+		}
 
-	bool conflict = false;
+		if (curr > (int64_t)std::numeric_limits<int>::max()) {
+			break;
+		}
+
+		int value = active.empty() ? OffsetCurve::NONE : *active.rbegin();
+		if (steps.empty() ? value != OffsetCurve::NONE : steps.back().second != value) {
+			steps.push_back(pair<int, int>((int)curr, value));
+		}
+	}
+}
+
+void OffsetCurve::merge(const OffsetCurve &c) {
+	vector<pair<vec2i, int> > intervals;
+	for (auto s = c.steps.begin(); s != c.steps.end(); s++) {
+		if (s->second != OffsetCurve::NONE) {
+			int hi = (s+1) == c.steps.end() ? std::numeric_limits<int>::max() : (s+1)->first-1;
+			intervals.push_back(pair<vec2i, int>(vec2i(s->first, hi), s->second));
+		}
+	}
+	push(intervals);
+}
+
+// Compute the minimum offset between l0 and l1 as a function of the shift of
+// l1 relative to l0 along the opposite axis. Two rectangles interact when
+// their extents along the opposite axis, each grown by half the spacing,
+// overlap. Instead of comparing every pair of rectangles, we first reduce
+// each layer to its facing edge profile since only the farthest edge of l0
+// and the nearest edge of l1 at any point can set the offset.
+bool minOffset(OffsetCurve *curve, int axis, const Layer &l0, const vector<int> &l0Nets, const Layer &l1, const vector<int> &l1Nets, vec2i spacing, bool mergeNet) {
+	bool skipNet = (l0.draw == l1.draw and mergeNet);
+	vector<EdgeSegment> p0 = edgeProfile(l0, l0Nets, axis, 0, skipNet);
+	vector<EdgeSegment> p1 = edgeProfile(l1, l1Nets, axis, 1, skipNet);
+
+	int64_t halo = 2*(int64_t)(spacing[1-axis]/2);
+	vector<pair<vec2i, int> > intervals;
+	for (auto s0 = p0.begin(); s0 != p0.end(); s0++) {
+		for (auto s1 = p1.begin(); s1 != p1.end(); s1++) {
+			if (skipNet and s0->net == s1->net) {
+				continue;
+			}
+
+			// The segments interact for any shift strictly between these bounds
+			int64_t lo = (int64_t)s0->lo - (int64_t)s1->hi - halo + 1;
+			int64_t hi = (int64_t)s0->hi - (int64_t)s1->lo + halo - 1;
+			if (lo <= hi) {
+				intervals.push_back(pair<vec2i, int>(vec2i(clampInt(lo), clampInt(hi)), clampInt((int64_t)s0->pos + spacing[axis] - s1->pos)));
+			}
+		}
+	}
+
+	curve->push(intervals);
+	return not intervals.empty();
+}
+
+bool minOffset(OffsetCurve *curve, int axis, const Layer &l0, const Layer &l1, vec2i spacing, bool mergeNet, const Mapping<int> &l0Map, const Mapping<int> &l1Map) {
+	return minOffset(curve, axis, l0, l0.remap(l0Map), l1, l1.remap(l1Map), spacing, mergeNet);
+}
+
+// A spacing rule matched between a layer of the left evaluation and a layer
+// of the right evaluation.
+struct SpacingCheck {
+	const Layer *l0;
+	const Layer *l1;
+	// remapped net ids for l0.geo and l1.geo
+	const vector<int> *l0Nets;
+	const vector<int> *l1Nets;
+	vec2i spacing;
+	bool mergeNet;
+};
+
+// Find all of the spacing rules that apply between the geometry of e0 and e1.
+// remap[0] and remap[1] rename the nets of e0 and e1 respectively. The
+// remapped net ids of each layer are computed the first time that layer shows
+// up in a rule and stored in views, then reused by every other rule that
+// checks it.
+static vector<SpacingCheck> spacingChecks(int axis, const Evaluation &e0, const Evaluation &e1, int substrateMode, int routingMode, bool horizSpacing, const function<int(int)> remap[2], map<int, vector<int> > views[2]) {
+	auto view = [&](int side, int idx, const Layer &layer) -> const vector<int>* {
+		auto pos = views[side].find(idx);
+		if (pos == views[side].end()) {
+			vector<int> nets;
+			nets.reserve(layer.geo.size());
+			for (auto r = layer.geo.begin(); r != layer.geo.end(); r++) {
+				nets.push_back(remap[side](r->net));
+			}
+			pos = views[side].insert(pair<int, vector<int> >(idx, nets)).first;
+		}
+		return &pos->second;
+	};
+
+	auto mode = [&](const Layer &l) {
+		return (l.isRouting ? routingMode : (l.isSubstrate ? (l.isFill() ? Layout::MERGENET : substrateMode) : Layout::DEFAULT));
+	};
+
+	vector<SpacingCheck> result;
 	auto i0 = e0.incomplete.begin();
 	auto i1 = e1.incomplete.begin();
-	//printf("checking %d and %d rules\n", (int)e0.incomplete.size(), (int)e1.incomplete.size());
 	while (i0 != e0.incomplete.end() and i1 != e1.incomplete.end()) {
 		if (i0->first < i1->first) {
-			//printf("unmatched i0=%d: %s\n", i0->second, tech->print(i0->first).c_str());
 			i0++;
 		} else if (i1->first < i0->first) {
-			//printf("unmatched i1=%d: %s\n", i1->second, tech->print(i1->first).c_str());
 			i1++;
 		} else {
-			//printf("matched rule %d i0=%d i1=%d\n", i0->first, i0->second, i1->second);
-			const Rule &rule = left.tech->rules[flip(i0->first)];
+			const Rule &rule = e0.layout->tech->rules[flip(i0->first)];
 
 			if (rule.type == Rule::SPACING) {
 				vec2i spacing(rule.params[0], rule.params[0]);
@@ -2125,47 +3205,27 @@ bool minOffset(int *offset, int axis, const Layout &left, int leftShift, const L
 					spacing[1-axis] = 0;
 				}
 
-				if (e0.has(rule.operands[0]) and e1.has(rule.operands[1])) {
-					const Layer &l0 = e0.at(rule.operands[0]);
-					const Layer &l1 = e1.at(rule.operands[1]);
-			
-					int leftMode = (l0.isRouting ? routingMode : (l0.isSubstrate ? (l0.isFill() ? Layout::MERGENET : substrateMode) : Layout::DEFAULT));
-					int rightMode = (l1.isRouting ? routingMode : (l1.isSubstrate ? (l1.isFill() ? Layout::MERGENET : substrateMode) : Layout::DEFAULT));
-					//printf("found e0 <-> e1: %d %d\n", leftMode, rightMode);
-
-					if (leftMode != Layout::IGNORE and rightMode != Layout::IGNORE) {// and (not l0.isFill() or not l1.isFill())) {
-						bool newConflict = minOffset(offset, axis, l0, leftShift, l1, rightShift, spacing, leftMode == Layout::MERGENET and rightMode == Layout::MERGENET, leftMap, rightMap);
-						/*if (newConflict) {
-							printf("conflict %d i0=%d e0=%d i1=%d e1=%d off=%d\n", i0->first, i0->second, leftMode, i1->second, rightMode, *offset);
-							//l0.print();
-							//l1.print();
-							//printf("found conflict: %d\n", *offset);
-						} else {
-							//printf("no conflict\n");
-						}*/
-						conflict = conflict or newConflict;
+				for (int order = 0; order < 2; order++) {
+					int a0 = rule.operands[order];
+					int a1 = rule.operands[1-order];
+					if ((order == 1 and rule.operands[0] == rule.operands[1]) or not e0.has(a0) or not e1.has(a1)) {
+						continue;
 					}
-				}
 
-				if (rule.operands[0] != rule.operands[1] and e0.has(rule.operands[1]) and e1.has(rule.operands[0])) {
-					const Layer &l0 = e0.at(rule.operands[1]);
-					const Layer &l1 = e1.at(rule.operands[0]);
-					
-					int leftMode = (l0.isRouting ? routingMode : (l0.isSubstrate ? (l0.isFill() ? Layout::MERGENET : substrateMode) : Layout::DEFAULT));
-					int rightMode = (l1.isRouting ? routingMode : (l1.isSubstrate ? (l1.isFill() ? Layout::MERGENET : substrateMode) : Layout::DEFAULT));
-					//printf("found e1 <-> e0: %d %d\n", leftMode, rightMode);
+					const Layer &l0 = e0.at(a0);
+					const Layer &l1 = e1.at(a1);
 
+					int leftMode = mode(l0);
+					int rightMode = mode(l1);
 					if (leftMode != Layout::IGNORE and rightMode != Layout::IGNORE) {// and (not l0.isFill() or not l1.isFill())) {
-						bool newConflict = minOffset(offset, axis, l0, leftShift, l1, rightShift, spacing, leftMode == Layout::MERGENET and rightMode == Layout::MERGENET, leftMap, rightMap);
-						/*if (newConflict) {
-							printf("conflict %d i0=%d e0=%d i1=%d e1=%d off=%d\n", i0->first, i0->second, leftMode, i1->second, rightMode, *offset);
-							//l0.print();
-							//l1.print();
-							//printf("found conflict: %d\n", *offset);
-						} else {
-							//printf("no conflict\n");
-						}*/
-						conflict = conflict or newConflict;
+						SpacingCheck check;
+						check.l0 = &l0;
+						check.l1 = &l1;
+						check.l0Nets = view(0, a0, l0);
+						check.l1Nets = view(1, a1, l1);
+						check.spacing = spacing;
+						check.mergeNet = (leftMode == Layout::MERGENET and rightMode == Layout::MERGENET);
+						result.push_back(check);
 					}
 				}
 			}
@@ -2174,8 +3234,147 @@ bool minOffset(int *offset, int axis, const Layout &left, int leftShift, const L
 			i1++;
 		}
 	}
+	return result;
+}
+
+// The scalar minOffset() between two evaluations with the nets of each side
+// renamed by remap.
+static bool minOffset(int *offset, int axis, const Evaluation &e0, int leftShift, const Evaluation &e1, int rightShift, int substrateMode, int routingMode, bool horizSpacing, const function<int(int)> remap[2]) {
+	map<int, vector<int> > views[2];
+	vector<SpacingCheck> checks = spacingChecks(axis, e0, e1, substrateMode, routingMode, horizSpacing, remap, views);
+
+	// The layer sweeps only read the bound caches, so they must be up to date
+	// before the checks are split across threads.
+	e0.sync();
+	e1.sync();
+
+	// Handing the checks to other threads only pays off once the sweeps are
+	// large enough. Small cells, which placers query in tight loops, are
+	// checked on the calling thread.
+	int work = 0;
+	for (auto c = checks.begin(); c != checks.end(); c++) {
+		work += (int)(c->l0->geo.size() + c->l1->geo.size());
+	}
+
+	// Each rule is checked independently starting from the same initial
+	// offset, then the results are reduced with max.
+	vector<int> offsets(checks.size(), *offset);
+	vector<char> conflicts(checks.size(), 0);
+	parallelFor((int)checks.size(), [&](int i) {
+		const SpacingCheck &c = checks[i];
+		conflicts[i] = minOffset(&offsets[i], axis, *c.l0, *c.l0Nets, leftShift, *c.l1, *c.l1Nets, rightShift, c.spacing, c.mergeNet);
+	}, work < PARALLEL_WORK ? 1 : 0);
+
+	bool conflict = false;
+	for (int i = 0; i < (int)checks.size(); i++) {
+		if (offsets[i] > *offset) {
+			*offset = offsets[i];
+		}
+		conflict = conflict or conflicts[i];
+	}
+	return conflict;
+}
+
+bool minOffset(int *offset, int axis, const Evaluation &e0, int leftShift, const Evaluation &e1, int rightShift, int substrateMode, int routingMode, bool horizSpacing, const Mapping<int> &leftMap, const Mapping<int> &rightMap) {
+	function<int(int)> remap[2] = {
+		[&](int net) { return leftMap.map(net); },
+		[&](int net) { return rightMap.map(net); },
+	};
+	return minOffset(offset, axis, e0, leftShift, e1, rightShift, substrateMode, routingMode, horizSpacing, remap);
+}
+
+bool minOffset(int *offset, int axis, const Evaluation &e0, const vector<int> &leftNets, int leftShift, const Evaluation &e1, const vector<int> &rightNets, int rightShift, int substrateMode, int routingMode, bool horizSpacing) {
+	auto lookup = [](const vector<int> &table, int net) {
+		return (net >= 0 and net < (int)table.size()) ? table[net] : -1;
+	};
+	function<int(int)> remap[2] = {
+		[&](int net) { return lookup(leftNets, net); },
+		[&](int net) { return lookup(rightNets, net); },
+	};
+	return minOffset(offset, axis, e0, leftShift, e1, rightShift, substrateMode, routingMode, horizSpacing, remap);
+}
+
+bool minOffset(OffsetCurve *curve, int axis, const Evaluation &e0, const Evaluation &e1, int substrateMode, int routingMode, bool horizSpacing, const Mapping<int> &leftMap, const Mapping<int> &rightMap) {
+	function<int(int)> remap[2] = {
+		[&](int net) { return leftMap.map(net); },
+		[&](int net) { return rightMap.map(net); },
+	};
+	map<int, vector<int> > views[2];
+	vector<SpacingCheck> checks = spacingChecks(axis, e0, e1, substrateMode, routingMode, horizSpacing, remap, views);
+
+	bool conflict = false;
+	for (auto c = checks.begin(); c != checks.end(); c++) {
+		bool newConflict = minOffset(curve, axis, *c->l0, *c->l0Nets, *c->l1, *c->l1Nets, c->spacing, c->mergeNet);
+		conflict = conflict or newConflict;
+	}
 	return conflict;
 }
 
+bool minOffset(OffsetCurve *curve, int axis, const Evaluation &e0, const vector<int> &leftNets, const Evaluation &e1, const vector<int> &rightNets, int substrateMode, int routingMode, bool horizSpacing) {
+	auto lookup = [](const vector<int> &table, int net) {
+		return (net >= 0 and net < (int)table.size()) ? table[net] : -1;
+	};
+	function<int(int)> remap[2] = {
+		[&](int net) { return lookup(leftNets, net); },
+		[&](int net) { return lookup(rightNets, net); },
+	};
+	map<int, vector<int> > views[2];
+	vector<SpacingCheck> checks = spacingChecks(axis, e0, e1, substrateMode, routingMode, horizSpacing, remap, views);
+
+	bool conflict = false;
+	for (auto c = checks.begin(); c != checks.end(); c++) {
+		bool newConflict = minOffset(curve, axis, *c->l0, *c->l0Nets, *c->l1, *c->l1Nets, c->spacing, c->mergeNet);
+		conflict = conflict or newConflict;
+	}
+	return conflict;
+}
+
+
+
+bool minOffset(int *offset, int axis, const Layout &left, int leftShift, const Layout &right, int rightShift, int substrateMode, int routingMode, bool horizSpacing, const Mapping<int> &leftMap, const Mapping<int> &rightMap) {
+	Evaluation e0(left);
+	Evaluation e1(right);
+	return minOffset(offset, axis, e0, leftShift, e1, rightShift, substrateMode, routingMode, horizSpacing, leftMap, rightMap);
+}
+
+bool minOffset(OffsetCurve *curve, int axis, const Layout &left, const Layout &right, int substrateMode, int routingMode, bool horizSpacing, const Mapping<int> &leftMap, const Mapping<int> &rightMap) {
+	Evaluation e0(left);
+	Evaluation e1(right);
+	return minOffset(curve, axis, e0, e1, substrateMode, routingMode, horizSpacing, leftMap, rightMap);
+}
+
+vector<bool> minOffset(vector<int> &offset, int axis, const Layout &left, int leftShift, const vector<const Layout*> &right, const vector<int> &rightShift, int substrateMode, int routingMode, bool horizSpacing, const Mapping<int> &leftMap, const vector<Mapping<int> > &rightMap) {
+	if (offset.size() < right.size()) {
+		offset.resize(right.size(), 0);
+	}
+
+	Evaluation e0(left);
+	e0.sync();
+
+	// Layer::sync() isn't safe to call from multiple threads, so the geometry
+	// of every candidate needs to be ready before we split up the work.
+	for (auto r = right.begin(); r != right.end(); r++) {
+		for (auto i = (*r)->layers.begin(); i != (*r)->layers.end(); i++) {
+			if (i->second.dirty) {
+				i->second.sync();
+			}
+		}
+	}
+
+	vector<char> conflict(right.size(), 0);
+	parallelFor((int)right.size(), [&](int i) {
+		Evaluation e1(*right[i]);
+		e1.sync();
+		int shift = i < (int)rightShift.size() ? rightShift[i] : 0;
+		if (i < (int)rightMap.size()) {
+			conflict[i] = minOffset(&offset[i], axis, e0, leftShift, e1, shift, substrateMode, routingMode, horizSpacing, leftMap, rightMap[i]);
+		} else {
+			conflict[i] = minOffset(&offset[i], axis, e0, leftShift, e1, shift, substrateMode, routingMode, horizSpacing, leftMap);
+		}
+	});
+
+	return vector<bool>(conflict.begin(), conflict.end());
+}
+
 }
 
@@ -2,6 +2,13 @@
 
 #include <vector>
 #include <array>
+#include <limits>
+#include <string_view>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <bit>
+#include <cstdint>
 
 #include <common/mapping.h>
 
@@ -121,12 +128,23 @@ struct Bound {
 bool operator<(const Bound &b0, const Bound &b1);
 bool operator<(const Bound &b, int p);
 
+// The rectangles of a layer sorted by each of their edges, see Layer::sync()
+struct LayerBounds {
+	// indexed as [axis][fromTo]
+	array<array<vector<Bound>, 2>, 2> bound;
+};
+
 struct Layer {
 	Layer(const Tech &tech);
 	Layer(const Tech &tech, bool value);
 	Layer(const Tech &tech, int draw);
+	Layer(const Layer &copy);
+	Layer(Layer &&copy);
 	~Layer();
 
+	Layer &operator=(const Layer &copy);
+	Layer &operator=(Layer &&copy);
+
 	enum {
 		UNKNOWN = -1,
 	};
@@ -148,13 +166,17 @@ struct Layer {
 	bool isPin;
 	bool isWell;
 
+	// Changes whenever geo, poly, or lbl change. Versions are drawn from a
+	// process-wide counter, so two layers with the same version have the same
+	// contents. See Layout::get().
+	uint64_t version;
 	
 	/////////////////////////////////////////////
-	// these optimize performance in the minOffset computation
+	// these optimize performance in the minOffset computation. They are
+	// rebuilt from geo by sync(), so they are kept out of line and copies of
+	// the layer start without them.
 	mutable bool dirty;
-	
-	// indexed as [axis][fromTo]
-	mutable array<array<vector<Bound>, 2>, 2> bound;
+	mutable unique_ptr<LayerBounds> cache;
 
 	////////////////////////////////////////////
 
@@ -162,7 +184,12 @@ struct Layer {
 
 	bool empty() const;
 	void clear();
+	// Give this layer a new version. Call this after modifying geo, poly, or
+	// lbl directly.
+	void touch();
 	void sync() const;
+	// The bounds built by the last sync()
+	const vector<Bound> &bounds(int axis, int fromTo) const;
 
 	void push(Rect rect);
 	void push(vector<Rect> rects);
@@ -188,6 +215,10 @@ struct Layer {
 
 	bool overlaps(const Rect &r0) const;
 	bool overlaps(const Layer &l0) const;
+
+	// Apply the net mapping to every rectangle in geo. The result is indexed
+	// the same as geo.
+	vector<int> remap(const Mapping<int> &m) const;
 	
 	void print() const;
 };
@@ -198,8 +229,24 @@ bool operator<(const Layer &l, int id);
 Layer operator&(const Layer &l0, const Layer &l1);
 Layer interact(const Layer &l0, const Layer &l1);
 Layer not_interact(const Layer &l0, const Layer &l1);
+// Same as l0 & ~l1 without building the complement of l1
+Layer difference(const Layer &l0, const Layer &l1);
+// Same as interact(l0 & l1, l2) without building l0 & l1
+Layer and_interact(const Layer &l0, const Layer &l1, const Layer &l2);
 Layer operator|(const Layer &l0, const Layer &l1);
 Layer operator~(const Layer &l);
+// Same as layers[0] & layers[1] & ... The operands are intersected from the
+// fewest candidate rectangles to the most, stopping as soon as nothing is
+// left. Nets and draw come from layers[0].
+Layer intersect(const vector<const Layer*> &layers);
+// Same as layers[0] | layers[1] | ... computed in one sweep over the
+// operands' rectangles merged by left edge. The result covers the union of
+// each net with disjoint rectangles.
+Layer unite(const vector<const Layer*> &layers);
+// Same as (draw[0] | draw[1] | ...) & mask[0] & ... & ~excl[0] & ... Each
+// rectangle of the union is clipped by the masks and exclusions on its own
+// without building any of the intermediate layers.
+Layer material(const vector<const Layer*> &draw, const vector<const Layer*> &mask, const vector<const Layer*> &excl);
 
 struct Evaluation {
 	Evaluation(const Tech &tech);
@@ -215,10 +262,14 @@ struct Evaluation {
 	map<int, int> incomplete;
 
 	void init();
-	bool has(int idx);
+	bool has(int idx) const;
 	const Layer &at(int idx) const;
 	Layer &set(int idx);
 	void evaluate();
+
+	// Build the bound arrays for every layer this evaluation can hand out so
+	// that it may be shared by minOffset() calls running on other threads.
+	void sync() const;
 };
 
 struct Net {
@@ -235,8 +286,15 @@ struct Net {
 	bool isOutput;
 	bool isSub;
 
-	void set(string name);
-	bool has(string name) const;
+	void set(string_view name);
+	bool has(string_view name) const;
+};
+
+// Hashes net names by their contents so that Layout::netIndex may be
+// searched with a string_view without building a string
+struct NameHash {
+	using is_transparent = void;
+	size_t operator()(string_view name) const;
 };
 
 struct Instance {
@@ -252,6 +310,112 @@ struct Instance {
 	Instance &shift_inplace(vec2i pos, vec2i dir=vec2i(1,1));
 };
 
+// The layers of a Layout stored densely by draw layer along with a bitmap of
+// the ones that are present. This behaves like the map<int, Layer> that it
+// replaced: iteration visits the present layers in increasing order of draw
+// and dereferences to a pair of draw and Layer.
+struct LayerTable {
+	LayerTable(const Tech &tech);
+	~LayerTable();
+
+	typedef pair<int, Layer> value_type;
+
+	template <typename Table, typename Value>
+	struct Iterator {
+		Iterator() {
+			table = nullptr;
+			slot = 0;
+		}
+
+		Iterator(Table *table, int slot) {
+			this->table = table;
+			this->slot = slot;
+		}
+
+		// iterator converts to const_iterator
+		template <typename T, typename V>
+		Iterator(const Iterator<T, V> &other) {
+			table = other.table;
+			slot = other.slot;
+		}
+
+		Table *table;
+		// index into LayerTable::slots
+		int slot;
+
+		Value &operator*() const {
+			return table->slots[slot];
+		}
+
+		Value *operator->() const {
+			return &table->slots[slot];
+		}
+
+		Iterator &operator++() {
+			slot = table->next(slot+1);
+			return *this;
+		}
+
+		Iterator operator++(int) {
+			Iterator result = *this;
+			slot = table->next(slot+1);
+			return result;
+		}
+
+		bool operator==(const Iterator &other) const {
+			return slot == other.slot;
+		}
+
+		bool operator!=(const Iterator &other) const {
+			return slot != other.slot;
+		}
+	};
+
+	typedef Iterator<LayerTable, value_type> iterator;
+	typedef Iterator<const LayerTable, const value_type> const_iterator;
+
+	const Tech *tech;
+
+	// slots[i] holds the layer for draw i-base. Operations on the paint have
+	// negative draw, see Tech::rules.
+	int base;
+	vector<value_type> slots;
+	// bit i is set if slots[i] holds a layer
+	vector<uint64_t> present;
+	int count;
+
+	int size() const;
+	bool empty() const;
+	void clear();
+
+	iterator begin();
+	iterator end();
+	const_iterator begin() const;
+	const_iterator end() const;
+
+	iterator find(int draw);
+	const_iterator find(int draw) const;
+
+	pair<iterator, bool> insert(value_type layer);
+	iterator erase(iterator pos);
+	int erase(int draw);
+
+	// Returns the first slot at or after this one that holds a layer, or
+	// slots.size() if there isn't one.
+	int next(int slot) const;
+};
+
+// A material layer computed by Layout::get()
+struct CachedLayer {
+	CachedLayer(const Tech &tech);
+	~CachedLayer();
+
+	Layer layer;
+	// The versions of the draw, label, mask, and exclusion layers of the
+	// material in that order, or 0 for the ones that were missing
+	vector<uint64_t> sources;
+};
+
 struct Layout {
 	// Layout(); we shouldn't be able to create a layout without a pointer to the
 	// technology node specification
@@ -275,17 +439,30 @@ struct Layout {
 
 	// The names for all of the nets
 	vector<Net> nets;
+	// name -> the lowest index into nets with that name. This covers the first
+	// indexed nets, the rest are added by the next netAt(). Names added to a
+	// net that is already indexed must go through nameNet().
+	unordered_map<string, int, NameHash, equal_to<> > netIndex;
+	int indexed;
 
 	// The geometry for this cell
-	map<int, Layer> layers;
+	LayerTable layers;
 
 	vector<Instance> inst;
+
+	// Material layers by level, see get()
+	map<Level, CachedLayer> materials;
 	
-	map<int, Layer>::const_iterator find(int draw) const;
-	map<int, Layer>::iterator find(int draw);
-	map<int, Layer>::iterator at(int draw);
+	LayerTable::const_iterator find(int draw) const;
+	LayerTable::iterator find(int draw);
+	// Returns the layer for draw, adding an empty one if there isn't one
+	LayerTable::iterator at(int draw);
 
-	Layer get(Level level);
+	// The geometry of a material: its draw and label layers, clipped to its
+	// masks and without its exclusions. This is cached until one of those
+	// layers changes version. The returned layer is valid until the next call
+	// for the same level.
+	const Layer &get(Level level);
 
 	void push(int layer, Rect rect);
 	void push(int layer, vector<Rect> rects);
@@ -304,7 +481,13 @@ struct Layout {
 
 	void push(Instance inst, Rect box);
 
-	int netAt(string name);
+	// Returns the net with this name, adding one if there isn't one
+	int netAt(string_view name);
+	// Add name to nets[net]
+	void nameNet(int net, string_view name);
+	// Index the nets added since the last call. reset reindexes all of them,
+	// which is necessary after removing nets or names.
+	void indexNets(bool reset=false);
 
 	void normalize();
 	void merge();
@@ -317,11 +500,69 @@ struct Layout {
 	bool empty() const;
 	void clear();
 
+	// A fingerprint of the geometry, nets, and instances of this cell, not
+	// including its name.
+	uint64_t hash() const;
+
 	void print();
 };
 
-bool minOffset(int *offset, int axis, const Layer &l0, int l0Shift, const Layer &l1, int l1Shift, vec2i spacing=vec2i(0,0), bool mergeNet=true, Mapping<int> l0Map=Mapping<int>(-1, true), Mapping<int> l1Map=Mapping<int>(-1, true));
-bool minOffset(int *offset, int axis, const Layout &left, int leftShift, const Layout &right, int rightShift, int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true, Mapping<int> leftMap=Mapping<int>(-1, true), Mapping<int> rightMap=Mapping<int>(-1, true));
+// The minimum offset between two layouts as a piecewise-constant function of
+// the shift of the right layout relative to the left along the opposite axis,
+// shift = rightShift - leftShift.
+struct OffsetCurve {
+	OffsetCurve();
+	~OffsetCurve();
+
+	enum {
+		// There is no conflict at this shift
+		NONE = std::numeric_limits<int>::min(),
+	};
+
+	// (shift, offset) sorted by shift. Each step applies from its shift up to
+	// the shift of the next step. Shifts before the first step have no
+	// conflict.
+	vector<pair<int, int> > steps;
+
+	bool empty() const;
+
+	// Returns the offset at this shift or NONE
+	int at(int shift) const;
+	// Behaves like the scalar minOffset(), raising *offset to the offset at
+	// this shift. Returns true if there is a conflict at this shift.
+	bool at(int *offset, int shift) const;
+
+	// Raise the curve to the given offset over each inclusive range of shifts
+	void push(vector<pair<vec2i, int> > intervals);
+	// Take the pointwise maximum of the two curves
+	void merge(const OffsetCurve &c);
+};
+
+// l0Nets and l1Nets are the net ids of l0.geo and l1.geo after mapping (see
+// Layer::remap()). These are built once by the caller and shared across every
+// rule that checks the layer.
+bool minOffset(int *offset, int axis, const Layer &l0, const vector<int> &l0Nets, int l0Shift, const Layer &l1, const vector<int> &l1Nets, int l1Shift, vec2i spacing=vec2i(0,0), bool mergeNet=true);
+bool minOffset(int *offset, int axis, const Layer &l0, int l0Shift, const Layer &l1, int l1Shift, vec2i spacing=vec2i(0,0), bool mergeNet=true, const Mapping<int> &l0Map=Mapping<int>(-1, true), const Mapping<int> &l1Map=Mapping<int>(-1, true));
+bool minOffset(int *offset, int axis, const Evaluation &left, int leftShift, const Evaluation &right, int rightShift, int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true, const Mapping<int> &leftMap=Mapping<int>(-1, true), const Mapping<int> &rightMap=Mapping<int>(-1, true));
+// leftNets[i] and rightNets[i] are the new ids of net i of each evaluation.
+bool minOffset(int *offset, int axis, const Evaluation &left, const vector<int> &leftNets, int leftShift, const Evaluation &right, const vector<int> &rightNets, int rightShift, int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true);
+bool minOffset(int *offset, int axis, const Layout &left, int leftShift, const Layout &right, int rightShift, int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true, const Mapping<int> &leftMap=Mapping<int>(-1, true), const Mapping<int> &rightMap=Mapping<int>(-1, true));
+
+// Compute minOffset() for every relative shift at once, merging the result
+// into curve. Returns true if there is a conflict at any shift.
+bool minOffset(OffsetCurve *curve, int axis, const Layer &l0, const vector<int> &l0Nets, const Layer &l1, const vector<int> &l1Nets, vec2i spacing=vec2i(0,0), bool mergeNet=true);
+bool minOffset(OffsetCurve *curve, int axis, const Layer &l0, const Layer &l1, vec2i spacing=vec2i(0,0), bool mergeNet=true, const Mapping<int> &l0Map=Mapping<int>(-1, true), const Mapping<int> &l1Map=Mapping<int>(-1, true));
+bool minOffset(OffsetCurve *curve, int axis, const Evaluation &left, const Evaluation &right, int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true, const Mapping<int> &leftMap=Mapping<int>(-1, true), const Mapping<int> &rightMap=Mapping<int>(-1, true));
+// leftNets[i] and rightNets[i] are the new ids of net i of left and right.
+// Nets outside of the tables become -1.
+bool minOffset(OffsetCurve *curve, int axis, const Evaluation &left, const vector<int> &leftNets, const Evaluation &right, const vector<int> &rightNets, int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true);
+bool minOffset(OffsetCurve *curve, int axis, const Layout &left, const Layout &right, int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true, const Mapping<int> &leftMap=Mapping<int>(-1, true), const Mapping<int> &rightMap=Mapping<int>(-1, true));
+
+// Compute minOffset() from left to every layout in right. The rules of left
+// are evaluated once and shared by all of the candidates, which are then
+// checked in parallel. offset[i] and the returned conflict flag correspond to
+// right[i]. Missing shifts default to 0 and missing mappings to the identity.
+vector<bool> minOffset(vector<int> &offset, int axis, const Layout &left, int leftShift, const vector<const Layout*> &right, const vector<int> &rightShift=vector<int>(), int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true, const Mapping<int> &leftMap=Mapping<int>(-1, true), const vector<Mapping<int> > &rightMap=vector<Mapping<int> >());
 
 }
 
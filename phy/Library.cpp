@@ -1,9 +1,88 @@
 #include "Library.h"
+#include "Binary.h"
+#include "Parallel.h"
+
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <algorithm>
 
 using namespace std;
 
 namespace phy {
 
+OffsetKey::OffsetKey() {
+	left = -1;
+	right = -1;
+	axis = 0;
+	leftDir = 0;
+	rightDir = 0;
+	substrateMode = Layout::DEFAULT;
+	routingMode = Layout::DEFAULT;
+	horizSpacing = true;
+	mapHash = 0;
+}
+
+OffsetKey::OffsetKey(int left, int right, int axis, int leftDir, int rightDir, int substrateMode, int routingMode, bool horizSpacing, uint64_t mapHash) {
+	this->left = left;
+	this->right = right;
+	this->axis = axis;
+	this->leftDir = leftDir;
+	this->rightDir = rightDir;
+	this->substrateMode = substrateMode;
+	this->routingMode = routingMode;
+	this->horizSpacing = horizSpacing;
+	this->mapHash = mapHash;
+}
+
+OffsetKey::~OffsetKey() {
+}
+
+bool operator<(const OffsetKey &k0, const OffsetKey &k1) {
+	if (k0.left != k1.left) {
+		return k0.left < k1.left;
+	} else if (k0.right != k1.right) {
+		return k0.right < k1.right;
+	} else if (k0.axis != k1.axis) {
+		return k0.axis < k1.axis;
+	} else if (k0.leftDir != k1.leftDir) {
+		return k0.leftDir < k1.leftDir;
+	} else if (k0.rightDir != k1.rightDir) {
+		return k0.rightDir < k1.rightDir;
+	} else if (k0.substrateMode != k1.substrateMode) {
+		return k0.substrateMode < k1.substrateMode;
+	} else if (k0.routingMode != k1.routingMode) {
+		return k0.routingMode < k1.routingMode;
+	} else if (k0.horizSpacing != k1.horizSpacing) {
+		return k0.horizSpacing < k1.horizSpacing;
+	}
+	return k0.mapHash < k1.mapHash;
+}
+
+int orientation(vec2i dir) {
+	return (dir[0] < 0 ? 1 : 0) | (dir[1] < 0 ? 2 : 0);
+}
+
+vec2i direction(int orientation) {
+	return vec2i((orientation & 1) ? -1 : 1, (orientation & 2) ? -1 : 1);
+}
+
+OffsetTable::OffsetTable() {
+	axis = 0;
+	shift = 0;
+}
+
+OffsetTable::~OffsetTable() {
+}
+
+int OffsetTable::index(int left, int leftDir, int right, int rightDir) const {
+	return ((left*(int)dirs.size() + leftDir)*(int)macros.size() + right)*(int)dirs.size() + rightDir;
+}
+
+int OffsetTable::at(int left, int leftDir, int right, int rightDir) const {
+	return offset[index(left, leftDir, right, rightDir)];
+}
+
 Library::Library(const Tech &tech) {
 	this->tech = &tech;
 }
@@ -11,5 +90,763 @@ Library::Library(const Tech &tech) {
 Library::~Library() {
 }
 
+int Library::push(const Layout &macro) {
+	auto pos = names.find(macro.name);
+	if (pos != names.end()) {
+		macros[pos->second] = macro;
+		invalidate(pos->second);
+		return pos->second;
+	}
+
+	int index = (int)macros.size();
+	macros.push_back(macro);
+	names.insert(pair<string, int>(macro.name, index));
+	hashes.insert(pair<uint64_t, int>(macro.hash(), index));
+	return index;
+}
+
+int Library::find(string name) const {
+	auto pos = names.find(name);
+	if (pos == names.end()) {
+		return -1;
+	}
+	return pos->second;
+}
+
+int Library::find(uint64_t hash) const {
+	auto pos = hashes.find(hash);
+	if (pos == hashes.end()) {
+		return -1;
+	}
+	return pos->second;
+}
+
+void Library::reindex() {
+	names.clear();
+	hashes.clear();
+	for (int i = 0; i < (int)macros.size(); i++) {
+		// keep the first of any duplicates
+		names.insert(pair<string, int>(macros[i].name, i));
+		hashes.insert(pair<uint64_t, int>(macros[i].hash(), i));
+	}
+}
+
+const Layout &Library::orient(int macro, vec2i dir) {
+	int key = macro*4 + orientation(dir);
+	auto pos = oriented.find(key);
+	if (pos == oriented.end()) {
+		pos = oriented.insert(pair<int, Layout>(key, macros[macro])).first;
+		pos->second.shift_inplace(vec2i(0, 0), direction(orientation(dir)));
+	}
+	return pos->second;
+}
+
+const Evaluation &Library::evaluate(int macro, vec2i dir) {
+	int key = macro*4 + orientation(dir);
+	auto pos = evals.find(key);
+	if (pos == evals.end()) {
+		pos = evals.insert(pair<int, Evaluation>(key, Evaluation(orient(macro, dir)))).first;
+	}
+	return pos->second;
+}
+
+// Hash the net mapping over the range of nets in this layout
+static uint64_t hashMapping(const Layout &layout, const Mapping<int> &m) {
+	Hasher h;
+	for (int i = -1; i < (int)layout.nets.size(); i++) {
+		h.push((int32_t)m.map(i));
+	}
+	return h.value;
+}
+
+// Combine the mapping hashes of the two macros of a pair into the
+// OffsetKey::mapHash of that pair
+static uint64_t hashPair(uint64_t left, uint64_t right) {
+	Hasher h;
+	h.push(left);
+	h.push(right);
+	return h.value;
+}
+
+const OffsetCurve &Library::offsetCurve(int axis, int left, int right, vec2i leftDir, vec2i rightDir, int substrateMode, int routingMode, bool horizSpacing, const Mapping<int> &leftMap, const Mapping<int> &rightMap) {
+	uint64_t mapHash = hashPair(hashMapping(macros[left], leftMap), hashMapping(macros[right], rightMap));
+	OffsetKey key(left, right, axis, orientation(leftDir), orientation(rightDir), substrateMode, routingMode, horizSpacing, mapHash);
+	auto pos = offsets.find(key);
+	if (pos == offsets.end()) {
+		OffsetCurve curve;
+		phy::minOffset(&curve, axis, evaluate(left, leftDir), evaluate(right, rightDir), substrateMode, routingMode, horizSpacing, leftMap, rightMap);
+		pos = offsets.insert(pair<OffsetKey, OffsetCurve>(key, curve)).first;
+	}
+	return pos->second;
+}
+
+bool Library::minOffset(int *offset, int axis, int left, int leftShift, int right, int rightShift, vec2i leftDir, vec2i rightDir, int substrateMode, int routingMode, bool horizSpacing, const Mapping<int> &leftMap, const Mapping<int> &rightMap) {
+	return offsetCurve(axis, left, right, leftDir, rightDir, substrateMode, routingMode, horizSpacing, leftMap, rightMap).at(offset, rightShift-leftShift);
+}
+
+// Hash the net table over the range of nets in this layout the same way as
+// hashMapping() so that equivalent tables and mappings share cache entries.
+static uint64_t hashNets(const Layout &layout, const vector<int> &nets) {
+	Hasher h;
+	for (int i = -1; i < (int)layout.nets.size(); i++) {
+		h.push((int32_t)((i >= 0 and i < (int)nets.size()) ? nets[i] : -1));
+	}
+	return h.value;
+}
+
+const OffsetCurve &Library::offsetCurve(int axis, int left, int right, const vector<int> &leftNets, const vector<int> &rightNets, vec2i leftDir, vec2i rightDir, int substrateMode, int routingMode, bool horizSpacing) {
+	uint64_t mapHash = hashPair(hashNets(macros[left], leftNets), hashNets(macros[right], rightNets));
+	OffsetKey key(left, right, axis, orientation(leftDir), orientation(rightDir), substrateMode, routingMode, horizSpacing, mapHash);
+	auto pos = offsets.find(key);
+	if (pos == offsets.end()) {
+		OffsetCurve curve;
+		phy::minOffset(&curve, axis, evaluate(left, leftDir), leftNets, evaluate(right, rightDir), rightNets, substrateMode, routingMode, horizSpacing);
+		pos = offsets.insert(pair<OffsetKey, OffsetCurve>(key, curve)).first;
+	}
+	return pos->second;
+}
+
+// A piece of a hierarchical layout. This is either the layout's own geometry
+// or a macro instance somewhere in its hierarchy.
+struct LayoutPiece {
+	// index into Library::macros or -1 for the layout's own geometry
+	int macro;
+	vec2i pos;
+	vec2i dir;
+	// the nets of the macro -> the nets of the layout. Nets that aren't
+	// connected to a port of the layout are private to this instance and get
+	// ids at or above the net count of the layout that no other instance uses.
+	vector<int> nets;
+};
+
+static void collectPieces(const Library &lib, const Layout &cell, vec2i pos, vec2i dir, const vector<int> &nets, int *next, vector<LayoutPiece> &pieces) {
+	for (auto i = cell.inst.begin(); i != cell.inst.end(); i++) {
+		if (i->macro < 0 or i->macro >= (int)lib.macros.size()) {
+			continue;
+		}
+
+		LayoutPiece piece;
+		piece.macro = i->macro;
+		piece.pos = pos + dir*i->pos;
+		piece.dir = dir*i->dir;
+		piece.nets.resize(lib.macros[i->macro].nets.size(), -1);
+		for (int j = 0; j < (int)piece.nets.size(); j++) {
+			int port = j < (int)i->ports.size() ? i->ports[j] : -1;
+			if (port >= 0 and port < (int)nets.size()) {
+				piece.nets[j] = nets[port];
+			} else {
+				piece.nets[j] = (*next)++;
+			}
+		}
+		pieces.push_back(piece);
+		// The recursion grows pieces, so it gets the nets of the local copy
+		collectPieces(lib, lib.macros[i->macro], piece.pos, piece.dir, piece.nets, next, pieces);
+	}
+}
+
+// The first piece is always the layout's own geometry, and its net table
+// covers every net of the layout.
+static vector<LayoutPiece> layoutPieces(const Library &lib, const Layout &layout) {
+	LayoutPiece own;
+	own.macro = -1;
+	own.pos = vec2i(0, 0);
+	own.dir = vec2i(1, 1);
+
+	int count = (int)layout.nets.size();
+	for (auto layer = layout.layers.begin(); layer != layout.layers.end(); layer++) {
+		for (auto r = layer->second.geo.begin(); r != layer->second.geo.end(); r++) {
+			count = max(count, r->net+1);
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		own.nets.push_back(i);
+	}
+
+	vector<LayoutPiece> result(1, own);
+	collectPieces(lib, layout, own.pos, own.dir, own.nets, &count, result);
+	return result;
+}
+
+// Renumber the private nets of a piece, those at or above count, to start
+// at base in order of their first appearance. This keeps the nets of a pair
+// of pieces independent of where in the hierarchy each instance was found so
+// that equivalent pairs share cache entries.
+static vector<int> canonicalNets(const vector<int> &nets, int count, int base) {
+	vector<int> result;
+	result.reserve(nets.size());
+	map<int, int> fresh;
+	for (auto n = nets.begin(); n != nets.end(); n++) {
+		if (*n < count) {
+			result.push_back(*n);
+		} else {
+			result.push_back(fresh.insert(pair<int, int>(*n, base + (int)fresh.size())).first->second);
+		}
+	}
+	return result;
+}
+
+// Find the extent of all of the geometry in eval along the given axis.
+// Returns false if there isn't any.
+static bool evaluationExtent(const Evaluation &eval, int axis, int64_t *lo, int64_t *hi) {
+	bool found = false;
+	auto bound = [&](const Layer &layer) {
+		for (auto r = layer.geo.begin(); r != layer.geo.end(); r++) {
+			if (not found or r->ll[axis] < *lo) {
+				*lo = r->ll[axis];
+			}
+			if (not found or r->ur[axis] > *hi) {
+				*hi = r->ur[axis];
+			}
+			found = true;
+		}
+	};
+
+	for (auto layer = eval.layout->layers.begin(); layer != eval.layout->layers.end(); layer++) {
+		bound(layer->second);
+	}
+	for (auto layer = eval.layers.begin(); layer != eval.layers.end(); layer++) {
+		bound(layer->second);
+	}
+	return found;
+}
+
+bool Library::minOffset(int *offset, int axis, const Layout &left, int leftShift, const Layout &right, int rightShift, int substrateMode, int routingMode, bool horizSpacing) {
+	// Interactions can't reach farther than the largest spacing rule
+	int64_t halo = 0;
+	for (auto rule = tech->rules.begin(); rule != tech->rules.end(); rule++) {
+		if (rule->type == Rule::SPACING and not rule->params.empty() and rule->params[0] > halo) {
+			halo = rule->params[0];
+		}
+	}
+
+	const Layout *layouts[2] = {&left, &right};
+	int shifts[2] = {leftShift, rightShift};
+	Evaluation own[2] = {Evaluation(left), Evaluation(right)};
+	vector<LayoutPiece> pieces[2];
+	// the extent of each piece along the opposite axis, or empty if it has no
+	// geometry
+	vector<vector<int64_t> > extent[2];
+	for (int side = 0; side < 2; side++) {
+		pieces[side] = layoutPieces(*this, *layouts[side]);
+		for (auto p = pieces[side].begin(); p != pieces[side].end(); p++) {
+			const Evaluation &eval = p->macro < 0 ? own[side] : evaluate(p->macro, p->dir);
+			int64_t lo = 0, hi = 0;
+			if (evaluationExtent(eval, 1-axis, &lo, &hi)) {
+				int64_t base = (int64_t)p->pos[1-axis] + shifts[side];
+				extent[side].push_back({lo + base, hi + base});
+			} else {
+				extent[side].push_back(vector<int64_t>());
+			}
+		}
+	}
+
+	// The nets of both layouts share ids, so the private nets of the left
+	// piece of each pair go in a range above the nets of both layouts and
+	// those of the right piece in the range after that.
+	int count[2] = {(int)pieces[0][0].nets.size(), (int)pieces[1][0].nets.size()};
+	int base = max(count[0], count[1]);
+
+	bool conflict = false;
+	for (int i = 0; i < (int)pieces[0].size(); i++) {
+		const LayoutPiece &p0 = pieces[0][i];
+		vector<int> nets0 = canonicalNets(p0.nets, count[0], base);
+		for (int j = 0; j < (int)pieces[1].size(); j++) {
+			const LayoutPiece &p1 = pieces[1][j];
+			if (extent[0][i].empty() or extent[1][j].empty()
+				or extent[1][j][0] >= extent[0][i][1] + halo
+				or extent[0][i][0] >= extent[1][j][1] + halo) {
+				continue;
+			}
+			vector<int> nets1 = canonicalNets(p1.nets, count[1], base + (int)p0.nets.size());
+
+			int shift = (rightShift + p1.pos[1-axis]) - (leftShift + p0.pos[1-axis]);
+			int value = OffsetCurve::NONE;
+			if (p0.macro >= 0 and p1.macro >= 0) {
+				value = offsetCurve(axis, p0.macro, p1.macro, nets0, nets1, p0.dir, p1.dir, substrateMode, routingMode, horizSpacing).at(shift);
+			} else {
+				// The own geometry is different on every call, so building its curve
+				// doesn't pay off. A single sweep at this shift is enough.
+				const Evaluation &e0 = p0.macro < 0 ? own[0] : evaluate(p0.macro, p0.dir);
+				const Evaluation &e1 = p1.macro < 0 ? own[1] : evaluate(p1.macro, p1.dir);
+				phy::minOffset(&value, axis, e0, nets0, leftShift + p0.pos[1-axis], e1, nets1, rightShift + p1.pos[1-axis], substrateMode, routingMode, horizSpacing);
+			}
+
+			if (value != OffsetCurve::NONE) {
+				// move from the coordinates of the pieces to those of the layouts
+				int64_t result = (int64_t)value + p0.pos[axis] - p1.pos[axis];
+				if (result > *offset) {
+					*offset = (int)min(result, (int64_t)std::numeric_limits<int>::max());
+					conflict = true;
+				}
+			}
+		}
+	}
+	return conflict;
+}
+
+map<int, Layer> Library::evaluate(const Layout &top) {
+	vector<LayoutPiece> pieces = layoutPieces(*this, top);
+	Evaluation own(top);
+
+	// The complement of a layer covers everything, so any rule that takes one
+	// mixes the geometry of every piece.
+	bool local = true;
+	for (auto rule = tech->rules.begin(); rule != tech->rules.end(); rule++) {
+		local = local and rule->type != Rule::NOT;
+	}
+
+	// Group the pieces whose geometry overlaps or abuts
+	int n = (int)pieces.size();
+	vector<Rect> box(n);
+	vector<int> group(n), order;
+	auto root = [&](int i) {
+		while (group[i] != i) {
+			group[i] = group[group[i]];
+			i = group[i];
+		}
+		return i;
+	};
+	for (int i = 0; i < n; i++) {
+		group[i] = i;
+		const Evaluation &eval = pieces[i].macro < 0 ? own : evaluate(pieces[i].macro, pieces[i].dir);
+		int64_t lo[2], hi[2];
+		if (evaluationExtent(eval, 0, &lo[0], &hi[0]) and evaluationExtent(eval, 1, &lo[1], &hi[1])) {
+			box[i] = Rect(-1, vec2i((int)lo[0], (int)lo[1]) + pieces[i].pos, vec2i((int)hi[0], (int)hi[1]) + pieces[i].pos);
+			order.push_back(i);
+		}
+	}
+	sort(order.begin(), order.end(), [&](int i, int j) {
+		return box[i].ll[0] < box[j].ll[0];
+	});
+	for (int a = 0; a < (int)order.size(); a++) {
+		int i = order[a];
+		if (not local) {
+			group[i] = order[0];
+			continue;
+		}
+		for (int b = a+1; b < (int)order.size() and box[order[b]].ll[0] <= box[i].ur[0]; b++) {
+			int j = order[b];
+			if (box[i].ll[1] <= box[j].ur[1] and box[j].ll[1] <= box[i].ur[1]) {
+				group[root(j)] = root(i);
+			}
+		}
+	}
+
+	map<int, Layer> result;
+	// Add the derived layers of eval moved by offset with nets renamed by nets
+	// if given. The private nets of the instances keep their own ids while
+	// evaluating, but they don't exist in top so they come out as -1.
+	int count = (int)pieces[0].nets.size();
+	auto add = [&](const Evaluation &eval, vec2i offset, const vector<int> *nets) {
+		auto rename = [&](int net) {
+			if (nets != nullptr) {
+				net = (net >= 0 and net < (int)nets->size()) ? (*nets)[net] : -1;
+			}
+			return net < count ? net : -1;
+		};
+		for (auto layer = eval.layers.begin(); layer != eval.layers.end(); layer++) {
+			if (layer->second.empty()) {
+				continue;
+			}
+
+			auto dst = result.find(layer->first);
+			if (dst == result.end()) {
+				dst = result.insert(pair<int, Layer>(layer->first, Layer(*tech, layer->first))).first;
+				dst->second.isRouting = layer->second.isRouting;
+				dst->second.isSubstrate = layer->second.isSubstrate;
+				dst->second.isPin = layer->second.isPin;
+				dst->second.isWell = layer->second.isWell;
+			}
+			for (auto r = layer->second.geo.begin(); r != layer->second.geo.end(); r++) {
+				Rect rect = r->shift(offset);
+				rect.net = rename(rect.net);
+				dst->second.push(rect);
+			}
+			for (auto l = layer->second.lbl.begin(); l != layer->second.lbl.end(); l++) {
+				Label lbl = *l;
+				lbl.shift_inplace(offset);
+				lbl.net = rename(lbl.net);
+				dst->second.label(lbl);
+			}
+		}
+	};
+
+	map<int, vector<int> > groups;
+	for (auto i = order.begin(); i != order.end(); i++) {
+		groups[root(*i)].push_back(*i);
+	}
+	for (auto g = groups.begin(); g != groups.end(); g++) {
+		if (g->second.size() == 1) {
+			// Nothing else reaches this piece, so its cached evaluation is
+			// already correct
+			const LayoutPiece &p = pieces[g->second[0]];
+			add(p.macro < 0 ? own : evaluate(p.macro, p.dir), p.pos, &p.nets);
+			continue;
+		}
+
+		// Flatten only the pieces that interact and evaluate them together
+		Layout flat(*tech);
+		for (auto i = g->second.begin(); i != g->second.end(); i++) {
+			const LayoutPiece &p = pieces[*i];
+			const Layout &cell = p.macro < 0 ? top : orient(p.macro, p.dir);
+			for (auto layer = cell.layers.begin(); layer != cell.layers.end(); layer++) {
+				vector<Rect> rects;
+				rects.reserve(layer->second.geo.size());
+				for (auto r = layer->second.geo.begin(); r != layer->second.geo.end(); r++) {
+					rects.push_back(r->shift(p.pos));
+					rects.back().net = (r->net >= 0 and r->net < (int)p.nets.size()) ? p.nets[r->net] : -1;
+				}
+				flat.push(layer->first, rects);
+				for (auto l = layer->second.lbl.begin(); l != layer->second.lbl.end(); l++) {
+					Label lbl = *l;
+					lbl.shift_inplace(p.pos);
+					lbl.net = (l->net >= 0 and l->net < (int)p.nets.size()) ? p.nets[l->net] : -1;
+					flat.label(layer->first, lbl);
+				}
+			}
+		}
+		add(Evaluation(flat), vec2i(0, 0), nullptr);
+	}
+	return result;
+}
+
+OffsetTable Library::offsetTable(int axis, int shift, vector<vec2i> dirs, vector<int> macros, int substrateMode, int routingMode, bool horizSpacing) {
+	OffsetTable result;
+	result.axis = axis;
+	result.shift = shift;
+	if (macros.empty()) {
+		for (int i = 0; i < (int)this->macros.size(); i++) {
+			macros.push_back(i);
+		}
+	}
+	result.macros = macros;
+	for (auto d = dirs.begin(); d != dirs.end(); d++) {
+		result.dirs.push_back(orientation(*d));
+	}
+
+	int n = (int)macros.size();
+	int m = (int)dirs.size();
+
+	// Insert every oriented macro and an empty evaluation for it up front so
+	// that the maps aren't modified while the workers fill them in.
+	vector<int> missing;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < m; j++) {
+			int key = macros[i]*4 + result.dirs[j];
+			orient(macros[i], dirs[j]);
+			auto pos = evals.find(key);
+			if (pos == evals.end()) {
+				evals.insert(pair<int, Evaluation>(key, Evaluation(*tech)));
+				missing.push_back(key);
+			} else {
+				pos->second.sync();
+			}
+		}
+	}
+
+	parallelFor((int)missing.size(), [&](int i) {
+		Evaluation &eval = evals.find(missing[i])->second;
+		eval.layout = &oriented.find(missing[i])->second;
+		eval.evaluate();
+		eval.sync();
+	});
+
+	// The identity mapping of each macro only depends on its net count
+	vector<uint64_t> mapHash;
+	mapHash.reserve(n);
+	for (int i = 0; i < n; i++) {
+		mapHash.push_back(hashMapping(this->macros[macros[i]], Mapping<int>(-1, true)));
+	}
+
+	vector<OffsetKey> keys;
+	keys.reserve((size_t)n*n*m*m);
+	for (int l = 0; l < n; l++) {
+		for (int ld = 0; ld < m; ld++) {
+			for (int r = 0; r < n; r++) {
+				uint64_t pairHash = hashPair(mapHash[l], mapHash[r]);
+				for (int rd = 0; rd < m; rd++) {
+					keys.push_back(OffsetKey(macros[l], macros[r], axis, result.dirs[ld], result.dirs[rd], substrateMode, routingMode, horizSpacing, pairHash));
+				}
+			}
+		}
+	}
+
+	// Pairs that already have a cached curve are a lookup, the rest need a
+	// single sweep at this shift which is much cheaper than building their
+	// curve.
+	result.offset.resize(keys.size());
+	parallelFor((int)keys.size(), [&](int i) {
+		const OffsetKey &key = keys[i];
+		auto pos = offsets.find(key);
+		if (pos != offsets.end()) {
+			result.offset[i] = pos->second.at(shift);
+		} else {
+			const Evaluation &e0 = evals.find(key.left*4 + key.leftDir)->second;
+			const Evaluation &e1 = evals.find(key.right*4 + key.rightDir)->second;
+			result.offset[i] = OffsetTable::NONE;
+			phy::minOffset(&result.offset[i], axis, e0, 0, e1, shift, substrateMode, routingMode, horizSpacing);
+		}
+	});
+	return result;
+}
+
+void Library::invalidate(int macro) {
+	// The content hash of the macro has likely changed
+	for (auto i = hashes.begin(); i != hashes.end(); ) {
+		if (i->second == macro) {
+			i = hashes.erase(i);
+		} else {
+			i++;
+		}
+	}
+	hashes.insert(pair<uint64_t, int>(macros[macro].hash(), macro));
+
+	oriented.erase(oriented.lower_bound(macro*4), oriented.lower_bound(macro*4+4));
+	evals.erase(evals.lower_bound(macro*4), evals.lower_bound(macro*4+4));
+	for (auto i = offsets.begin(); i != offsets.end(); ) {
+		if (i->first.left == macro or i->first.right == macro) {
+			i = offsets.erase(i);
+		} else {
+			i++;
+		}
+	}
+}
+
+void Library::invalidate() {
+	reindex();
+	oriented.clear();
+	evals.clear();
+	offsets.clear();
+}
+
+static const char offsetMagic[4] = {'P', 'H', 'Y', 'O'};
+// Version 2 combines a hash of each net mapping into OffsetKey::mapHash
+static const int32_t offsetVersion = 2;
+
+bool Library::saveOffsets(string path) const {
+	Writer w;
+	w.write(offsetMagic, 4);
+	w.write(offsetVersion);
+	w.write(tech->hash());
+
+	w.write((int32_t)macros.size());
+	for (auto m = macros.begin(); m != macros.end(); m++) {
+		w.write(m->hash());
+	}
+
+	w.write((int32_t)offsets.size());
+	for (auto i = offsets.begin(); i != offsets.end(); i++) {
+		const OffsetKey &key = i->first;
+		w.write((int32_t)key.left);
+		w.write((int32_t)key.right);
+		w.write((int32_t)key.axis);
+		w.write((int32_t)key.leftDir);
+		w.write((int32_t)key.rightDir);
+		w.write((int32_t)key.substrateMode);
+		w.write((int32_t)key.routingMode);
+		w.write((int32_t)key.horizSpacing);
+		w.write(key.mapHash);
+
+		w.write((int32_t)i->second.steps.size());
+		for (auto s = i->second.steps.begin(); s != i->second.steps.end(); s++) {
+			w.write((int32_t)s->first);
+			w.write((int32_t)s->second);
+		}
+	}
+
+	return w.save(path);
+}
+
+bool Library::loadOffsets(string path) {
+	MappedFile file;
+	if (not file.open(path)) {
+		return false;
+	}
+	Reader r = file.reader();
+
+	char magic[4];
+	int32_t version = 0;
+	uint64_t techHash = 0;
+	if (not r.read(magic, 4) or memcmp(magic, offsetMagic, 4) != 0 or not r.read(&version) or version != offsetVersion) {
+		printf("%s:%d error: '%s' is not an offset cache.\n", __FILE__, __LINE__, path.c_str());
+		return false;
+	}
+	if (not r.read(&techHash) or techHash != tech->hash()) {
+		// The rules have changed, so nothing in here is valid
+		return false;
+	}
+
+	if (hashes.empty() and not macros.empty()) {
+		reindex();
+	}
+
+	// Macros are matched by content, so the cache survives reordering the
+	// library. Entries for macros that are no longer present are dropped.
+	int32_t macroCount = 0;
+	r.read(&macroCount);
+	vector<int> remap;
+	for (int i = 0; i < macroCount and not r.failed; i++) {
+		uint64_t macroHash = 0;
+		r.read(&macroHash);
+		remap.push_back(find(macroHash));
+	}
+
+	int32_t count = 0;
+	r.read(&count);
+	for (int i = 0; i < count and not r.failed; i++) {
+		int32_t fields[8];
+		uint64_t mapHash = 0;
+		for (int j = 0; j < 8; j++) {
+			r.read(&fields[j]);
+		}
+		r.read(&mapHash);
+
+		OffsetCurve curve;
+		int32_t steps = 0;
+		r.read(&steps);
+		for (int j = 0; j < steps and not r.failed; j++) {
+			int32_t shift = 0, offset = 0;
+			r.read(&shift);
+			r.read(&offset);
+			curve.steps.push_back(pair<int, int>(shift, offset));
+		}
+
+		int left = (fields[0] >= 0 and fields[0] < (int)remap.size()) ? remap[fields[0]] : -1;
+		int right = (fields[1] >= 0 and fields[1] < (int)remap.size()) ? remap[fields[1]] : -1;
+		if (not r.failed and left >= 0 and right >= 0) {
+			offsets[OffsetKey(left, right, fields[2], fields[3], fields[4], fields[5], fields[6], fields[7] != 0, mapHash)] = curve;
+		}
+	}
+
+	if (r.failed) {
+		printf("%s:%d error: offset cache '%s' is truncated.\n", __FILE__, __LINE__, path.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Bound all of the geometry in cell and the instances in it. extent and
+// state are indexed like Library::macros. State is 0 for unvisited, 1 while
+// the macro is being computed, and 2 when done.
+static Rect cellExtent(const Library &lib, const Layout &cell, vector<Rect> &extent, vector<char> &state) {
+	Rect result;
+	for (auto layer = cell.layers.begin(); layer != cell.layers.end(); layer++) {
+		for (auto r = layer->second.geo.begin(); r != layer->second.geo.end(); r++) {
+			result.bound(*r);
+		}
+	}
+
+	for (auto i = cell.inst.begin(); i != cell.inst.end(); i++) {
+		if (i->macro < 0 or i->macro >= (int)lib.macros.size()) {
+			continue;
+		}
+
+		if (state[i->macro] == 0) {
+			state[i->macro] = 1;
+			extent[i->macro] = cellExtent(lib, lib.macros[i->macro], extent, state);
+			state[i->macro] = 2;
+		}
+		if (state[i->macro] == 2 and extent[i->macro].ll != extent[i->macro].ur) {
+			result.bound(extent[i->macro].shift(i->pos, i->dir));
+		}
+	}
+	return result;
+}
+
+FlatView::FlatView(const Library &lib, const Layout &top) {
+	this->lib = &lib;
+	this->top = &top;
+
+	extent.resize(lib.macros.size());
+	vector<char> state(lib.macros.size(), 0);
+	for (int i = 0; i < (int)lib.macros.size(); i++) {
+		if (state[i] == 0) {
+			state[i] = 1;
+			extent[i] = cellExtent(lib, lib.macros[i], extent, state);
+			state[i] = 2;
+		}
+	}
+}
+
+FlatView::~FlatView() {
+}
+
+Rect FlatView::box() const {
+	Rect result;
+	for (auto layer = top->layers.begin(); layer != top->layers.end(); layer++) {
+		for (auto r = layer->second.geo.begin(); r != layer->second.geo.end(); r++) {
+			result.bound(*r);
+		}
+	}
+	for (auto i = top->inst.begin(); i != top->inst.end(); i++) {
+		if (i->macro >= 0 and i->macro < (int)extent.size() and extent[i->macro].ll != extent[i->macro].ur) {
+			result.bound(extent[i->macro].shift(i->pos, i->dir));
+		}
+	}
+	return result;
 }
 
+// Visit the geometry of cell placed at pos + dir*x. nets maps the nets of
+// cell to the nets of the top cell, or is null for the top cell itself.
+// Visit only the layer at draw, or every layer if draw is null
+static void visitCell(const FlatView &view, const Layout &cell, vec2i pos, vec2i dir, const vector<int> *nets, const int *draw, const Rect *window, const function<void(int, const Rect&)> &fn) {
+	for (auto layer = cell.layers.begin(); layer != cell.layers.end(); layer++) {
+		if (draw != nullptr and layer->first != *draw) {
+			continue;
+		}
+
+		for (auto r = layer->second.geo.begin(); r != layer->second.geo.end(); r++) {
+			Rect rect = r->shift(pos, dir);
+			if (window != nullptr and not rect.overlaps(*window)) {
+				continue;
+			}
+			if (nets != nullptr) {
+				rect.net = (rect.net >= 0 and rect.net < (int)nets->size()) ? (*nets)[rect.net] : -1;
+			}
+			fn(layer->first, rect);
+		}
+	}
+
+	for (auto i = cell.inst.begin(); i != cell.inst.end(); i++) {
+		if (i->macro < 0 or i->macro >= (int)view.lib->macros.size()) {
+			continue;
+		}
+
+		vec2i childPos = pos + dir*i->pos;
+		vec2i childDir = dir*i->dir;
+		if (window != nullptr and not view.extent[i->macro].shift(childPos, childDir).overlaps(*window)) {
+			continue;
+		}
+
+		const Layout &macro = view.lib->macros[i->macro];
+		vector<int> childNets(macro.nets.size(), -1);
+		for (int j = 0; j < (int)childNets.size() and j < (int)i->ports.size(); j++) {
+			int port = i->ports[j];
+			if (nets == nullptr) {
+				childNets[j] = port;
+			} else if (port >= 0 and port < (int)nets->size()) {
+				childNets[j] = (*nets)[port];
+			}
+		}
+
+		visitCell(view, macro, childPos, childDir, &childNets, draw, window, fn);
+	}
+}
+
+void FlatView::visit(function<void(int draw, const Rect &rect)> fn) const {
+	visitCell(*this, *top, vec2i(0, 0), vec2i(1, 1), nullptr, nullptr, nullptr, fn);
+}
+
+void FlatView::visit(int draw, function<void(int draw, const Rect &rect)> fn) const {
+	visitCell(*this, *top, vec2i(0, 0), vec2i(1, 1), nullptr, &draw, nullptr, fn);
+}
+
+void FlatView::query(Rect window, function<void(int draw, const Rect &rect)> fn) const {
+	visitCell(*this, *top, vec2i(0, 0), vec2i(1, 1), nullptr, nullptr, &window, fn);
+}
+
+void FlatView::query(int draw, Rect window, function<void(int draw, const Rect &rect)> fn) const {
+	visitCell(*this, *top, vec2i(0, 0), vec2i(1, 1), nullptr, &draw, &window, fn);
+}
+
+}
@@ -1,6 +1,11 @@
 #pragma once
 
 #include <vector>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
 
 #include "Layout.h"
 
@@ -8,13 +13,168 @@ using namespace std;
 
 namespace phy {
 
+// Identifies a cached minOffset() curve between two macros in the Library
+struct OffsetKey {
+	OffsetKey();
+	OffsetKey(int left, int right, int axis, int leftDir, int rightDir, int substrateMode, int routingMode, bool horizSpacing, uint64_t mapHash);
+	~OffsetKey();
+
+	// index into Library::macros
+	int left;
+	int right;
+	int axis;
+	// orientation codes, see orientation()
+	int leftDir;
+	int rightDir;
+	int substrateMode;
+	int routingMode;
+	bool horizSpacing;
+	// fingerprint of the net mappings of both macros
+	uint64_t mapHash;
+};
+
+bool operator<(const OffsetKey &k0, const OffsetKey &k1);
+
+// Encode a direction vector like those in Instance::dir as an index in
+// [0, 4). Bit 0 is set when x is mirrored and bit 1 when y is mirrored.
+int orientation(vec2i dir);
+vec2i direction(int orientation);
+
+// A dense table of minOffset() results between every pair of macros in a
+// set, in every requested orientation, at a single relative shift.
+struct OffsetTable {
+	OffsetTable();
+	~OffsetTable();
+
+	enum {
+		// There is no conflict between this pair
+		NONE = OffsetCurve::NONE,
+	};
+
+	int axis;
+	int shift;
+
+	// index into Library::macros
+	vector<int> macros;
+	// orientation codes, see orientation()
+	vector<int> dirs;
+
+	// indexed by index(left, leftDir, right, rightDir)
+	vector<int> offset;
+
+	// left and right index into macros and leftDir and rightDir index into dirs
+	int index(int left, int leftDir, int right, int rightDir) const;
+	int at(int left, int leftDir, int right, int rightDir) const;
+};
+
 struct Library {
 	Library(const Tech &tech);
 	~Library();
 
 	const Tech *tech;
-	
-	vector<Layout> macros; 
+
+	vector<Layout> macros;
+
+	// Lookup tables into macros by Layout::name and by Layout::hash(). These
+	// are maintained by push() and invalidate(). Call reindex() after
+	// modifying macros directly.
+	unordered_map<string, int> names;
+	unordered_map<uint64_t, int> hashes;
+
+	// These cache the results of minOffset() between macros. The oriented
+	// copies of the macros and their evaluations are indexed by
+	// macro*4+orientation.
+	map<int, Layout> oriented;
+	map<int, Evaluation> evals;
+	map<OffsetKey, OffsetCurve> offsets;
+
+	// Add a macro to the library and return its index. If there is already a
+	// macro with this name, it is replaced.
+	int push(const Layout &macro);
+	// Returns the index into macros or -1 if there isn't one
+	int find(string name) const;
+	int find(uint64_t hash) const;
+	void reindex();
+
+	const Layout &orient(int macro, vec2i dir=vec2i(1,1));
+	const Evaluation &evaluate(int macro, vec2i dir=vec2i(1,1));
+
+	// Like minOffset() for two layouts, except the macros are flipped by
+	// leftDir and rightDir first and the curve over all shifts is cached so
+	// that later calls on the same pair are a lookup.
+	const OffsetCurve &offsetCurve(int axis, int left, int right, vec2i leftDir=vec2i(1,1), vec2i rightDir=vec2i(1,1), int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true, const Mapping<int> &leftMap=Mapping<int>(-1, true), const Mapping<int> &rightMap=Mapping<int>(-1, true));
+	bool minOffset(int *offset, int axis, int left, int leftShift, int right, int rightShift, vec2i leftDir=vec2i(1,1), vec2i rightDir=vec2i(1,1), int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true, const Mapping<int> &leftMap=Mapping<int>(-1, true), const Mapping<int> &rightMap=Mapping<int>(-1, true));
+	// leftNets[i] and rightNets[i] are the new ids of net i of each macro.
+	const OffsetCurve &offsetCurve(int axis, int left, int right, const vector<int> &leftNets, const vector<int> &rightNets, vec2i leftDir=vec2i(1,1), vec2i rightDir=vec2i(1,1), int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true);
+
+	// Compute minOffset() between two layouts built from instances of macros
+	// in this library without flattening them. Each layout is split into its
+	// own geometry and the geometry of every macro instance in its hierarchy.
+	// Pairs of pieces are only compared when they are within the largest
+	// spacing rule of each other along the opposite axis, and pairs of
+	// instances use the cached curves from offsetCurve(). Macro nets that
+	// aren't connected to a port are private to their instance, as they would
+	// be after flattening. Derived layers are evaluated per piece, so rules
+	// that combine geometry across instance boundaries aren't seen.
+	bool minOffset(int *offset, int axis, const Layout &left, int leftShift, const Layout &right, int rightShift, int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true);
+
+	// Evaluate the rules of the technology over a layout built from instances
+	// of macros in this library as if it were flattened, and return the
+	// derived layers indexed like Evaluation::layers. Pieces of the hierarchy
+	// that don't overlap or abut any other piece reuse the cached evaluation
+	// of their macro. Only the groups of pieces that touch are flattened and
+	// evaluated together. If the technology takes the complement of a layer,
+	// every piece interacts and the whole layout is flattened.
+	map<int, Layer> evaluate(const Layout &top);
+
+	// Compute the offset between every pair of macros in every pair of the
+	// given orientations. An empty macro list means all macros. Each oriented
+	// macro is evaluated once up front, then the pairs are computed in
+	// parallel. Pairs with a curve from offsetCurve() are read from the cache.
+	OffsetTable offsetTable(int axis, int shift=0, vector<vec2i> dirs=vector<vec2i>(1, vec2i(1,1)), vector<int> macros=vector<int>(), int substrateMode=Layout::DEFAULT, int routingMode=Layout::DEFAULT, bool horizSpacing=true);
+
+	// Drop everything cached for this macro. This must be called whenever a
+	// macro is modified.
+	void invalidate(int macro);
+	void invalidate();
+
+	// The offset cache is saved along with the hash of the technology and of
+	// every macro it references. On load, macros are matched by content hash
+	// so entries whose macros have since changed are dropped, and the whole
+	// file is rejected if the technology has changed.
+	bool saveOffsets(string path) const;
+	bool loadOffsets(string path);
+};
+
+// A read-only view of a hierarchical layout as if it were flat. Geometry in
+// the instances of top is transformed into the coordinates of top as it is
+// visited rather than copied, so memory use stays proportional to the number
+// of unique cells. Instance::macro indexes into Library::macros and
+// Instance::ports[i] is the net of the parent cell connected to net i of the
+// macro. Macro nets that aren't connected to a port come out as -1. The
+// hierarchy must not be recursive.
+struct FlatView {
+	FlatView(const Library &lib, const Layout &top);
+	~FlatView();
+
+	const Library *lib;
+	const Layout *top;
+
+	// The bounding box of all of the geometry in each macro including its
+	// instances, indexed like Library::macros.
+	vector<Rect> extent;
+
+	Rect box() const;
+
+	// Call fn on every rectangle of every layer, or only of the layer at draw.
+	// Any draw is matched exactly, including the negative ones of rule
+	// results.
+	void visit(function<void(int draw, const Rect &rect)> fn) const;
+	void visit(int draw, function<void(int draw, const Rect &rect)> fn) const;
+	// Like visit() but only for rectangles that overlap window. Instances that
+	// fall entirely outside of the window are skipped.
+	void query(Rect window, function<void(int draw, const Rect &rect)> fn) const;
+	void query(int draw, Rect window, function<void(int draw, const Rect &rect)> fn) const;
 };
 
 }
@@ -0,0 +1,666 @@
+#include "Loom.h"
+#include "Binary.h"
+
+#include <set>
+#include <limits>
+#include <cerrno>
+#include <cstdlib>
+
+namespace phy {
+
+LoomValue::LoomValue() {
+	type = NONE;
+	integer = 0;
+	real = 0.0;
+}
+
+LoomValue::~LoomValue() {
+}
+
+static LoomValue makeInt(long long value) {
+	LoomValue result;
+	result.type = LoomValue::INT;
+	result.integer = value;
+	return result;
+}
+
+static LoomValue makeFloat(double value) {
+	LoomValue result;
+	result.type = LoomValue::FLOAT;
+	result.real = value;
+	return result;
+}
+
+static LoomValue makeLevel(Level level) {
+	LoomValue result;
+	result.type = LoomValue::TUPLE;
+	result.items.push_back(makeInt(level.type));
+	result.items.push_back(makeInt(level.idx));
+	return result;
+}
+
+// Each of these leaves result untouched if the parameter wasn't given so
+// that it keeps its default value.
+
+static bool asInt(const LoomValue &v, int *result) {
+	if (v.type == LoomValue::NONE) {
+		return true;
+	} else if (v.type != LoomValue::INT
+		or v.integer < numeric_limits<int>::min()
+		or v.integer > numeric_limits<int>::max()) {
+		return false;
+	}
+	*result = (int)v.integer;
+	return true;
+}
+
+static bool asFloat(const LoomValue &v, double *result) {
+	if (v.type == LoomValue::NONE) {
+		return true;
+	} else if (v.type == LoomValue::INT) {
+		*result = (double)v.integer;
+		return true;
+	} else if (v.type == LoomValue::FLOAT) {
+		*result = v.real;
+		return true;
+	}
+	return false;
+}
+
+static bool asFloat(const LoomValue &v, float *result) {
+	double value = *result;
+	if (not asFloat(v, &value)) {
+		return false;
+	}
+	*result = (float)value;
+	return true;
+}
+
+static bool asString(const LoomValue &v, string *result) {
+	if (v.type == LoomValue::NONE) {
+		return true;
+	} else if (v.type != LoomValue::STRING) {
+		return false;
+	}
+	*result = v.text;
+	return true;
+}
+
+static bool asLevel(const LoomValue &v, Level *result) {
+	if (v.type == LoomValue::NONE) {
+		return true;
+	} else if (v.type != LoomValue::TUPLE or v.items.size() != 2) {
+		return false;
+	}
+	int type = 0, idx = 0;
+	if (not asInt(v.items[0], &type) or not asInt(v.items[1], &idx)) {
+		return false;
+	}
+	*result = Level(type, idx);
+	return true;
+}
+
+static bool asInts(const LoomValue &v, vector<int> *result) {
+	if (v.type == LoomValue::NONE) {
+		return true;
+	} else if (v.type != LoomValue::LIST) {
+		return false;
+	}
+	result->clear();
+	for (auto i = v.items.begin(); i != v.items.end(); i++) {
+		int value = 0;
+		if (i->type == LoomValue::NONE or not asInt(*i, &value)) {
+			return false;
+		}
+		result->push_back(value);
+	}
+	return true;
+}
+
+static bool asBins(const LoomValue &v, vector<pair<int, int> > *result) {
+	if (v.type == LoomValue::NONE) {
+		return true;
+	} else if (v.type != LoomValue::LIST) {
+		return false;
+	}
+	result->clear();
+	for (auto i = v.items.begin(); i != v.items.end(); i++) {
+		int lo = 0, hi = 0;
+		if (i->type != LoomValue::TUPLE or i->items.size() != 2
+			or i->items[0].type != LoomValue::INT or i->items[1].type != LoomValue::INT
+			or not asInt(i->items[0], &lo) or not asInt(i->items[1], &hi)) {
+			return false;
+		}
+		result->push_back(pair<int, int>(lo, hi));
+	}
+	return true;
+}
+
+// Match the arguments of a call to the parameters of a loom function the
+// same way python does. Parameters that weren't given are left as NONE.
+static bool bind(const vector<LoomValue> &args, const map<string, LoomValue> &kwargs, vector<string> params, int required, vector<LoomValue> *result) {
+	if (args.size() > params.size()) {
+		return false;
+	}
+
+	result->assign(params.size(), LoomValue());
+	for (int i = 0; i < (int)args.size(); i++) {
+		(*result)[i] = args[i];
+	}
+	for (auto i = kwargs.begin(); i != kwargs.end(); i++) {
+		int idx = 0;
+		while (idx < (int)params.size() and params[idx] != i->first) {
+			idx++;
+		}
+		if (idx >= (int)params.size() or idx < (int)args.size()) {
+			return false;
+		}
+		(*result)[idx] = i->second;
+	}
+	for (int i = 0; i < required; i++) {
+		if ((*result)[i].type == LoomValue::NONE) {
+			return false;
+		}
+	}
+	return true;
+}
+
+LoomParser::LoomParser(Tech &tech) {
+	this->tech = &tech;
+	this->pos = 0;
+	this->depth = 0;
+	this->imported = false;
+}
+
+LoomParser::~LoomParser() {
+}
+
+int LoomParser::peek(size_t offset) const {
+	if (pos+offset >= src.size()) {
+		return -1;
+	}
+	return (unsigned char)src[pos+offset];
+}
+
+void LoomParser::skip() {
+	while (true) {
+		int c = peek();
+		if (c == ' ' or c == '\t' or c == '\r' or (depth > 0 and c == '\n')) {
+			pos++;
+		} else if (c == '#') {
+			while (peek() >= 0 and peek() != '\n') {
+				pos++;
+			}
+		} else {
+			return;
+		}
+	}
+}
+
+bool LoomParser::accept(char c) {
+	skip();
+	if (peek() == c) {
+		pos++;
+		return true;
+	}
+	return false;
+}
+
+bool LoomParser::identifier(string *result) {
+	skip();
+	if (not isalpha(peek()) and peek() != '_') {
+		return false;
+	}
+	size_t start = pos;
+	while (isalnum(peek()) or peek() == '_') {
+		pos++;
+	}
+	*result = string(src.substr(start, pos-start));
+	return true;
+}
+
+bool LoomParser::endOfStatement() {
+	skip();
+	if (peek() < 0) {
+		return true;
+	} else if (peek() == '\n') {
+		pos++;
+		return true;
+	}
+	return false;
+}
+
+bool LoomParser::parse(string_view src) {
+	this->src = src;
+	pos = 0;
+	depth = 0;
+	while (peek() >= 0) {
+		bool indented = (peek() == ' ' or peek() == '\t');
+		skip();
+		if (peek() == '\n') {
+			pos++;
+		} else if (peek() < 0) {
+			break;
+		} else if (indented or not statement()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool LoomParser::statement() {
+	static const set<string> keywords = {
+		"False", "None", "True", "and", "as", "assert", "async", "await",
+		"break", "class", "continue", "def", "del", "elif", "else", "except",
+		"finally", "for", "from", "global", "if", "import", "in", "is",
+		"lambda", "nonlocal", "not", "or", "pass", "raise", "return", "try",
+		"while", "with", "yield",
+	};
+
+	size_t start = pos;
+	string name;
+	if (not identifier(&name)) {
+		return false;
+	}
+
+	if (name == "import") {
+		string module;
+		if (not identifier(&module) or module != "loom") {
+			return false;
+		}
+		imported = true;
+		return endOfStatement();
+	}
+
+	skip();
+	if (peek() == '=' and peek(1) != '=') {
+		pos++;
+		if (name == "loom" or keywords.find(name) != keywords.end()) {
+			return false;
+		}
+		LoomValue result;
+		if (not value(&result)) {
+			return false;
+		}
+		names[name] = result;
+		return endOfStatement();
+	}
+
+	pos = start;
+	LoomValue result;
+	return value(&result) and endOfStatement();
+}
+
+bool LoomParser::value(LoomValue *result) {
+	skip();
+	int c = peek();
+	if (c == '-') {
+		pos++;
+		skip();
+		if (isdigit(peek()) or (peek() == '.' and isdigit(peek(1)))) {
+			return number(true, result);
+		}
+		return false;
+	} else if (isdigit(c) or (c == '.' and isdigit(peek(1)))) {
+		return number(false, result);
+	} else if (c == '"' or c == '\'') {
+		return text(result);
+	} else if (c == '(') {
+		pos++;
+		depth++;
+		return sequence(')', result);
+	} else if (c == '[') {
+		pos++;
+		depth++;
+		return sequence(']', result);
+	}
+
+	string name;
+	if (not identifier(&name)) {
+		return false;
+	}
+
+	if (name == "loom") {
+		string function;
+		if (not imported or not accept('.') or not identifier(&function) or not accept('(')) {
+			return false;
+		}
+		depth++;
+		return call(function, result);
+	}
+
+	auto found = names.find(name);
+	if (found == names.end()) {
+		return false;
+	}
+	*result = found->second;
+	return true;
+}
+
+bool LoomParser::number(bool negative, LoomValue *result) {
+	size_t start = pos;
+	bool isFloat = false;
+	while (isdigit(peek())) {
+		pos++;
+	}
+	if (peek() == '.') {
+		isFloat = true;
+		pos++;
+		while (isdigit(peek())) {
+			pos++;
+		}
+	}
+	if (peek() == 'e' or peek() == 'E') {
+		isFloat = true;
+		pos++;
+		if (peek() == '+' or peek() == '-') {
+			pos++;
+		}
+		if (not isdigit(peek())) {
+			return false;
+		}
+		while (isdigit(peek())) {
+			pos++;
+		}
+	}
+	// hex, underscores, imaginary numbers and the like
+	if (isalnum(peek()) or peek() == '_' or peek() == '.') {
+		return false;
+	}
+
+	string token(src.substr(start, pos-start));
+	if (isFloat) {
+		*result = makeFloat(strtod(token.c_str(), nullptr));
+		if (negative) {
+			result->real = -result->real;
+		}
+		return true;
+	}
+
+	// python doesn't allow leading zeros on integers
+	if (token.size() > 1 and token[0] == '0' and token.find_first_not_of('0') != string::npos) {
+		return false;
+	}
+	errno = 0;
+	long long value = strtoll(token.c_str(), nullptr, 10);
+	if (errno == ERANGE) {
+		return false;
+	}
+	*result = makeInt(negative ? -value : value);
+	return true;
+}
+
+bool LoomParser::text(LoomValue *result) {
+	char quote = (char)peek();
+	pos++;
+	if (peek() == quote and peek(1) == quote) {
+		// triple quoted strings
+		return false;
+	}
+
+	size_t start = pos;
+	while (peek() != quote) {
+		if (peek() < 0 or peek() == '\n' or peek() == '\\') {
+			return false;
+		}
+		pos++;
+	}
+	result->type = LoomValue::STRING;
+	result->text = string(src.substr(start, pos-start));
+	pos++;
+	return true;
+}
+
+bool LoomParser::sequence(char close, LoomValue *result) {
+	result->type = close == ')' ? LoomValue::TUPLE : LoomValue::LIST;
+	result->items.clear();
+	bool comma = false;
+	while (true) {
+		if (accept(close)) {
+			break;
+		}
+		result->items.push_back(LoomValue());
+		if (not value(&result->items.back())) {
+			return false;
+		}
+		comma = accept(',');
+		if (not comma) {
+			if (not accept(close)) {
+				return false;
+			}
+			break;
+		}
+	}
+	depth--;
+
+	// (value) is just the value
+	if (close == ')' and result->items.size() == 1 and not comma) {
+		LoomValue inner = result->items[0];
+		*result = inner;
+	}
+	return true;
+}
+
+bool LoomParser::call(string name, LoomValue *result) {
+	vector<LoomValue> args;
+	map<string, LoomValue> kwargs;
+	while (not accept(')')) {
+		size_t start = pos;
+		string key;
+		if (identifier(&key) and accept('=') and peek() != '=') {
+			if (kwargs.find(key) != kwargs.end() or not value(&kwargs[key])) {
+				return false;
+			}
+		} else {
+			pos = start;
+			args.push_back(LoomValue());
+			if (not kwargs.empty() or not value(&args.back())) {
+				return false;
+			}
+		}
+
+		if (not accept(',')) {
+			if (not accept(')')) {
+				return false;
+			}
+			break;
+		}
+	}
+	depth--;
+
+	return apply(name, args, kwargs, result);
+}
+
+// Each of these does the same thing as the python function of the same name
+// in Script.cpp
+bool LoomParser::apply(string name, vector<LoomValue> args, map<string, LoomValue> kwargs, LoomValue *result) {
+	vector<LoomValue> v;
+	*result = LoomValue();
+	if (name == "b_and" or name == "b_or") {
+		vector<int> layers;
+		LoomValue list;
+		list.type = LoomValue::LIST;
+		list.items = args;
+		if (not kwargs.empty() or not asInts(list, &layers) or layers.size() < 2) {
+			return false;
+		}
+		*result = makeInt(name == "b_and" ? tech->setAnd(layers) : tech->setOr(layers));
+		return true;
+	} else if (name == "nmos" or name == "pmos") {
+		string variant, model;
+		Level diff;
+		vector<pair<int, int> > bins;
+		if (not bind(args, kwargs, {"variant", "name", "diff", "bins"}, 3, &v)
+			or not asString(v[0], &variant) or not asString(v[1], &model)
+			or not asLevel(v[2], &diff) or not asBins(v[3], &bins)) {
+			return false;
+		}
+		tech->models.push_back(Model(name == "nmos" ? Model::NMOS : Model::PMOS, variant, model, diff, bins));
+		return true;
+	} else if (name == "dielec") {
+		Level down, up;
+		float thickness = 0.0f;
+		float permitivity = 0.0f;
+		if (not bind(args, kwargs, {"down", "up", "thick", "permit"}, 3, &v)
+			or not asLevel(v[0], &down) or not asLevel(v[1], &up)
+			or not asFloat(v[2], &thickness) or not asFloat(v[3], &permitivity)) {
+			return false;
+		}
+		tech->dielec.push_back(Dielectric(down, up, thickness, permitivity));
+		return true;
+	} else if (name == "subst" or name == "well") {
+		int draw = -1;
+		int label = -1;
+		int pin = -1;
+		int tap = -1;
+		vector<int> mask, excl;
+		Level well;
+		float thickness = 0.0f;
+		float resistivity = 0.0f;
+		if (name == "subst") {
+			if (not bind(args, kwargs, {"draw", "label", "pin", "mask", "excl", "well", "thick", "resist"}, 1, &v)
+				or not asInt(v[0], &draw) or not asInt(v[1], &label) or not asInt(v[2], &pin)
+				or not asInts(v[3], &mask) or not asInts(v[4], &excl) or not asLevel(v[5], &well)
+				or not asFloat(v[6], &thickness) or not asFloat(v[7], &resistivity)) {
+				return false;
+			}
+		} else if (not bind(args, kwargs, {"draw", "label", "pin", "tap", "mask", "excl", "thick", "resist"}, 1, &v)
+			or not asInt(v[0], &draw) or not asInt(v[1], &label) or not asInt(v[2], &pin) or not asInt(v[3], &tap)
+			or not asInts(v[4], &mask) or not asInts(v[5], &excl)
+			or not asFloat(v[6], &thickness) or not asFloat(v[7], &resistivity)) {
+			return false;
+		}
+
+		*result = makeLevel(Level(Level::SUBST, (int)tech->subst.size()));
+		tech->subst.push_back(Substrate(draw, label, pin, tap, well, thickness, resistivity));
+		tech->subst.back().mask = mask;
+		tech->subst.back().excl = excl;
+		return true;
+	} else if (name == "via") {
+		Level down, up;
+		int draw = -1;
+		int label = -1;
+		int pin = -1;
+		float thickness = 0.0f;
+		float resistivity = 0.0f;
+		if (not bind(args, kwargs, {"down", "up", "draw", "label", "pin", "thick", "resist"}, 3, &v)
+			or not asLevel(v[0], &down) or not asLevel(v[1], &up)
+			or not asInt(v[2], &draw) or not asInt(v[3], &label) or not asInt(v[4], &pin)
+			or not asFloat(v[5], &thickness) or not asFloat(v[6], &resistivity)) {
+			return false;
+		}
+		*result = makeLevel(Level(Level::VIA, (int)tech->vias.size()));
+		tech->vias.push_back(Via(down, up, draw, label, pin, thickness, resistivity));
+		return true;
+	} else if (name == "route") {
+		int draw = -1;
+		int label = -1;
+		int pin = -1;
+		float thickness = 0.0f;
+		float resistivity = 0.0f;
+		if (not bind(args, kwargs, {"draw", "label", "pin", "thick", "resist"}, 1, &v)
+			or not asInt(v[0], &draw) or not asInt(v[1], &label) or not asInt(v[2], &pin)
+			or not asFloat(v[3], &thickness) or not asFloat(v[4], &resistivity)) {
+			return false;
+		}
+		*result = makeLevel(Level(Level::ROUTE, (int)tech->wires.size()));
+		tech->wires.push_back(Routing(draw, label, pin, thickness, resistivity));
+		return true;
+	}
+
+	// The rest only take positional arguments
+	if (not kwargs.empty()) {
+		return false;
+	}
+
+	if (name == "dbunit" or name == "scale") {
+		double value = -1;
+		if (not bind(args, kwargs, {"value"}, 1, &v) or not asFloat(v[0], &value)) {
+			return false;
+		}
+		(name == "dbunit" ? tech->dbunit : tech->scale) = value;
+		*result = makeFloat(value);
+	} else if (name == "paint") {
+		string paint;
+		int major = -1;
+		int minor = -1;
+		if (not bind(args, kwargs, {"name", "major", "minor"}, 3, &v)
+			or not asString(v[0], &paint) or not asInt(v[1], &major) or not asInt(v[2], &minor)) {
+			return false;
+		}
+		*result = makeInt((int)tech->paint.size());
+		tech->paint.push_back(Paint(paint, major, minor));
+	} else if (name == "width") {
+		int layer = -1;
+		int width = -1;
+		if (not bind(args, kwargs, {"layer", "width"}, 2, &v)
+			or not asInt(v[0], &layer) or not asInt(v[1], &width)) {
+			return false;
+		}
+		tech->setWidth(layer, width);
+		*result = makeInt(layer);
+	} else if (name == "fill") {
+		int layer = -1;
+		if (not bind(args, kwargs, {"layer"}, 1, &v) or not asInt(v[0], &layer)
+			or layer < 0 or layer >= (int)tech->paint.size()) {
+			return false;
+		}
+		tech->paint[layer].fill = true;
+		*result = makeInt(layer);
+	} else if (name == "spacing") {
+		int l0 = -1;
+		int l1 = -1;
+		int value = -1;
+		if (not bind(args, kwargs, {"l0", "l1", "value"}, 3, &v)
+			or not asInt(v[0], &l0) or not asInt(v[1], &l1) or not asInt(v[2], &value)) {
+			return false;
+		}
+		*result = makeInt(tech->setSpacing(l0, l1, value));
+	} else if (name == "enclosing") {
+		int l0 = -1;
+		int l1 = -1;
+		int lo = -1;
+		int hi = -1;
+		if (not bind(args, kwargs, {"l0", "l1", "lo", "hi"}, 3, &v)
+			or not asInt(v[0], &l0) or not asInt(v[1], &l1) or not asInt(v[2], &lo) or not asInt(v[3], &hi)
+			or l0 < 0) {
+			return false;
+		}
+		*result = makeInt(tech->setEnclosing(l0, l1, lo, hi));
+	} else if (name == "b_not") {
+		int l0 = -1;
+		if (not bind(args, kwargs, {"l0"}, 1, &v) or not asInt(v[0], &l0)) {
+			return false;
+		}
+		*result = makeInt(tech->setNot(l0));
+	} else if (name == "bound") {
+		int l0 = -1;
+		if (not bind(args, kwargs, {"l0"}, 1, &v) or not asInt(v[0], &l0)) {
+			return false;
+		}
+		tech->boundary = l0;
+		*result = makeInt(l0);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+bool parseLoom(Tech &dst, string path) {
+	MappedFile file;
+	if (not file.open(path)) {
+		return false;
+	}
+
+	// Work on a copy so that a script outside of the subset leaves dst as it
+	// was for python.
+	Tech result = dst;
+	LoomParser parser(result);
+	if (not parser.parse(string_view(file.data, file.size))) {
+		return false;
+	}
+	dst = result;
+	return true;
+}
+
+}
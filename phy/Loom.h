@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+
+#include "Tech.h"
+
+using namespace std;
+
+namespace phy {
+
+// Most technology scripts only call the functions of the loom module with
+// literal arguments. These are read directly without starting python. A
+// script may only use the following subset of python:
+//
+//   - blank lines and # comments
+//   - import loom
+//   - name = value
+//   - a call on a line by itself, loom.function(value, ..., key=value, ...)
+//
+// where a value is an integer, a decimal or exponent float, a string in
+// single or double quotes without escapes, a name assigned earlier, a tuple
+// (value, ...), a list [value, ...], a leading - on a number, or a call to a
+// loom function. Calls, tuples and lists may span multiple lines. Anything
+// else, including sys.argv, other imports, expressions, and control flow,
+// puts the script outside of the subset.
+
+struct LoomValue {
+	LoomValue();
+	~LoomValue();
+
+	enum {
+		NONE = 0,
+		INT = 1,
+		FLOAT = 2,
+		STRING = 3,
+		TUPLE = 4,
+		LIST = 5,
+	};
+
+	int type;
+	long long integer;
+	double real;
+	string text;
+	vector<LoomValue> items;
+};
+
+struct LoomParser {
+	LoomParser(Tech &tech);
+	~LoomParser();
+
+	Tech *tech;
+
+	string_view src;
+	size_t pos;
+	// count of open brackets, newlines inside of brackets are whitespace
+	int depth;
+
+	bool imported;
+	map<string, LoomValue> names;
+
+	// Returns false if the script is outside of the subset. tech may be
+	// partially filled in that case.
+	bool parse(string_view src);
+
+private:
+	int peek(size_t offset=0) const;
+	void skip();
+	bool accept(char c);
+	bool identifier(string *result);
+	bool endOfStatement();
+
+	bool statement();
+	bool value(LoomValue *result);
+	bool number(bool negative, LoomValue *result);
+	bool text(LoomValue *result);
+	bool sequence(char close, LoomValue *result);
+	bool call(string name, LoomValue *result);
+	bool apply(string name, vector<LoomValue> args, map<string, LoomValue> kwargs, LoomValue *result);
+};
+
+// Fill dst from the script at path if the script stays within the subset
+// described above. Returns false and leaves dst untouched otherwise, in
+// which case the script has to be run by python, see Interpreter::load().
+bool parseLoom(Tech &dst, string path);
+
+}
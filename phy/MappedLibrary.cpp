@@ -0,0 +1,547 @@
+#include "MappedLibrary.h"
+
+#include <cstring>
+#include <type_traits>
+
+namespace phy {
+
+// Rect arrays are handed out directly from the mapped file
+static_assert(std::is_standard_layout<Rect>::value, "Rect must be standard layout to be read in place");
+static_assert(sizeof(Rect) == 5*sizeof(int32_t), "Rect must be packed to be read in place");
+static_assert(sizeof(vec2i) == 2*sizeof(int32_t), "vec2i must be packed to be read in place");
+
+static const char MAPPED_MAGIC[4] = {'P', 'H', 'Y', 'L'};
+static const int32_t MAPPED_VERSION = 1;
+static const uint32_t MAPPED_ENDIAN = 0x01020304;
+
+// Reserve an 8 byte aligned, zero filled region at the end of data and
+// return its offset.
+static uint64_t reserve(vector<char> &data, size_t size) {
+	size_t offset = (data.size()+7)&~(size_t)7;
+	data.resize(offset+size, 0);
+	return offset;
+}
+
+template <typename T>
+static void put(vector<char> &data, uint64_t offset, const T &value) {
+	memcpy(data.data()+offset, &value, sizeof(T));
+}
+
+static MappedString putString(vector<char> &data, const string &str) {
+	MappedString result;
+	result.offset = data.size();
+	result.length = (int32_t)str.size();
+	result.pad = 0;
+	data.insert(data.end(), str.begin(), str.end());
+	return result;
+}
+
+static void putRect(int32_t *dst, const Rect &r) {
+	dst[0] = r.net;
+	dst[1] = r.ll[0];
+	dst[2] = r.ll[1];
+	dst[3] = r.ur[0];
+	dst[4] = r.ur[1];
+}
+
+static Rect getRect(const int32_t *src) {
+	Rect result;
+	result.net = src[0];
+	result.ll = vec2i(src[1], src[2]);
+	result.ur = vec2i(src[3], src[4]);
+	return result;
+}
+
+static string_view getString(const char *base, const MappedString &str) {
+	return string_view(base+str.offset, str.length);
+}
+
+static void putLayer(vector<char> &data, uint64_t offset, const Layer &layer) {
+	MappedLayer entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.draw = layer.draw;
+	entry.rectCount = (int32_t)layer.geo.size();
+	entry.polyCount = (int32_t)layer.poly.size();
+	entry.labelCount = (int32_t)layer.lbl.size();
+	putRect(entry.box, layer.box);
+
+	entry.rects = reserve(data, layer.geo.size()*sizeof(Rect));
+	if (not layer.geo.empty()) {
+		memcpy(data.data()+entry.rects, layer.geo.data(), layer.geo.size()*sizeof(Rect));
+	}
+
+	entry.polys = reserve(data, layer.poly.size()*sizeof(MappedPoly));
+	for (int i = 0; i < (int)layer.poly.size(); i++) {
+		const Poly &gon = layer.poly[i];
+		MappedPoly poly;
+		poly.net = gon.net;
+		poly.vertCount = (int32_t)gon.v.size();
+		poly.verts = reserve(data, gon.v.size()*sizeof(vec2i));
+		if (not gon.v.empty()) {
+			memcpy(data.data()+poly.verts, gon.v.data(), gon.v.size()*sizeof(vec2i));
+		}
+		put(data, entry.polys+i*sizeof(MappedPoly), poly);
+	}
+
+	entry.labels = reserve(data, layer.lbl.size()*sizeof(MappedLabel));
+	for (int i = 0; i < (int)layer.lbl.size(); i++) {
+		const Label &lbl = layer.lbl[i];
+		MappedLabel label;
+		label.net = lbl.net;
+		label.pos[0] = lbl.pos[0];
+		label.pos[1] = lbl.pos[1];
+		label.pad = 0;
+		label.txt = putString(data, lbl.txt);
+		put(data, entry.labels+i*sizeof(MappedLabel), label);
+	}
+
+	put(data, offset, entry);
+}
+
+static void putMacro(vector<char> &data, uint64_t offset, const Layout &macro) {
+	MappedMacro entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.name = putString(data, macro.name);
+	putRect(entry.box, macro.box);
+	entry.layerCount = (int32_t)macro.layers.size();
+	entry.netCount = (int32_t)macro.nets.size();
+	entry.instCount = (int32_t)macro.inst.size();
+	entry.hash = macro.hash();
+
+	entry.layers = reserve(data, macro.layers.size()*sizeof(MappedLayer));
+	int i = 0;
+	for (auto layer = macro.layers.begin(); layer != macro.layers.end(); layer++, i++) {
+		putLayer(data, entry.layers+i*sizeof(MappedLayer), layer->second);
+	}
+
+	entry.nets = reserve(data, macro.nets.size()*sizeof(MappedNet));
+	for (i = 0; i < (int)macro.nets.size(); i++) {
+		const Net &n = macro.nets[i];
+		MappedNet net;
+		net.nameCount = (int32_t)n.names.size();
+		net.flags = (n.isVdd ? MappedNet::VDD : 0)
+			| (n.isGND ? MappedNet::GND : 0)
+			| (n.isInput ? MappedNet::INPUT : 0)
+			| (n.isOutput ? MappedNet::OUTPUT : 0)
+			| (n.isSub ? MappedNet::SUB : 0);
+		net.names = reserve(data, n.names.size()*sizeof(MappedString));
+		for (int j = 0; j < (int)n.names.size(); j++) {
+			put(data, net.names+j*sizeof(MappedString), putString(data, n.names[j]));
+		}
+		put(data, entry.nets+i*sizeof(MappedNet), net);
+	}
+
+	entry.insts = reserve(data, macro.inst.size()*sizeof(MappedInstance));
+	for (i = 0; i < (int)macro.inst.size(); i++) {
+		const Instance &ci = macro.inst[i];
+		MappedInstance inst;
+		inst.macro = ci.macro;
+		inst.pos[0] = ci.pos[0];
+		inst.pos[1] = ci.pos[1];
+		inst.dir[0] = ci.dir[0];
+		inst.dir[1] = ci.dir[1];
+		inst.portCount = (int32_t)ci.ports.size();
+		inst.ports = reserve(data, ci.ports.size()*sizeof(int32_t));
+		for (int j = 0; j < (int)ci.ports.size(); j++) {
+			put(data, inst.ports+j*sizeof(int32_t), (int32_t)ci.ports[j]);
+		}
+		put(data, entry.insts+i*sizeof(MappedInstance), inst);
+	}
+
+	put(data, offset, entry);
+}
+
+bool saveMapped(const Library &lib, string path) {
+	Writer out;
+	vector<char> &data = out.data;
+
+	MappedHeader header;
+	memset(&header, 0, sizeof(header));
+	uint64_t offset = reserve(data, sizeof(MappedHeader));
+	memcpy(header.magic, MAPPED_MAGIC, 4);
+	header.version = MAPPED_VERSION;
+	header.endian = MAPPED_ENDIAN;
+	header.rectSize = (int32_t)sizeof(Rect);
+	header.techHash = lib.tech->hash();
+	header.macroCount = (int32_t)lib.macros.size();
+	header.macros = reserve(data, lib.macros.size()*sizeof(MappedMacro));
+	for (int i = 0; i < (int)lib.macros.size(); i++) {
+		putMacro(data, header.macros+i*sizeof(MappedMacro), lib.macros[i]);
+	}
+	put(data, offset, header);
+
+	return out.save(path);
+}
+
+LayerView::LayerView() {
+	base = nullptr;
+	layer = nullptr;
+}
+
+LayerView::LayerView(const char *base, const MappedLayer *layer) {
+	this->base = base;
+	this->layer = layer;
+}
+
+LayerView::~LayerView() {
+}
+
+int LayerView::draw() const {
+	return layer == nullptr ? Layer::UNKNOWN : layer->draw;
+}
+
+int LayerView::size() const {
+	return layer == nullptr ? 0 : layer->rectCount;
+}
+
+const Rect *LayerView::begin() const {
+	if (layer == nullptr) {
+		return nullptr;
+	}
+	return (const Rect *)(base+layer->rects);
+}
+
+const Rect *LayerView::end() const {
+	return begin()+size();
+}
+
+const Rect &LayerView::operator[](int idx) const {
+	return begin()[idx];
+}
+
+int LayerView::polys() const {
+	return layer == nullptr ? 0 : layer->polyCount;
+}
+
+Poly LayerView::poly(int idx) const {
+	const MappedPoly &gon = ((const MappedPoly *)(base+layer->polys))[idx];
+	const vec2i *verts = (const vec2i *)(base+gon.verts);
+	return Poly(gon.net, vector<vec2i>(verts, verts+gon.vertCount));
+}
+
+int LayerView::labels() const {
+	return layer == nullptr ? 0 : layer->labelCount;
+}
+
+Label LayerView::label(int idx) const {
+	const MappedLabel &lbl = ((const MappedLabel *)(base+layer->labels))[idx];
+	return Label(lbl.net, vec2i(lbl.pos[0], lbl.pos[1]), string(getString(base, lbl.txt)));
+}
+
+Layer LayerView::toLayer(const Tech &tech) const {
+	Layer result(tech, draw());
+	if (layer == nullptr) {
+		return result;
+	}
+	result.geo.assign(begin(), end());
+	result.poly.reserve(polys());
+	for (int i = 0; i < polys(); i++) {
+		result.poly.push_back(poly(i));
+	}
+	result.lbl.reserve(labels());
+	for (int i = 0; i < labels(); i++) {
+		result.lbl.push_back(label(i));
+	}
+	result.box = getRect(layer->box);
+	result.dirty = true;
+	return result;
+}
+
+MacroView::MacroView() {
+	base = nullptr;
+	macro = nullptr;
+}
+
+MacroView::MacroView(const char *base, const MappedMacro *macro) {
+	this->base = base;
+	this->macro = macro;
+}
+
+MacroView::~MacroView() {
+}
+
+string_view MacroView::name() const {
+	return getString(base, macro->name);
+}
+
+Rect MacroView::box() const {
+	return getRect(macro->box);
+}
+
+uint64_t MacroView::hash() const {
+	return macro->hash;
+}
+
+int MacroView::layers() const {
+	return macro->layerCount;
+}
+
+LayerView MacroView::layer(int idx) const {
+	return LayerView(base, ((const MappedLayer *)(base+macro->layers))+idx);
+}
+
+LayerView MacroView::find(int draw) const {
+	// layers are written in draw order
+	const MappedLayer *table = (const MappedLayer *)(base+macro->layers);
+	int lo = 0, hi = macro->layerCount;
+	while (lo < hi) {
+		int mid = (lo+hi)/2;
+		if (table[mid].draw < draw) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo < macro->layerCount and table[lo].draw == draw) {
+		return LayerView(base, table+lo);
+	}
+	return LayerView();
+}
+
+int MacroView::nets() const {
+	return macro->netCount;
+}
+
+Net MacroView::net(int idx) const {
+	const MappedNet &n = ((const MappedNet *)(base+macro->nets))[idx];
+	const MappedString *names = (const MappedString *)(base+n.names);
+
+	Net result;
+	result.names.reserve(n.nameCount);
+	for (int i = 0; i < n.nameCount; i++) {
+		result.names.push_back(string(getString(base, names[i])));
+	}
+	result.isVdd = (n.flags & MappedNet::VDD) != 0;
+	result.isGND = (n.flags & MappedNet::GND) != 0;
+	result.isInput = (n.flags & MappedNet::INPUT) != 0;
+	result.isOutput = (n.flags & MappedNet::OUTPUT) != 0;
+	result.isSub = (n.flags & MappedNet::SUB) != 0;
+	return result;
+}
+
+int MacroView::instances() const {
+	return macro->instCount;
+}
+
+Instance MacroView::instance(int idx) const {
+	const MappedInstance &i = ((const MappedInstance *)(base+macro->insts))[idx];
+	const int32_t *ports = (const int32_t *)(base+i.ports);
+
+	Instance result(i.macro, vec2i(i.pos[0], i.pos[1]), vec2i(i.dir[0], i.dir[1]));
+	result.ports.assign(ports, ports+i.portCount);
+	return result;
+}
+
+Layout MacroView::toLayout(const Tech &tech) const {
+	Layout result(tech);
+	result.name = string(name());
+	result.box = box();
+	result.nets.reserve(nets());
+	for (int i = 0; i < nets(); i++) {
+		result.nets.push_back(net(i));
+	}
+	for (int i = 0; i < layers(); i++) {
+		LayerView view = layer(i);
+		result.layers.insert(pair<int, Layer>(view.draw(), view.toLayer(tech)));
+	}
+	result.inst.reserve(instances());
+	for (int i = 0; i < instances(); i++) {
+		result.inst.push_back(instance(i));
+	}
+	return result;
+}
+
+MappedLibrary::MappedLibrary(const Tech &tech) {
+	this->tech = &tech;
+}
+
+MappedLibrary::~MappedLibrary() {
+}
+
+// Check that count elements of the given size and alignment at offset lie
+// within a file of the given size.
+static bool inFile(size_t fileSize, uint64_t offset, int64_t count, size_t size, size_t align) {
+	if (count < 0 or offset > fileSize or offset%align != 0) {
+		return false;
+	}
+	return (uint64_t)count <= (fileSize-offset)/size;
+}
+
+static bool inFile(size_t fileSize, const MappedString &str) {
+	return inFile(fileSize, str.offset, str.length, 1, 1);
+}
+
+static bool checkLayer(const char *base, size_t size, const MappedLayer &layer) {
+	if (not inFile(size, layer.rects, layer.rectCount, sizeof(Rect), alignof(Rect))
+		or not inFile(size, layer.polys, layer.polyCount, sizeof(MappedPoly), alignof(MappedPoly))
+		or not inFile(size, layer.labels, layer.labelCount, sizeof(MappedLabel), alignof(MappedLabel))) {
+		return false;
+	}
+
+	const MappedPoly *polys = (const MappedPoly *)(base+layer.polys);
+	for (int i = 0; i < layer.polyCount; i++) {
+		if (not inFile(size, polys[i].verts, polys[i].vertCount, sizeof(vec2i), alignof(vec2i))) {
+			return false;
+		}
+	}
+
+	const MappedLabel *labels = (const MappedLabel *)(base+layer.labels);
+	for (int i = 0; i < layer.labelCount; i++) {
+		if (not inFile(size, labels[i].txt)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool checkMacro(const char *base, size_t size, const MappedMacro &macro) {
+	if (not inFile(size, macro.name)
+		or not inFile(size, macro.layers, macro.layerCount, sizeof(MappedLayer), alignof(MappedLayer))
+		or not inFile(size, macro.nets, macro.netCount, sizeof(MappedNet), alignof(MappedNet))
+		or not inFile(size, macro.insts, macro.instCount, sizeof(MappedInstance), alignof(MappedInstance))) {
+		return false;
+	}
+
+	const MappedLayer *layers = (const MappedLayer *)(base+macro.layers);
+	for (int i = 0; i < macro.layerCount; i++) {
+		if ((i > 0 and layers[i].draw <= layers[i-1].draw)
+			or not checkLayer(base, size, layers[i])) {
+			return false;
+		}
+	}
+
+	const MappedNet *nets = (const MappedNet *)(base+macro.nets);
+	for (int i = 0; i < macro.netCount; i++) {
+		if (not inFile(size, nets[i].names, nets[i].nameCount, sizeof(MappedString), alignof(MappedString))) {
+			return false;
+		}
+		const MappedString *names = (const MappedString *)(base+nets[i].names);
+		for (int j = 0; j < nets[i].nameCount; j++) {
+			if (not inFile(size, names[j])) {
+				return false;
+			}
+		}
+	}
+
+	const MappedInstance *insts = (const MappedInstance *)(base+macro.insts);
+	for (int i = 0; i < macro.instCount; i++) {
+		if (not inFile(size, insts[i].ports, insts[i].portCount, sizeof(int32_t), alignof(int32_t))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool MappedLibrary::open(string path) {
+	close();
+	if (not file.open(path)) {
+		printf("%s:%d error: unable to open file '%s'.\n", __FILE__, __LINE__, path.c_str());
+		return false;
+	}
+
+	if (file.size < sizeof(MappedHeader) or ((uintptr_t)file.data)%8 != 0) {
+		printf("%s:%d error: '%s' is not a mapped library.\n", __FILE__, __LINE__, path.c_str());
+		close();
+		return false;
+	}
+
+	const MappedHeader *header = (const MappedHeader *)file.data;
+	if (memcmp(header->magic, MAPPED_MAGIC, 4) != 0) {
+		printf("%s:%d error: '%s' is not a mapped library.\n", __FILE__, __LINE__, path.c_str());
+		close();
+		return false;
+	}
+	if (header->version != MAPPED_VERSION) {
+		printf("%s:%d error: '%s' has unsupported version %d.\n", __FILE__, __LINE__, path.c_str(), header->version);
+		close();
+		return false;
+	}
+	if (header->endian != MAPPED_ENDIAN or header->rectSize != (int32_t)sizeof(Rect)) {
+		printf("%s:%d error: '%s' was written on a machine with a different byte order or struct layout.\n", __FILE__, __LINE__, path.c_str());
+		close();
+		return false;
+	}
+	if (header->techHash != tech->hash()) {
+		printf("%s:%d error: '%s' was written for a different technology.\n", __FILE__, __LINE__, path.c_str());
+		close();
+		return false;
+	}
+	if (not inFile(file.size, header->macros, header->macroCount, sizeof(MappedMacro), alignof(MappedMacro))) {
+		printf("%s:%d error: '%s' is truncated or corrupt.\n", __FILE__, __LINE__, path.c_str());
+		close();
+		return false;
+	}
+
+	const MappedMacro *macros = (const MappedMacro *)(file.data+header->macros);
+	names.reserve(header->macroCount);
+	for (int i = 0; i < header->macroCount; i++) {
+		if (not checkMacro(file.data, file.size, macros[i])) {
+			printf("%s:%d error: '%s' is truncated or corrupt.\n", __FILE__, __LINE__, path.c_str());
+			close();
+			return false;
+		}
+		// keep the first of any duplicates, like Library::reindex()
+		names.insert(pair<string_view, int>(getString(file.data, macros[i].name), i));
+	}
+	return true;
+}
+
+void MappedLibrary::close() {
+	names.clear();
+	file.close();
+}
+
+int MappedLibrary::size() const {
+	if (file.size < sizeof(MappedHeader)) {
+		return 0;
+	}
+	return ((const MappedHeader *)file.data)->macroCount;
+}
+
+MacroView MappedLibrary::macro(int idx) const {
+	const MappedHeader *header = (const MappedHeader *)file.data;
+	return MacroView(file.data, ((const MappedMacro *)(file.data+header->macros))+idx);
+}
+
+int MappedLibrary::find(string_view name) const {
+	auto pos = names.find(name);
+	if (pos == names.end()) {
+		return -1;
+	}
+	return pos->second;
+}
+
+void MappedLibrary::load(Library &lib) const {
+	// Instance::macro indexes the macros of the file. Find where each one
+	// will land in lib, following Library::push(), so that the instances can
+	// be renumbered before the macros are added. Duplicate names in the file
+	// resolve to the first one.
+	vector<int> index(size(), -1);
+	int next = (int)lib.macros.size();
+	for (int i = 0; i < size(); i++) {
+		int first = find(macro(i).name());
+		if (first != i) {
+			continue;
+		}
+		int idx = lib.find(string(macro(i).name()));
+		index[i] = idx >= 0 ? idx : next++;
+	}
+	for (int i = 0; i < size(); i++) {
+		if (index[i] < 0) {
+			index[i] = index[find(macro(i).name())];
+		}
+	}
+
+	for (int i = 0; i < size(); i++) {
+		if (find(macro(i).name()) != i) {
+			continue;
+		}
+		Layout layout = macro(i).toLayout(*tech);
+		for (auto j = layout.inst.begin(); j != layout.inst.end(); j++) {
+			j->macro = (j->macro >= 0 and j->macro < (int)index.size()) ? index[j->macro] : -1;
+		}
+		lib.push(layout);
+	}
+}
+
+}
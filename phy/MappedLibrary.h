@@ -0,0 +1,197 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <cstdint>
+
+#include "Layout.h"
+#include "Library.h"
+#include "Binary.h"
+
+using namespace std;
+
+namespace phy {
+
+// The on-disk layout of a mapped library. Everything is stored in the native
+// byte order of the machine that wrote it and is used in place, so a file is
+// only valid on machines with the same byte order and the same layout of
+// Rect. All offsets are from the start of the file and every table is 8 byte
+// aligned.
+
+struct MappedString {
+	uint64_t offset;
+	int32_t length;
+	int32_t pad;
+};
+
+struct MappedHeader {
+	char magic[4];
+	int32_t version;
+	// 0x01020304 in the byte order of the writer
+	uint32_t endian;
+	// sizeof(Rect) of the writer
+	int32_t rectSize;
+	uint64_t techHash;
+	int32_t macroCount;
+	int32_t pad;
+	// MappedMacro[macroCount]
+	uint64_t macros;
+};
+
+struct MappedMacro {
+	MappedString name;
+	// net, ll, ur
+	int32_t box[5];
+	int32_t layerCount;
+	int32_t netCount;
+	int32_t instCount;
+	// MappedLayer[layerCount]
+	uint64_t layers;
+	// MappedNet[netCount]
+	uint64_t nets;
+	// MappedInstance[instCount]
+	uint64_t insts;
+	// Layout::hash() of the macro
+	uint64_t hash;
+};
+
+struct MappedLayer {
+	int32_t draw;
+	int32_t rectCount;
+	int32_t polyCount;
+	int32_t labelCount;
+	// net, ll, ur
+	int32_t box[5];
+	int32_t pad;
+	// Rect[rectCount]
+	uint64_t rects;
+	// MappedPoly[polyCount]
+	uint64_t polys;
+	// MappedLabel[labelCount]
+	uint64_t labels;
+};
+
+struct MappedPoly {
+	int32_t net;
+	int32_t vertCount;
+	// vec2i[vertCount]
+	uint64_t verts;
+};
+
+struct MappedLabel {
+	int32_t net;
+	int32_t pos[2];
+	int32_t pad;
+	MappedString txt;
+};
+
+struct MappedNet {
+	enum {
+		VDD = 1,
+		GND = 2,
+		INPUT = 4,
+		OUTPUT = 8,
+		SUB = 16,
+	};
+
+	int32_t nameCount;
+	int32_t flags;
+	// MappedString[nameCount]
+	uint64_t names;
+};
+
+struct MappedInstance {
+	int32_t macro;
+	int32_t pos[2];
+	int32_t dir[2];
+	int32_t portCount;
+	// int32_t[portCount]
+	uint64_t ports;
+};
+
+// A read-only view of a layer stored in a mapped library. The rectangles are
+// used directly from the mapped file.
+struct LayerView {
+	LayerView();
+	LayerView(const char *base, const MappedLayer *layer);
+	~LayerView();
+
+	const char *base;
+	const MappedLayer *layer;
+
+	int draw() const;
+
+	int size() const;
+	const Rect *begin() const;
+	const Rect *end() const;
+	const Rect &operator[](int idx) const;
+
+	int polys() const;
+	Poly poly(int idx) const;
+
+	int labels() const;
+	Label label(int idx) const;
+
+	// Copy this layer out of the file
+	Layer toLayer(const Tech &tech) const;
+};
+
+// A read-only view of a macro stored in a mapped library
+struct MacroView {
+	MacroView();
+	MacroView(const char *base, const MappedMacro *macro);
+	~MacroView();
+
+	const char *base;
+	const MappedMacro *macro;
+
+	string_view name() const;
+	Rect box() const;
+	uint64_t hash() const;
+
+	int layers() const;
+	LayerView layer(int idx) const;
+	// Returns a view with no geometry if there isn't a layer for draw
+	LayerView find(int draw) const;
+
+	int nets() const;
+	Net net(int idx) const;
+
+	int instances() const;
+	Instance instance(int idx) const;
+
+	// Copy this macro out of the file
+	Layout toLayout(const Tech &tech) const;
+};
+
+// A library file that is memory mapped and read in place. Opening the file
+// only checks its tables, it doesn't read any geometry, and processes that
+// map the same file share one copy in the page cache.
+struct MappedLibrary {
+	MappedLibrary(const Tech &tech);
+	~MappedLibrary();
+
+	const Tech *tech;
+	MappedFile file;
+
+	// macro name -> index, the keys point into the mapped file
+	unordered_map<string_view, int> names;
+
+	bool open(string path);
+	void close();
+
+	int size() const;
+	MacroView macro(int idx) const;
+	// Returns the index of the macro or -1 if there isn't one
+	int find(string_view name) const;
+
+	// Copy every macro out of the file into lib with Library::push(),
+	// renumbering the instances to match. Of macros with the same name, only
+	// the first is loaded.
+	void load(Library &lib) const;
+};
+
+bool saveMapped(const Library &lib, string path);
+
+}
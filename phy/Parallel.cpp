@@ -0,0 +1,204 @@
+#include "Parallel.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace phy {
+
+static thread_local bool inWorker = false;
+
+// One call to parallelFor()
+struct ParallelJob {
+	ParallelJob(function<void(int)> &fn, int n, int helpers);
+	~ParallelJob();
+
+	function<void(int)> *fn;
+	int n;
+	// the number of pool threads that may still join and the number that are
+	// running it, guarded by WorkerPool::lock
+	int helpers;
+	int active;
+
+	atomic<int> next;
+
+	mutex lock;
+	exception_ptr error;
+
+	void run();
+};
+
+ParallelJob::ParallelJob(function<void(int)> &fn, int n, int helpers) : next(0) {
+	this->fn = &fn;
+	this->n = n;
+	this->helpers = helpers;
+	this->active = 0;
+}
+
+ParallelJob::~ParallelJob() {
+}
+
+// The threads shared by every call to parallelFor()
+struct WorkerPool {
+	static WorkerPool &inst();
+
+	mutex lock;
+	// signaled when a job is queued or the pool is stopping
+	condition_variable wake;
+	// signaled when a pool thread leaves a job
+	condition_variable finished;
+	// jobs that still have indices left and room for more threads
+	deque<ParallelJob*> jobs;
+	vector<thread> workers;
+	bool stopping;
+
+	int size() const;
+	void run(ParallelJob &job);
+
+private:
+	WorkerPool();
+	~WorkerPool();
+
+	void work();
+};
+
+void ParallelJob::run() {
+	bool prev = inWorker;
+	inWorker = true;
+	for (int i = next++; i < n; i = next++) {
+		try {
+			(*fn)(i);
+		} catch (...) {
+			lock_guard<mutex> guard(lock);
+			if (not error) {
+				error = current_exception();
+			}
+			// stop handing out indices
+			next = n;
+		}
+	}
+	inWorker = prev;
+}
+
+WorkerPool &WorkerPool::inst() {
+	static WorkerPool instance;
+	return instance;
+}
+
+WorkerPool::WorkerPool() {
+	stopping = false;
+	int count = (int)thread::hardware_concurrency()-1;
+	for (int i = 0; i < count; i++) {
+		workers.push_back(thread([this]() { work(); }));
+	}
+}
+
+WorkerPool::~WorkerPool() {
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto t = workers.begin(); t != workers.end(); t++) {
+		t->join();
+	}
+}
+
+int WorkerPool::size() const {
+	return (int)workers.size();
+}
+
+void WorkerPool::work() {
+	unique_lock<mutex> guard(lock);
+	while (true) {
+		wake.wait(guard, [&]() { return stopping or not jobs.empty(); });
+		if (stopping) {
+			return;
+		}
+
+		ParallelJob *job = jobs.front();
+		job->active++;
+		if (--job->helpers <= 0) {
+			jobs.pop_front();
+		}
+		guard.unlock();
+		job->run();
+		guard.lock();
+
+		// The indices ran out, no other thread needs to pick this one up
+		for (auto j = jobs.begin(); j != jobs.end(); j++) {
+			if (*j == job) {
+				jobs.erase(j);
+				break;
+			}
+		}
+		if (--job->active == 0) {
+			finished.notify_all();
+		}
+	}
+}
+
+void WorkerPool::run(ParallelJob &job) {
+	int helpers = job.helpers;
+	{
+		lock_guard<mutex> guard(lock);
+		jobs.push_back(&job);
+	}
+	if (helpers == 1) {
+		wake.notify_one();
+	} else {
+		wake.notify_all();
+	}
+
+	job.run();
+
+	// Every index has been claimed, so the job is done once the pool threads
+	// that joined it have left.
+	unique_lock<mutex> guard(lock);
+	for (auto j = jobs.begin(); j != jobs.end(); j++) {
+		if (*j == &job) {
+			jobs.erase(j);
+			break;
+		}
+	}
+	finished.wait(guard, [&]() { return job.active == 0; });
+}
+
+void parallelFor(int n, function<void(int)> fn, int threads) {
+	if (threads <= 0) {
+		threads = (int)thread::hardware_concurrency();
+	}
+	if (threads > n) {
+		threads = n;
+	}
+
+	if (inWorker or threads <= 1) {
+		for (int i = 0; i < n; i++) {
+			fn(i);
+		}
+		return;
+	}
+
+	WorkerPool &pool = WorkerPool::inst();
+	int helpers = min(threads-1, pool.size());
+	if (helpers <= 0) {
+		for (int i = 0; i < n; i++) {
+			fn(i);
+		}
+		return;
+	}
+
+	ParallelJob job(fn, n, helpers);
+	pool.run(job);
+	if (job.error) {
+		rethrow_exception(job.error);
+	}
+}
+
+}
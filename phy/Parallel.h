@@ -0,0 +1,26 @@
+#pragma once
+
+#include <functional>
+
+using namespace std;
+
+namespace phy {
+
+// Call fn(i) for every i in [0, n) using up to threads threads including the
+// caller (0 means one per hardware thread). The work is handed to a pool of
+// worker threads that is started by the first call and kept for the rest of
+// the process. Indices are handed out one at a time from a shared counter so
+// that tasks of uneven cost stay balanced across workers. Calls made from
+// inside of a worker run serially on that worker, so nested parallel loops
+// don't oversubscribe the machine. If fn throws, no more indices are handed
+// out and the first exception is rethrown to the caller once every thread
+// has stopped.
+void parallelFor(int n, function<void(int)> fn, int threads=0);
+
+enum {
+	// Roughly the number of rectangles a minOffset() query needs to sweep
+	// before splitting it across threads is faster than running it serially
+	PARALLEL_WORK = 2048,
+};
+
+}
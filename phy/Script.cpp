@@ -1,4 +1,7 @@
 #include "Script.h"
+#include "Snapshot.h"
+#include "Loom.h"
+#include "Binary.h"
 
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
@@ -43,8 +46,35 @@ public:
 	int (*Status_Exception)(PyStatus);
 	int (*Status_IsExit)(PyStatus);
 	void (*ExitStatusException)(PyStatus);
+	int (*IsInitialized)();
+	PyThreadState* (*Eval_SaveThread)();
+	PyGILState_STATE (*GILState_Ensure)();
+	void (*GILState_Release)(PyGILState_STATE);
+	void* (*Module_GetState)(PyObject*);
+	PyObject* (*Import_GetModuleDict)();
+	PyObject* (*Eval_GetBuiltins)();
+	PyObject* (*Dict_New)();
+	int (*Dict_SetItemString)(PyObject*, const char*, PyObject*);
+	int (*Dict_DelItemString)(PyObject*, const char*);
+	PyObject* (*Dict_Keys)(PyObject*);
+	int (*Dict_DelItem)(PyObject*, PyObject*);
+	PyObject* (*Set_New)(PyObject*);
+	int (*Set_Contains)(PyObject*, PyObject*);
+	PyObject* (*List_New)(Py_ssize_t);
+	int (*List_SetItem)(PyObject*, Py_ssize_t, PyObject*);
+	int (*List_Insert)(PyObject*, Py_ssize_t, PyObject*);
+	int (*List_SetSlice)(PyObject*, Py_ssize_t, Py_ssize_t, PyObject*);
+	Py_ssize_t (*Sequence_Index)(PyObject*, PyObject*);
+	PyObject* (*Sys_GetObject)(const char*);
+	int (*Sys_SetObject)(const char*, PyObject*);
+	PyObject* (*Unicode_DecodeFSDefault)(const char*);
+	PyObject* (*Run_FileExFlags)(FILE*, const char*, int, PyObject*, PyObject*, int, PyCompilerFlags*);
+	void (*Err_Print)();
+	void (*Err_Clear)();
+	void (*DecRef)(PyObject*);
 
 	PyObject* Exc_TypeError;
+	PyObject* Exc_RuntimeError;
 	PyObject* None;
 	PyTypeObject* List_Type;
 	PyTypeObject* Tuple_Type;
@@ -170,12 +200,46 @@ private:
 		lookup("PyStatus_Exception", Status_Exception);
 		lookup("PyStatus_IsExit", Status_IsExit);
 		lookup("Py_ExitStatusException", ExitStatusException);
-		lookup("PyExc_TypeError", Exc_TypeError);
+		lookup("Py_IsInitialized", IsInitialized);
+		lookup("PyEval_SaveThread", Eval_SaveThread);
+		lookup("PyGILState_Ensure", GILState_Ensure);
+		lookup("PyGILState_Release", GILState_Release);
+		lookup("PyModule_GetState", Module_GetState);
+		lookup("PyImport_GetModuleDict", Import_GetModuleDict);
+		lookup("PyEval_GetBuiltins", Eval_GetBuiltins);
+		lookup("PyDict_New", Dict_New);
+		lookup("PyDict_SetItemString", Dict_SetItemString);
+		lookup("PyDict_DelItemString", Dict_DelItemString);
+		lookup("PyDict_Keys", Dict_Keys);
+		lookup("PyDict_DelItem", Dict_DelItem);
+		lookup("PySet_New", Set_New);
+		lookup("PySet_Contains", Set_Contains);
+		lookup("PyList_New", List_New);
+		lookup("PyList_SetItem", List_SetItem);
+		lookup("PyList_Insert", List_Insert);
+		lookup("PyList_SetSlice", List_SetSlice);
+		lookup("PySequence_Index", Sequence_Index);
+		lookup("PySys_GetObject", Sys_GetObject);
+		lookup("PySys_SetObject", Sys_SetObject);
+		lookup("PyUnicode_DecodeFSDefault", Unicode_DecodeFSDefault);
+		lookup("PyRun_FileExFlags", Run_FileExFlags);
+		lookup("PyErr_Print", Err_Print);
+		lookup("PyErr_Clear", Err_Clear);
+		lookup("Py_DecRef", DecRef);
+		// The exception types are exported as PyObject* variables
+		lookupObject("PyExc_TypeError", Exc_TypeError);
+		lookupObject("PyExc_RuntimeError", Exc_RuntimeError);
 		lookup("_Py_NoneStruct", None);
 		lookup("PyList_Type", List_Type);
 		lookup("PyTuple_Type", Tuple_Type);
 	}
 
+	void lookupObject(string name, PyObject* &obj) {
+		PyObject **ptr = nullptr;
+		lookup(name, ptr);
+		obj = ptr != nullptr ? *ptr : nullptr;
+	}
+
 	void* lookup(const std::string &symb) {
 		return dlsym(handle, symb.c_str());
 	}
@@ -237,7 +301,7 @@ struct StringArgs {
 
 	~StringArgs() {
 		for (int i = 0; data[i] != nullptr; i++) {
-			delete data[i];
+			free(data[i]);
 			data[i] = nullptr;
 		}
 		delete [] data;
@@ -250,7 +314,17 @@ struct StringArgs {
 
 namespace phy {
 
-Tech *tech;
+// The Tech being filled by the script is stored in the state of the loom
+// module created for that load, see Interpreter::load().
+static Tech *target(PyObject *module) {
+	PythonLoader &Py = PythonLoader::inst();
+	Tech **state = (Tech**)Py.Module_GetState(module);
+	if (state == nullptr or *state == nullptr) {
+		Py.Err_SetString(Py.Exc_RuntimeError, "loom may only be used by a script run through loadTech().");
+		return nullptr;
+	}
+	return *state;
+}
 
 static PyObject* tupleFromLevel(Level level) {
 	PythonLoader &Py = PythonLoader::inst();
@@ -282,6 +356,10 @@ static Level levelFromTuple(PyObject *obj) {
 
 static PyObject* py_dbunit(PyObject *self, PyObject *args) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	double dbunit = -1;
 	if(!Py.Arg_ParseTuple(args, "d:dbunit", &dbunit)) {
 		return NULL;
@@ -293,6 +371,10 @@ static PyObject* py_dbunit(PyObject *self, PyObject *args) {
 
 static PyObject* py_scale(PyObject *self, PyObject *args) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	double scale = -1;
 	if(!Py.Arg_ParseTuple(args, "d:scale", &scale)) {
 		return NULL;
@@ -305,6 +387,10 @@ static PyObject* py_scale(PyObject *self, PyObject *args) {
 
 static PyObject* py_paint(PyObject *self, PyObject *args) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	const char *name = 0;
 	int major = -1;
 	int minor = -1;
@@ -319,6 +405,10 @@ static PyObject* py_paint(PyObject *self, PyObject *args) {
 
 static PyObject* py_width(PyObject *self, PyObject *args) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	int layer = -1;
 	int width = -1;
 	if(!Py.Arg_ParseTuple(args, "ii:width", &layer, &width)) {
@@ -331,6 +421,10 @@ static PyObject* py_width(PyObject *self, PyObject *args) {
 
 static PyObject* py_fill(PyObject *self, PyObject *args) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	int layer = -1;
 	if(!Py.Arg_ParseTuple(args, "i:fill", &layer)) {
 		return NULL;
@@ -342,6 +436,10 @@ static PyObject* py_fill(PyObject *self, PyObject *args) {
 
 static PyObject* py_nmos(PyObject *self, PyObject *args, PyObject *kwargs) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	const char *variant = 0;
 	const char *name = 0;
 
@@ -397,6 +495,10 @@ static PyObject* py_nmos(PyObject *self, PyObject *args, PyObject *kwargs) {
 
 static PyObject* py_pmos(PyObject *self, PyObject *args, PyObject *kwargs) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	const char *variant = 0;
 	const char *name = 0;
 	
@@ -452,6 +554,10 @@ static PyObject* py_pmos(PyObject *self, PyObject *args, PyObject *kwargs) {
 
 static PyObject* py_dielec(PyObject *self, PyObject *args, PyObject *kwargs) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	PyObject *down = nullptr;
 	PyObject *up = nullptr;
 	float thickness = 0.0f;
@@ -468,6 +574,10 @@ static PyObject* py_dielec(PyObject *self, PyObject *args, PyObject *kwargs) {
 
 static PyObject* py_subst(PyObject *self, PyObject *args, PyObject *kwargs) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	int draw = -1;
 	int label = -1;
 	int pin = -1;
@@ -520,6 +630,10 @@ static PyObject* py_subst(PyObject *self, PyObject *args, PyObject *kwargs) {
 
 static PyObject* py_well(PyObject *self, PyObject *args, PyObject *kwargs) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	int draw = -1;
 	int label = -1;
 	int pin = -1;
@@ -571,6 +685,10 @@ static PyObject* py_well(PyObject *self, PyObject *args, PyObject *kwargs) {
 
 static PyObject* py_via(PyObject *self, PyObject *args, PyObject *kwargs) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	PyObject *dn = nullptr;
 	PyObject *up = nullptr;
 	int draw = -1;
@@ -590,6 +708,10 @@ static PyObject* py_via(PyObject *self, PyObject *args, PyObject *kwargs) {
 
 static PyObject* py_route(PyObject *self, PyObject *args, PyObject *kwargs) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	int draw = -1;
 	int label = -1;
 	int pin = -1;
@@ -607,6 +729,10 @@ static PyObject* py_route(PyObject *self, PyObject *args, PyObject *kwargs) {
 
 static PyObject* py_spacing(PyObject *self, PyObject *args) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	int l0 = -1;
 	int l1 = -1;
 	int value = -1;
@@ -620,6 +746,10 @@ static PyObject* py_spacing(PyObject *self, PyObject *args) {
 
 static PyObject* py_enclosing(PyObject *self, PyObject *args) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	int l0 = -1;
 	int l1 = -1;
 	int lo = -1;
@@ -640,6 +770,10 @@ static PyObject* py_enclosing(PyObject *self, PyObject *args) {
 
 static PyObject* py_b_and(PyObject *self, PyObject *args) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	vector<int> l;
 	Py_ssize_t n;
 	PyObject *pItem;
@@ -665,6 +799,10 @@ static PyObject* py_b_and(PyObject *self, PyObject *args) {
 
 static PyObject* py_b_or(PyObject *self, PyObject *args) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	vector<int> l;
 	Py_ssize_t n;
 	PyObject *pItem;
@@ -690,6 +828,10 @@ static PyObject* py_b_or(PyObject *self, PyObject *args) {
 
 static PyObject* py_b_not(PyObject *self, PyObject *args) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	int l0 = -1;
 	if(!Py.Arg_ParseTuple(args, "i:b_not", &l0)) {
 		return NULL;
@@ -701,6 +843,10 @@ static PyObject* py_b_not(PyObject *self, PyObject *args) {
 
 static PyObject* py_bound(PyObject *self, PyObject *args) {
 	PythonLoader &Py = PythonLoader::inst();
+	Tech *tech = target(self);
+	if (tech == nullptr) {
+		return NULL;
+	}
 	int l0 = -1;
 	if(!Py.Arg_ParseTuple(args, "i:bound", &l0)) {
 		return NULL;
@@ -732,86 +878,214 @@ static PyMethodDef EmbMethods[] = {
 	{NULL, NULL, 0, NULL}
 };
 
+// The module state holds the Tech being loaded
 static PyModuleDef EmbModule = {
-	PyModuleDef_HEAD_INIT, "loom", NULL, -1, EmbMethods,
+	PyModuleDef_HEAD_INIT, "loom", NULL, sizeof(Tech*), EmbMethods,
 	NULL, NULL, NULL, NULL
 };
 
-static PyObject* PyInit_loom()
-{
-	PythonLoader &Py = PythonLoader::inst();
-	return Py.Module_Create(&EmbModule, PYTHON_API_VERSION);
+// Identify a tech script by its contents and the full command line so that
+// changing either one invalidates the snapshot. Files imported by the script
+// aren't covered.
+static uint64_t scriptKey(string path, string script) {
+	Hasher h;
+	h.push(path);
+
+	MappedFile file;
+	if (file.open(script)) {
+		h.push(file.data, file.size);
+	}
+	return h.value;
+}
+
+Interpreter::Interpreter() {
+	started = false;
+}
+
+Interpreter::~Interpreter() {
+	// Python is left running until the process exits. Finalizing it here
+	// would race with the static destructors of the python library.
 }
 
-bool loadTech(Tech &dst) {
+Interpreter &Interpreter::inst() {
+	static Interpreter instance;
+	return instance;
+}
+
+bool Interpreter::start() {
+	if (started) {
+		return true;
+	}
+
 	PythonLoader &Py = PythonLoader::inst();
 	if (not Py) {
 		return false;
 	}
 
-	tech = &dst;
-
-	vector<string> args = splitArguments(dst.path);
-	if (not filesystem::exists(args[0])) {
-		printf("technology file '%s' not found.\n", args[0].c_str());
-		return false;
+	// Someone else in this process already started python
+	if (Py.IsInitialized()) {
+		started = true;
+		return true;
 	}
 
 	PyConfig config;
 	Py.Config_InitPythonConfig(&config);
-
-	vector<char*> argv;
-	argv.push_back(const_cast<char*>(args[0].c_str()));
-	for (auto arg = args.begin(); arg != args.end(); arg++) {
-		argv.push_back(const_cast<char*>(arg->c_str()));
-	}
-
-	PyStatus status = Py.Config_SetBytesArgv(&config, argv.size(), argv.data());
+	PyStatus status = Py.InitializeFromConfig(&config);
+	Py.Config_Clear(&config);
 	if (Py.Status_Exception(status)) {
-		tech = nullptr;
-		Py.Config_Clear(&config);
 		if (not Py.Status_IsExit(status)) {
 			Py.ExitStatusException(status);
 		}
-		printf("config argv failed.\n");
+		printf("%s:%d error: unable to initialize python.\n", __FILE__, __LINE__);
 		return false;
 	}
 
-	Py.Import_AppendInittab("loom", &PyInit_loom);
-	status = Py.InitializeFromConfig(&config);
-	if (Py.Status_Exception(status)) {
-		tech = nullptr;
-		Py.Config_Clear(&config);
-		if (not Py.Status_IsExit(status)) {
-			Py.ExitStatusException(status);
-		}
-		printf("initialize failed.\n");
-		return false;
-	}
-	Py.Config_Clear(&config);
+	// Release the GIL so that later loads may come from any thread
+	Py.Eval_SaveThread();
+	started = true;
+	return true;
+}
+
+bool Interpreter::run(Tech &dst, const vector<string> &args) {
+	PythonLoader &Py = PythonLoader::inst();
 
-	bool success = true;
 #if defined(_WIN32) || defined(_WIN64)
-	FILE *fptr = fopen(argv[0], "rb");
+	FILE *fptr = fopen(args[0].c_str(), "rb");
 #else
-	FILE *fptr = fopen(argv[0], "r");
+	FILE *fptr = fopen(args[0].c_str(), "r");
 #endif
 	if (fptr == nullptr) {
-		printf("unable to open file.\n");
+		printf("%s:%d error: unable to open file '%s'.\n", __FILE__, __LINE__, args[0].c_str());
 		return false;
 	}
 
-	Py.Run_SimpleFile(fptr, argv[0]);
+	string dir = filesystem::absolute(args[0]).parent_path().string();
+
+	PyGILState_STATE gil = Py.GILState_Ensure();
+
+	// Each script gets its own loom module and its own globals
+	PyObject *module = Py.Module_Create(&EmbModule);
+	PyObject *globals = Py.Dict_New();
+	PyObject *argv = Py.List_New(args.size());
+	PyObject *name = Py.Unicode_DecodeFSDefault("__main__");
+	PyObject *file = Py.Unicode_DecodeFSDefault(args[0].c_str());
+	PyObject *path = Py.Unicode_DecodeFSDefault(dir.c_str());
+	PyObject *sysPath = Py.Sys_GetObject("path");
+	PyObject *modules = Py.Import_GetModuleDict();
+	// The modules loaded before this script, anything the script imports is
+	// dropped afterward so that the next load runs it again against its own
+	// loom module.
+	PyObject *loaded = nullptr;
+	if (modules != nullptr) {
+		PyObject *keys = Py.Dict_Keys(modules);
+		if (keys != nullptr) {
+			loaded = Py.Set_New(keys);
+			Py.DecRef(keys);
+		}
+	}
+
+	bool success = module != nullptr and globals != nullptr and argv != nullptr
+		and name != nullptr and file != nullptr and path != nullptr and sysPath != nullptr
+		and loaded != nullptr;
+	if (success) {
+		*(Tech**)Py.Module_GetState(module) = &dst;
+		for (int i = 0; i < (int)args.size(); i++) {
+			Py.List_SetItem(argv, i, Py.Unicode_DecodeFSDefault(args[i].c_str()));
+		}
+		Py.Dict_SetItemString(globals, "__builtins__", Py.Eval_GetBuiltins());
+		Py.Dict_SetItemString(globals, "__name__", name);
+		Py.Dict_SetItemString(globals, "__file__", file);
+
+		Py.Dict_SetItemString(modules, "loom", module);
+		Py.Sys_SetObject("argv", argv);
+		Py.List_Insert(sysPath, 0, path);
+
+		PyObject *result = Py.Run_FileExFlags(fptr, args[0].c_str(), Py_file_input, globals, globals, 0, nullptr);
+		if (result == nullptr) {
+			Py.Err_Print();
+			success = false;
+		} else {
+			Py.DecRef(result);
+		}
+
+		Py_ssize_t idx = Py.Sequence_Index(sysPath, path);
+		if (idx >= 0) {
+			Py.List_SetSlice(sysPath, idx, idx+1, nullptr);
+		} else {
+			Py.Err_Clear();
+		}
+		PyObject *keys = Py.Dict_Keys(modules);
+		if (keys != nullptr) {
+			for (Py_ssize_t i = 0; i < Py.List_Size(keys); i++) {
+				PyObject *key = Py.List_GetItem(keys, i);
+				if (Py.Set_Contains(loaded, key) == 0) {
+					Py.Dict_DelItem(modules, key);
+				}
+			}
+			Py.DecRef(keys);
+		}
+		Py.Err_Clear();
+
+		// The script may have kept a reference to the module, make sure it
+		// can't reach dst once this load returns.
+		*(Tech**)Py.Module_GetState(module) = nullptr;
+
+		// Output is normally flushed when python shuts down
+		Py.Run_SimpleString("import sys\nsys.stdout.flush()\nsys.stderr.flush()\n");
+	} else {
+		Py.Err_Print();
+	}
+
+	PyObject *objs[] = {module, globals, argv, name, file, path, loaded};
+	for (int i = 0; i < (int)(sizeof(objs)/sizeof(objs[0])); i++) {
+		if (objs[i] != nullptr) {
+			Py.DecRef(objs[i]);
+		}
+	}
+
+	Py.GILState_Release(gil);
 	fclose(fptr);
-	success = (Py.FinalizeEx() >= 0);
+
 	if (not success) {
-		printf("run failed.\n");
+		printf("%s:%d error: technology script '%s' failed.\n", __FILE__, __LINE__, args[0].c_str());
 	}
-
-	tech = nullptr;
 	return success;
 }
 
+bool Interpreter::load(Tech &dst, string snapshot) {
+	vector<string> args = splitArguments(dst.path);
+	if (args.empty() or not filesystem::exists(args[0])) {
+		printf("technology file '%s' not found.\n", args.empty() ? "" : args[0].c_str());
+		return false;
+	}
+
+	uint64_t key = 0;
+	if (not snapshot.empty()) {
+		key = scriptKey(dst.path, args[0]);
+		if (loadSnapshot(dst, snapshot, key)) {
+			dst.freeze();
+			return true;
+		}
+	}
+
+	// Scripts in the declarative subset don't need python at all
+	if (not parseLoom(dst, args[0])) {
+		lock_guard<mutex> guard(lock);
+		if (not start() or not run(dst, args)) {
+			return false;
+		}
+	}
+
+	dst.optimize();
+	if (not snapshot.empty()) {
+		saveSnapshot(dst, snapshot, key);
+	}
+	dst.freeze();
+	return true;
+}
 
+bool loadTech(Tech &dst, string snapshot) {
+	return Interpreter::inst().load(dst, snapshot);
 }
 
+}
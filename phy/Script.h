@@ -1,9 +1,45 @@
 #pragma once
 
+#include <mutex>
+
 #include "Tech.h"
 
 namespace phy {
 
-bool loadTech(Tech &dst);
+// The embedded python session used to run technology scripts. Scripts that
+// stay within the declarative subset described in Loom.h are read natively
+// and never start python. Otherwise, python is started by the first load and
+// stays up for the rest of the process, so later loads only pay for running
+// the script. Each script runs with fresh
+// globals and its own instance of the loom module bound to the Tech being
+// filled. Modules imported by the script are unloaded afterward, so helpers
+// run again for every load. Loads from multiple threads are run one at a
+// time.
+struct Interpreter {
+	static Interpreter &inst();
+
+	// Run the technology script named by dst.path into dst. If snapshot is
+	// given, the loaded Tech is saved there and later calls with the same
+	// script contents and arguments read the snapshot instead of running
+	// python. Once loaded, dst is optimized and frozen, see Tech::optimize()
+	// and Tech::freeze().
+	bool load(Tech &dst, string snapshot="");
+
+private:
+	Interpreter();
+	~Interpreter();
+
+	Interpreter(const Interpreter &) = delete;
+	Interpreter &operator=(const Interpreter &) = delete;
+
+	bool start();
+	bool run(Tech &dst, const vector<string> &args);
+
+	mutex lock;
+	bool started;
+};
+
+// Same as Interpreter::inst().load(dst, snapshot)
+bool loadTech(Tech &dst, string snapshot="");
 
 }
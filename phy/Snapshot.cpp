@@ -0,0 +1,260 @@
+#include "Snapshot.h"
+#include "Binary.h"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+namespace phy {
+
+static const char snapshotMagic[4] = {'P', 'H', 'Y', 'T'};
+// Increment this whenever the layout of Tech or of the snapshot changes
+static const int32_t snapshotVersion = 1;
+
+static void writeInts(Writer &w, const vector<int> &v) {
+	w.write((int32_t)v.size());
+	for (auto i = v.begin(); i != v.end(); i++) {
+		w.write((int32_t)*i);
+	}
+}
+
+static bool readInts(Reader &r, vector<int> *v) {
+	int32_t size = 0;
+	if (not r.read(&size) or size < 0 or (size_t)size > (r.size - r.pos)/4) {
+		r.failed = true;
+		return false;
+	}
+	v->resize(size);
+	for (int i = 0; i < size; i++) {
+		int32_t value = 0;
+		r.read(&value);
+		(*v)[i] = value;
+	}
+	return not r.failed;
+}
+
+static void writeLevel(Writer &w, Level level) {
+	w.write((int32_t)level.type);
+	w.write((int32_t)level.idx);
+}
+
+static Level readLevel(Reader &r) {
+	int32_t type = 0, idx = 0;
+	r.read(&type);
+	r.read(&idx);
+	return Level(type, idx);
+}
+
+static int readInt(Reader &r) {
+	int32_t value = 0;
+	r.read(&value);
+	return value;
+}
+
+static double readDouble(Reader &r) {
+	double value = 0.0;
+	r.read(&value);
+	return value;
+}
+
+static string readString(Reader &r) {
+	string value;
+	r.read(&value);
+	return value;
+}
+
+static void writeMaterial(Writer &w, const Material &m) {
+	w.write((int32_t)m.draw);
+	w.write((int32_t)m.label);
+	w.write((int32_t)m.pin);
+	writeInts(w, m.mask);
+	writeInts(w, m.excl);
+	w.write((double)m.thickness);
+	w.write((double)m.resistivity);
+}
+
+static void readMaterial(Reader &r, Material &m) {
+	m.draw = readInt(r);
+	m.label = readInt(r);
+	m.pin = readInt(r);
+	readInts(r, &m.mask);
+	readInts(r, &m.excl);
+	m.thickness = (float)readDouble(r);
+	m.resistivity = (float)readDouble(r);
+}
+
+// Read the number of elements in a list. Every element takes at least 4
+// bytes, which bounds the count on a corrupt file.
+static int readCount(Reader &r) {
+	int32_t count = 0;
+	if (not r.read(&count) or count < 0 or (size_t)count > (r.size - r.pos)/4) {
+		r.failed = true;
+		return 0;
+	}
+	return count;
+}
+
+bool saveSnapshot(const Tech &tech, string path, uint64_t key) {
+	Writer w;
+	w.write(snapshotMagic, 4);
+	w.write(snapshotVersion);
+	w.write(key);
+
+	w.write(tech.dbunit);
+	w.write(tech.scale);
+	w.write((int32_t)tech.boundary);
+
+	w.write((int32_t)tech.paint.size());
+	for (auto i = tech.paint.begin(); i != tech.paint.end(); i++) {
+		w.write(i->name);
+		w.write((int32_t)i->major);
+		w.write((int32_t)i->minor);
+		w.write((int32_t)i->fill);
+		writeInts(w, i->out);
+	}
+
+	w.write((int32_t)tech.subst.size());
+	for (auto i = tech.subst.begin(); i != tech.subst.end(); i++) {
+		writeMaterial(w, *i);
+		w.write((int32_t)i->tap);
+		writeLevel(w, i->well);
+	}
+
+	w.write((int32_t)tech.models.size());
+	for (auto i = tech.models.begin(); i != tech.models.end(); i++) {
+		w.write((int32_t)i->type);
+		w.write(i->variant);
+		w.write(i->name);
+		writeLevel(w, i->diff);
+		w.write((int32_t)i->bins.size());
+		for (auto j = i->bins.begin(); j != i->bins.end(); j++) {
+			w.write((int32_t)j->first);
+			w.write((int32_t)j->second);
+		}
+	}
+
+	w.write((int32_t)tech.wires.size());
+	for (auto i = tech.wires.begin(); i != tech.wires.end(); i++) {
+		writeMaterial(w, *i);
+	}
+
+	w.write((int32_t)tech.vias.size());
+	for (auto i = tech.vias.begin(); i != tech.vias.end(); i++) {
+		writeMaterial(w, *i);
+		writeLevel(w, i->down);
+		writeLevel(w, i->up);
+	}
+
+	w.write((int32_t)tech.dielec.size());
+	for (auto i = tech.dielec.begin(); i != tech.dielec.end(); i++) {
+		writeLevel(w, i->down);
+		writeLevel(w, i->up);
+		w.write((double)i->thickness);
+		w.write((double)i->permitivity);
+	}
+
+	w.write((int32_t)tech.rules.size());
+	for (auto i = tech.rules.begin(); i != tech.rules.end(); i++) {
+		w.write((int32_t)i->type);
+		writeInts(w, i->operands);
+		writeInts(w, i->params);
+		writeInts(w, i->out);
+	}
+
+	// Catch a snapshot that was cut short
+	w.write(tech.hash());
+	return w.save(path);
+}
+
+bool loadSnapshot(Tech &tech, string path, uint64_t key) {
+	MappedFile file;
+	if (not file.open(path)) {
+		return false;
+	}
+	Reader r = file.reader();
+
+	char magic[4];
+	int32_t version = 0;
+	uint64_t fileKey = 0;
+	if (not r.read(magic, 4) or memcmp(magic, snapshotMagic, 4) != 0
+		or not r.read(&version) or version != snapshotVersion
+		or not r.read(&fileKey) or fileKey != key) {
+		return false;
+	}
+
+	// Decode into a copy so that a bad snapshot leaves tech untouched
+	Tech result(tech.path, tech.lib);
+	result.dbunit = readDouble(r);
+	result.scale = readDouble(r);
+	result.boundary = readInt(r);
+
+	result.paint.resize(readCount(r));
+	for (auto i = result.paint.begin(); i != result.paint.end() and not r.failed; i++) {
+		i->name = readString(r);
+		i->major = readInt(r);
+		i->minor = readInt(r);
+		i->fill = readInt(r) != 0;
+		readInts(r, &i->out);
+	}
+
+	result.subst.resize(readCount(r));
+	for (auto i = result.subst.begin(); i != result.subst.end() and not r.failed; i++) {
+		readMaterial(r, *i);
+		i->tap = readInt(r);
+		i->well = readLevel(r);
+	}
+
+	result.models.resize(readCount(r));
+	for (auto i = result.models.begin(); i != result.models.end() and not r.failed; i++) {
+		i->type = readInt(r);
+		i->variant = readString(r);
+		i->name = readString(r);
+		i->diff = readLevel(r);
+		i->bins.resize(readCount(r));
+		for (auto j = i->bins.begin(); j != i->bins.end() and not r.failed; j++) {
+			j->first = readInt(r);
+			j->second = readInt(r);
+		}
+	}
+
+	result.wires.resize(readCount(r));
+	for (auto i = result.wires.begin(); i != result.wires.end() and not r.failed; i++) {
+		readMaterial(r, *i);
+	}
+
+	result.vias.resize(readCount(r));
+	for (auto i = result.vias.begin(); i != result.vias.end() and not r.failed; i++) {
+		readMaterial(r, *i);
+		i->down = readLevel(r);
+		i->up = readLevel(r);
+	}
+
+	result.dielec.resize(readCount(r));
+	for (auto i = result.dielec.begin(); i != result.dielec.end() and not r.failed; i++) {
+		i->down = readLevel(r);
+		i->up = readLevel(r);
+		i->thickness = (float)readDouble(r);
+		i->permitivity = (float)readDouble(r);
+	}
+
+	result.rules.resize(readCount(r));
+	for (auto i = result.rules.begin(); i != result.rules.end() and not r.failed; i++) {
+		i->type = readInt(r);
+		readInts(r, &i->operands);
+		readInts(r, &i->params);
+		readInts(r, &i->out);
+	}
+
+	uint64_t hash = 0;
+	if (not r.read(&hash) or not r.done() or hash != result.hash()) {
+		printf("%s:%d error: technology snapshot '%s' is corrupt.\n", __FILE__, __LINE__, path.c_str());
+		return false;
+	}
+
+	result.reindex();
+	tech = result;
+	return true;
+}
+
+}
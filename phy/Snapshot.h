@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "Tech.h"
+
+using namespace std;
+
+namespace phy {
+
+// A snapshot is a compact binary copy of a loaded Tech so that later runs
+// can skip the tech script. It is tagged with a caller provided key,
+// typically a hash of the script and its arguments, and is rejected on load
+// when the key or format version doesn't match. Tech::path and Tech::lib
+// are not part of the snapshot.
+bool saveSnapshot(const Tech &tech, string path, uint64_t key);
+bool loadSnapshot(Tech &tech, string path, uint64_t key);
+
+}
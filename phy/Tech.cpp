@@ -1,7 +1,9 @@
 #include "Tech.h"
+#include "Binary.h"
 
 #include <limits>
 #include <algorithm>
+#include <functional>
 
 using namespace std;
 
@@ -183,7 +185,7 @@ Rule::~Rule() {
 }
 
 bool Rule::isOperator() const {
-	return type < Rule::SPACING;
+	return type < Rule::SPACING or type == Rule::DIFFERENCE or type == Rule::AND_INTERACT;
 }
 
 Tech::Tech(string path, string lib) {
@@ -191,6 +193,12 @@ Tech::Tech(string path, string lib) {
 	dbunit = 1.0;
 	scale = 1.0;
 
+	frozen = false;
+	frozenPaint = 0;
+	frozenRules = 0;
+	checkCount = 0;
+	levelCount = 0;
+
 	this->path = path;
 	this->lib = lib;
 }
@@ -202,26 +210,34 @@ bool Tech::isLoaded() const {
 	return not paint.empty();
 }
 
-int Tech::findRule(int type, vector<int> operands) const {
+static uint64_t ruleKey(int type, const vector<int> &operands) {
+	Hasher h;
+	h.push((int32_t)type);
+	for (auto i = operands.begin(); i != operands.end(); i++) {
+		h.push((int32_t)*i);
+	}
+	return h.value;
+}
+
+int Tech::findRule(int type, const vector<int> &operands) const {
 	if (operands.empty()) {
 		return std::numeric_limits<int>::max();
 	}
 
-	for (int i = 0; i < (int)rules.size(); i++) {
-		if (rules[i].type == type and rules[i].operands.size() == operands.size()) {
-			bool found = true;
-			for (int j = 0; j < (int)operands.size() and found; j++) {
-				found = (rules[i].operands[j] == operands[j]);
-			}
-			if (found) {
-				return flip(i);
-			}
+	auto range = ruleIndex.equal_range(ruleKey(type, operands));
+	for (auto i = range.first; i != range.second; i++) {
+		const Rule &rule = rules[i->second];
+		if (rule.type == type and rule.operands == operands) {
+			return flip(i->second);
 		}
 	}
 	return std::numeric_limits<int>::max();
 }
 
-int Tech::setRule(int type, vector<int> operands) {
+int Tech::setRule(int type, const vector<int> &operands) {
+	// the caller may change the parameters of the rule
+	unfreeze();
+
 	int result = findRule(type, operands);
 	if (result < 0) {
 		return result;
@@ -229,6 +245,9 @@ int Tech::setRule(int type, vector<int> operands) {
 
 	result = flip((int)rules.size());
 	rules.push_back(Rule(type, operands));
+	if (not operands.empty()) {
+		ruleIndex.insert(pair<uint64_t, int>(ruleKey(type, operands), flip(result)));
+	}
 	for (auto l = operands.begin(); l != operands.end(); l++) {
 		if (*l >= 0) {
 			paint[*l].out.push_back(result);
@@ -239,19 +258,82 @@ int Tech::setRule(int type, vector<int> operands) {
 	return result;
 }
 
+void Tech::reindex() {
+	ruleIndex.clear();
+	ruleIndex.reserve(rules.size());
+	for (int i = 0; i < (int)rules.size(); i++) {
+		if (not rules[i].operands.empty()) {
+			ruleIndex.insert(pair<uint64_t, int>(ruleKey(rules[i].type, rules[i].operands), i));
+		}
+	}
+}
+
+int Tech::staticDraw(int layer) const {
+	while (layer < 0 and flip(layer) < (int)rules.size()) {
+		const Rule &rule = rules[flip(layer)];
+		if (not rule.isOperator() or rule.operands.empty()) {
+			break;
+		}
+		layer = rule.operands[0];
+	}
+	return layer;
+}
+
+vector<int> Tech::canonical(int type, vector<int> operands) const {
+	if (type == Rule::DIFFERENCE and not operands.empty()) {
+		sort(operands.begin()+1, operands.end());
+		operands.erase(unique(operands.begin()+1, operands.end()), operands.end());
+		return operands;
+	} else if ((type != Rule::AND and type != Rule::OR) or operands.empty()) {
+		return operands;
+	}
+
+	int primary = operands[0];
+	if (type == Rule::OR) {
+		int draw = staticDraw(primary);
+		for (auto i = operands.begin()+1; i != operands.end(); i++) {
+			if (*i < primary and staticDraw(*i) == draw) {
+				primary = *i;
+			}
+		}
+	}
+
+	sort(operands.begin(), operands.end());
+	operands.erase(unique(operands.begin(), operands.end()), operands.end());
+	operands.erase(find(operands.begin(), operands.end(), primary));
+	operands.insert(operands.begin(), primary);
+	return operands;
+}
+
 int Tech::getOr(vector<int> layers) const {
+	layers = canonical(Rule::OR, layers);
+	if ((int)layers.size() == 1) {
+		return layers[0];
+	}
 	return findRule(Rule::OR, layers);
 }
 
 int Tech::setOr(vector<int> layers) {
+	layers = canonical(Rule::OR, layers);
+	if ((int)layers.size() == 1) {
+		return layers[0];
+	}
 	return setRule(Rule::OR, layers);
 }
 
 int Tech::getAnd(vector<int> layers) const {
+	layers = canonical(Rule::AND, layers);
+	if ((int)layers.size() == 1) {
+		return layers[0];
+	}
 	return findRule(Rule::AND, layers);
 }
 
 int Tech::setAnd(vector<int> layers) {
+	layers = canonical(Rule::AND, layers);
+	if ((int)layers.size() == 1) {
+		return layers[0];
+	}
 	return setRule(Rule::AND, layers);
 }
 
@@ -280,6 +362,12 @@ int Tech::setNotInteract(int l0, int l1) {
 }
 
 int Tech::getSpacing(int l0, int l1) const {
+	int s0 = slot(l0), s1 = slot(l1);
+	if (s0 >= 0 and s1 >= 0) {
+		int c0 = checkIndex[s0], c1 = checkIndex[s1];
+		return (c0 < 0 or c1 < 0) ? 0 : spacingTable[c0*checkCount + c1];
+	}
+
 	int result = findRule(Rule::SPACING, {l0, l1});
 	if (result < 0) {
 		return rules[flip(result)].params[0];
@@ -302,6 +390,15 @@ int Tech::setSpacing(int l0, int l1, int value) {
 }
 
 vec2i Tech::getEnclosing(int l0, int l1) const {
+	int s0 = slot(l0), s1 = slot(l1);
+	if (s0 >= 0 and s1 >= 0) {
+		int c0 = checkIndex[s0], c1 = checkIndex[s1];
+		if (c0 >= 0 and c1 >= 0) {
+			return enclosingTable[c0*checkCount + c1];
+		}
+		return vec2i(std::numeric_limits<int>::min(), std::numeric_limits<int>::min());
+	}
+
 	int result = findRule(Rule::ENCLOSING, {l0, l1});
 	if (result < 0) {
 		vector<int> params = rules[flip(result)].params;
@@ -333,6 +430,11 @@ int Tech::setEnclosing(int l0, int l1, int lo, int hi) {
 }
 
 int Tech::getWidth(int l0) const {
+	int s0 = slot(l0);
+	if (s0 >= 0) {
+		return checkIndex[s0] < 0 ? 0 : widthTable[checkIndex[s0]];
+	}
+
 	int result = findRule(Rule::WIDTH, {l0});
 	if (result < 0) {
 		return rules[flip(result)].params[0];
@@ -362,10 +464,24 @@ string Tech::print(int layer) const {
 	const Rule &rule = rules[flip(layer)];
 	switch (rule.type) {
 	case Rule::NOT: return string("~") + print(rule.operands[0]);
-	case Rule::AND: return print(rule.operands[0]) + "&" + print(rule.operands[1]);
-	case Rule::OR:  return string("(") + print(rule.operands[0]) + "|" + print(rule.operands[1]) + ")";
+	case Rule::AND:
+	case Rule::OR: {
+		string result = print(rule.operands[0]);
+		for (int i = 1; i < (int)rule.operands.size(); i++) {
+			result += (rule.type == Rule::AND ? "&" : "|") + print(rule.operands[i]);
+		}
+		return rule.type == Rule::OR ? "(" + result + ")" : result;
+	}
 	case Rule::INTERACT: return "interact(" + print(rule.operands[0]) + "," + print(rule.operands[1]) + ")";
 	case Rule::NOT_INTERACT: return "not_interact(" + print(rule.operands[0]) + "," + print(rule.operands[1]) + ")";
+	case Rule::DIFFERENCE: {
+		string result = print(rule.operands[0]);
+		for (int i = 1; i < (int)rule.operands.size(); i++) {
+			result += "-" + print(rule.operands[i]);
+		}
+		return "(" + result + ")";
+	}
+	case Rule::AND_INTERACT: return "interact(" + print(rule.operands[0]) + "&" + print(rule.operands[1]) + "," + print(rule.operands[2]) + ")";
 	case Rule::SPACING:  return print(rule.operands[0]) + "<->" + print(rule.operands[1]);
 	case Rule::ENCLOSING:  return "enclosing(" + print(rule.operands[0]) + "," + print(rule.operands[1]) + ")";
 	default: printf("%s:%d error: unsupported operation (rule[%d].type=%d).\n", __FILE__, __LINE__, flip(layer), rule.type);
@@ -375,6 +491,11 @@ string Tech::print(int layer) const {
 
 
 int Tech::findPaint(string name) const {
+	if (frozen and frozenPaint == (int)paint.size()) {
+		auto pos = paintNames.find(name);
+		return pos == paintNames.end() ? -1 : pos->second;
+	}
+
 	for (int i = 0; i < (int)paint.size(); i++) {
 		if (paint[i].name == name) {
 			return i;
@@ -385,6 +506,11 @@ int Tech::findPaint(string name) const {
 }
 
 int Tech::findPaint(int major, int minor) const {
+	if (frozen and frozenPaint == (int)paint.size()) {
+		auto pos = paintNumbers.find(((uint64_t)(uint32_t)major << 32) | (uint32_t)minor);
+		return pos == paintNumbers.end() ? -1 : pos->second;
+	}
+
 	for (int i = 0; i < (int)paint.size(); i++) {
 		if (paint[i].major == major and paint[i].minor == minor) {
 			return i;
@@ -415,6 +541,11 @@ int Tech::findModel(int type, string variant) const {
 }
 
 const Material *Tech::findMaterial(int layer) const {
+	int s = slot(layer);
+	if (s >= 0) {
+		return layerMaterial[s].valid() ? &at(layerMaterial[s]) : nullptr;
+	}
+
 	for (int j = 0; j < (int)subst.size(); j++) {
 		if (subst[j].contains(layer)) {
 			return &subst[j];
@@ -436,6 +567,11 @@ const Material *Tech::findMaterial(int layer) const {
 }
 
 bool Tech::isRouting(int layer) const {
+	int s = slot(layer);
+	if (s >= 0) {
+		return (layerFlags[s] & ROUTING) != 0;
+	}
+
 	for (auto wire = wires.begin(); wire != wires.end(); wire++) {
 		if (layer == wire->draw) {
 			return true;
@@ -452,6 +588,11 @@ bool Tech::isRouting(int layer) const {
 }
 
 bool Tech::isSubstrate(int layer) const {
+	int s = slot(layer);
+	if (s >= 0) {
+		return (layerFlags[s] & SUBSTRATE) != 0;
+	}
+
 	for (auto mat = subst.begin(); mat != subst.end(); mat++) {
 		if (mat->contains(layer)) {
 			return true;
@@ -462,6 +603,11 @@ bool Tech::isSubstrate(int layer) const {
 }
 
 bool Tech::isPin(int layer) const {
+	int s = slot(layer);
+	if (s >= 0) {
+		return (layerFlags[s] & PIN) != 0;
+	}
+
 	for (auto wire = wires.begin(); wire != wires.end(); wire++) {
 		if (layer == wire->pin) {
 			return true;
@@ -484,6 +630,11 @@ bool Tech::isPin(int layer) const {
 }
 
 bool Tech::isLabel(int layer) const {
+	int s = slot(layer);
+	if (s >= 0) {
+		return (layerFlags[s] & LABEL) != 0;
+	}
+
 	for (auto wire = wires.begin(); wire != wires.end(); wire++) {
 		if (layer == wire->label) {
 			return true;
@@ -506,6 +657,11 @@ bool Tech::isLabel(int layer) const {
 }
 
 bool Tech::isWell(int layer) const {
+	int s = slot(layer);
+	if (s >= 0) {
+		return (layerFlags[s] & WELL) != 0;
+	}
+
 	for (auto mat = subst.begin(); mat != subst.end(); mat++) {
 		if (not mat->well.valid() and mat->contains(layer)) {
 			return true;
@@ -525,6 +681,11 @@ const Material &Tech::at(Level level) const {
 }
 
 vector<int> Tech::via(Level down, Level up) const {
+	int d = levelSlot(down), u = levelSlot(up);
+	if (d >= 0 and u >= 0) {
+		return viaTable[d*levelCount + u];
+	}
+
 	Level curr = down;
 	
 	vector<int> result;
@@ -542,4 +703,525 @@ vector<int> Tech::via(Level down, Level up) const {
 	return result;
 }
 
+// Call fn on every layer id stored in the materials
+static void visitMaterials(Tech &tech, function<void(int &layer, bool list)> fn) {
+	auto visit = [&](Material &mat) {
+		fn(mat.draw, false);
+		fn(mat.label, false);
+		fn(mat.pin, false);
+		for (auto i = mat.mask.begin(); i != mat.mask.end(); i++) {
+			fn(*i, true);
+		}
+		for (auto i = mat.excl.begin(); i != mat.excl.end(); i++) {
+			fn(*i, true);
+		}
+	};
+	for (auto i = tech.subst.begin(); i != tech.subst.end(); i++) {
+		visit(*i);
+	}
+	for (auto i = tech.wires.begin(); i != tech.wires.end(); i++) {
+		visit(*i);
+	}
+	for (auto i = tech.vias.begin(); i != tech.vias.end(); i++) {
+		visit(*i);
+	}
+	fn(tech.boundary, false);
+}
+
+void Tech::optimize() {
+	unfreeze();
+
+	int n = (int)rules.size();
+	if (n == 0) {
+		return;
+	}
+
+	// Outside of a list, -1 means there isn't a layer rather than rule 0. To
+	// keep that meaning, rule 0 is never merged away or renumbered.
+	auto isRef = [&](int layer, bool list) {
+		return layer < 0 and flip(layer) < n and (list or layer != -1);
+	};
+
+	// Rules that nothing uses were presumably defined to be looked up by the
+	// caller, so they are kept even if they are no longer used once the
+	// others are optimized.
+	vector<int> users(n, 0);
+	vector<bool> root(n, false);
+	for (auto rule = rules.begin(); rule != rules.end(); rule++) {
+		for (auto i = rule->operands.begin(); i != rule->operands.end(); i++) {
+			if (isRef(*i, true)) {
+				users[flip(*i)]++;
+			}
+		}
+	}
+	visitMaterials(*this, [&](int &layer, bool list) {
+		if (isRef(layer, list)) {
+			root[flip(layer)] = true;
+		}
+	});
+	root[0] = true;
+	for (int i = 0; i < n; i++) {
+		root[i] = root[i] or users[i] == 0;
+	}
+
+	// remap[i] is the layer that replaces rule i, flip(i) if it is kept
+	vector<int> remap(n);
+	for (int i = 0; i < n; i++) {
+		remap[i] = flip(i);
+	}
+	auto resolve = [&](int layer) {
+		while (layer < 0 and flip(layer) < n and remap[flip(layer)] != layer) {
+			layer = remap[flip(layer)];
+		}
+		return layer;
+	};
+
+	// Rewrite the operands of every kept rule into canonical form and merge
+	// rules that end up identical. Operands always come before the rules
+	// that use them, so they are resolved by the time they are needed.
+	auto merge = [&]() {
+		map<pair<int, vector<int> >, int> seen;
+		for (int i = 0; i < n; i++) {
+			if (remap[i] != flip(i)) {
+				continue;
+			}
+
+			Rule &rule = rules[i];
+			for (auto j = rule.operands.begin(); j != rule.operands.end(); j++) {
+				*j = resolve(*j);
+			}
+			rule.operands = canonical(rule.type, rule.operands);
+
+			if ((rule.type == Rule::AND or rule.type == Rule::OR) and (int)rule.operands.size() == 1 and i != 0) {
+				remap[i] = rule.operands[0];
+				continue;
+			}
+
+			auto pos = seen.insert(pair<pair<int, vector<int> >, int>(pair<int, vector<int> >(rule.type, rule.operands), i));
+			if (pos.second or i == 0) {
+				continue;
+			}
+
+			Rule &prev = rules[pos.first->second];
+			if (not rule.isOperator()) {
+				// Duplicate checks keep the strictest parameters, like
+				// setSpacing() does.
+				if (prev.params.size() < rule.params.size()) {
+					prev.params.resize(rule.params.size(), std::numeric_limits<int>::min());
+				}
+				for (int j = 0; j < (int)rule.params.size(); j++) {
+					prev.params[j] = max(prev.params[j], rule.params[j]);
+				}
+			}
+			remap[i] = flip(pos.first->second);
+		}
+	};
+
+	// Count the users of each rule that is kept
+	auto countUsers = [&]() {
+		vector<int> result(n, 0);
+		for (int i = 0; i < n; i++) {
+			if (remap[i] == flip(i)) {
+				for (auto j = rules[i].operands.begin(); j != rules[i].operands.end(); j++) {
+					if (*j < 0) {
+						result[flip(*j)]++;
+					}
+				}
+			}
+		}
+		visitMaterials(*this, [&](int &layer, bool list) {
+			if (isRef(layer, list) and resolve(layer) < 0) {
+				result[flip(resolve(layer))]++;
+			}
+		});
+		return result;
+	};
+
+	merge();
+
+	// Shared subexpressions aren't flattened into more than one rule
+	vector<int> merged = countUsers();
+
+	bool flattened = false;
+	for (int i = 0; i < n; i++) {
+		Rule &rule = rules[i];
+		if (remap[i] != flip(i) or (rule.type != Rule::AND and rule.type != Rule::OR)) {
+			continue;
+		}
+
+		vector<int> operands;
+		for (auto j = rule.operands.begin(); j != rule.operands.end(); j++) {
+			if (*j < 0 and rules[flip(*j)].type == rule.type and merged[flip(*j)] == 1 and not root[flip(*j)]) {
+				// The nested rule's first operand takes its place so that
+				// the primary operand of this rule doesn't change.
+				const vector<int> &nested = rules[flip(*j)].operands;
+				operands.insert(operands.end(), nested.begin(), nested.end());
+				merged[flip(*j)] = 0;
+				flattened = true;
+			} else {
+				operands.push_back(*j);
+			}
+		}
+		rule.operands = operands;
+	}
+
+	if (flattened) {
+		merge();
+	}
+
+	// Replace patterns that are expensive as written with fused operations
+	merged = countUsers();
+	bool rewritten = false;
+	for (int i = 0; i < n; i++) {
+		Rule &rule = rules[i];
+		if (remap[i] != flip(i)) {
+			continue;
+		}
+
+		auto isType = [&](int layer, int type) {
+			return layer < 0 and rules[flip(layer)].type == type;
+		};
+
+		if (rule.type == Rule::NOT and isType(rule.operands[0], Rule::NOT) and i != 0) {
+			// NOT(NOT(x)) -> x
+			remap[i] = resolve(rules[flip(rule.operands[0])].operands[0]);
+			rewritten = true;
+		} else if (rule.type == Rule::AND and (int)rule.operands.size() > 1) {
+			// AND(x, NOT(y), NOT(z)) -> DIFFERENCE(x, y, z)
+			bool matches = true;
+			for (auto j = rule.operands.begin()+1; j != rule.operands.end() and matches; j++) {
+				matches = isType(*j, Rule::NOT);
+			}
+			if (matches) {
+				for (auto j = rule.operands.begin()+1; j != rule.operands.end(); j++) {
+					*j = rules[flip(*j)].operands[0];
+				}
+				rule.type = Rule::DIFFERENCE;
+				rewritten = true;
+			}
+		} else if (rule.type == Rule::INTERACT and isType(rule.operands[0], Rule::AND)) {
+			// INTERACT(AND(a, b), c) -> AND_INTERACT(a, b, c)
+			int idx = flip(rule.operands[0]);
+			if ((int)rules[idx].operands.size() == 2 and merged[idx] == 1 and not root[idx]) {
+				rule.operands = {rules[idx].operands[0], rules[idx].operands[1], rule.operands[1]};
+				rule.type = Rule::AND_INTERACT;
+				rewritten = true;
+			}
+		}
+	}
+
+	if (rewritten) {
+		merge();
+	}
+
+	// Keep everything reachable from the rules and materials that must stay
+	vector<bool> live(n, false);
+	vector<int> stack;
+	for (int i = 0; i < n; i++) {
+		if (root[i] and remap[i] == flip(i)) {
+			stack.push_back(i);
+		}
+	}
+	visitMaterials(*this, [&](int &layer, bool list) {
+		if (isRef(layer, list) and resolve(layer) < 0) {
+			stack.push_back(flip(resolve(layer)));
+		}
+	});
+	while (not stack.empty()) {
+		int i = stack.back();
+		stack.pop_back();
+		if (live[i]) {
+			continue;
+		}
+		live[i] = true;
+		for (auto j = rules[i].operands.begin(); j != rules[i].operands.end(); j++) {
+			if (*j < 0 and not live[flip(*j)]) {
+				stack.push_back(flip(*j));
+			}
+		}
+	}
+
+	vector<int> index(n, -1);
+	vector<Rule> result;
+	for (int i = 0; i < n; i++) {
+		if (live[i]) {
+			index[i] = (int)result.size();
+			result.push_back(rules[i]);
+			result.back().out.clear();
+		}
+	}
+
+	auto renumber = [&](int layer) {
+		layer = resolve(layer);
+		if (layer < 0 and flip(layer) < n and index[flip(layer)] >= 0) {
+			return flip(index[flip(layer)]);
+		}
+		return layer;
+	};
+
+	for (auto rule = result.begin(); rule != result.end(); rule++) {
+		for (auto j = rule->operands.begin(); j != rule->operands.end(); j++) {
+			*j = renumber(*j);
+		}
+	}
+	visitMaterials(*this, [&](int &layer, bool list) {
+		if (isRef(layer, list)) {
+			layer = renumber(layer);
+		}
+	});
+
+	rules = result;
+	for (auto i = paint.begin(); i != paint.end(); i++) {
+		i->out.clear();
+	}
+	for (int i = 0; i < (int)rules.size(); i++) {
+		for (auto j = rules[i].operands.begin(); j != rules[i].operands.end(); j++) {
+			if (*j >= 0) {
+				paint[*j].out.push_back(flip(i));
+			} else {
+				rules[flip(*j)].out.push_back(flip(i));
+			}
+		}
+	}
+	reindex();
+}
+
+int Tech::slot(int layer) const {
+	if (not frozen) {
+		return -1;
+	} else if (layer >= 0) {
+		return layer < frozenPaint ? layer : -1;
+	}
+	int idx = flip(layer);
+	return idx < frozenRules ? frozenPaint+idx : -1;
+}
+
+int Tech::levelSlot(Level level) const {
+	if (not frozen or level.idx < 0) {
+		return -1;
+	}
+
+	int offset = 0;
+	if (level.type == Level::SUBST) {
+		return level.idx < (int)subst.size() ? level.idx : -1;
+	}
+	offset += (int)subst.size();
+	if (level.type == Level::ROUTE) {
+		return level.idx < (int)wires.size() ? offset+level.idx : -1;
+	}
+	offset += (int)wires.size();
+	if (level.type == Level::VIA) {
+		return level.idx < (int)vias.size() ? offset+level.idx : -1;
+	}
+	return -1;
+}
+
+void Tech::unfreeze() {
+	if (not frozen) {
+		return;
+	}
+
+	frozen = false;
+	layerFlags.clear();
+	layerMaterial.clear();
+	paintNames.clear();
+	paintNumbers.clear();
+	checkIndex.clear();
+	checkCount = 0;
+	spacingTable.clear();
+	enclosingTable.clear();
+	widthTable.clear();
+	levelCount = 0;
+	viaTable.clear();
+}
+
+void Tech::indexPaint() {
+	paintNames.clear();
+	paintNumbers.clear();
+	paintNames.reserve(paint.size());
+	paintNumbers.reserve(paint.size());
+	for (int i = 0; i < (int)paint.size(); i++) {
+		// findPaint() returns the first match
+		paintNames.insert(pair<string, int>(paint[i].name, i));
+		paintNumbers.insert(pair<uint64_t, int>(((uint64_t)(uint32_t)paint[i].major << 32) | (uint32_t)paint[i].minor, i));
+	}
+}
+
+void Tech::freeze() {
+	// The tables are filled in from the scanning versions of the queries
+	unfreeze();
+
+	int slots = (int)(paint.size() + rules.size());
+	auto slotOf = [&](int layer) {
+		if (layer >= 0) {
+			return layer < (int)paint.size() ? layer : -1;
+		}
+		return flip(layer) < (int)rules.size() ? (int)paint.size()+flip(layer) : -1;
+	};
+
+	layerFlags.assign(slots, 0);
+	layerMaterial.assign(slots, Level());
+	for (int i = 0; i < slots; i++) {
+		int layer = i < (int)paint.size() ? i : flip(i-(int)paint.size());
+		layerFlags[i] = (isRouting(layer) ? ROUTING : 0)
+			| (isSubstrate(layer) ? SUBSTRATE : 0)
+			| (isPin(layer) ? PIN : 0)
+			| (isLabel(layer) ? LABEL : 0)
+			| (isWell(layer) ? WELL : 0);
+	}
+
+	// Same priority as findMaterial()
+	vector<Level> levels;
+	for (int i = 0; i < (int)subst.size(); i++) {
+		levels.push_back(Level(Level::SUBST, i));
+	}
+	for (int i = 0; i < (int)wires.size(); i++) {
+		levels.push_back(Level(Level::ROUTE, i));
+	}
+	for (int i = 0; i < (int)vias.size(); i++) {
+		levels.push_back(Level(Level::VIA, i));
+	}
+	for (auto level = levels.begin(); level != levels.end(); level++) {
+		const Material &mat = at(*level);
+		vector<int> layers = {mat.draw, mat.label, mat.pin};
+		layers.insert(layers.end(), mat.mask.begin(), mat.mask.end());
+		for (auto layer = layers.begin(); layer != layers.end(); layer++) {
+			int s = slotOf(*layer);
+			if (s >= 0 and not layerMaterial[s].valid()) {
+				layerMaterial[s] = *level;
+			}
+		}
+	}
+
+	indexPaint();
+
+	checkIndex.assign(slots, -1);
+	checkCount = 0;
+	for (auto rule = rules.begin(); rule != rules.end(); rule++) {
+		if (rule->type == Rule::SPACING or rule->type == Rule::ENCLOSING or rule->type == Rule::WIDTH) {
+			for (auto layer = rule->operands.begin(); layer != rule->operands.end(); layer++) {
+				int s = slotOf(*layer);
+				if (s >= 0 and checkIndex[s] < 0) {
+					checkIndex[s] = checkCount++;
+				}
+			}
+		}
+	}
+
+	vector<int> checkLayer(checkCount, 0);
+	for (int i = 0; i < slots; i++) {
+		if (checkIndex[i] >= 0) {
+			checkLayer[checkIndex[i]] = i < (int)paint.size() ? i : flip(i-(int)paint.size());
+		}
+	}
+
+	spacingTable.assign(checkCount*checkCount, 0);
+	enclosingTable.assign(checkCount*checkCount, vec2i(0, 0));
+	widthTable.assign(checkCount, 0);
+	for (int i = 0; i < checkCount; i++) {
+		for (int j = 0; j < checkCount; j++) {
+			spacingTable[i*checkCount + j] = getSpacing(checkLayer[i], checkLayer[j]);
+			enclosingTable[i*checkCount + j] = getEnclosing(checkLayer[i], checkLayer[j]);
+		}
+		widthTable[i] = getWidth(checkLayer[i]);
+	}
+
+	levelCount = (int)levels.size();
+	viaTable.assign(levelCount*levelCount, vector<int>());
+	for (int i = 0; i < levelCount; i++) {
+		for (int j = 0; j < levelCount; j++) {
+			viaTable[i*levelCount + j] = via(levels[i], levels[j]);
+		}
+	}
+
+	frozenPaint = (int)paint.size();
+	frozenRules = (int)rules.size();
+	frozen = true;
+}
+
+static void hashLevel(Hasher &h, Level level) {
+	h.push((int32_t)level.type);
+	h.push((int32_t)level.idx);
+}
+
+static void hashInts(Hasher &h, const vector<int> &v) {
+	h.push((int32_t)v.size());
+	for (auto i = v.begin(); i != v.end(); i++) {
+		h.push((int32_t)*i);
+	}
+}
+
+static void hashMaterial(Hasher &h, const Material &m) {
+	h.push((int32_t)m.draw);
+	h.push((int32_t)m.label);
+	h.push((int32_t)m.pin);
+	hashInts(h, m.mask);
+	hashInts(h, m.excl);
+	h.push(m.thickness);
+	h.push(m.resistivity);
+}
+
+uint64_t Tech::hash() const {
+	Hasher h;
+	h.push(dbunit);
+	h.push(scale);
+	h.push((int32_t)boundary);
+
+	h.push((int32_t)paint.size());
+	for (auto i = paint.begin(); i != paint.end(); i++) {
+		h.push(i->name);
+		h.push((int32_t)i->major);
+		h.push((int32_t)i->minor);
+		h.push(i->fill);
+	}
+
+	h.push((int32_t)subst.size());
+	for (auto i = subst.begin(); i != subst.end(); i++) {
+		hashMaterial(h, *i);
+		h.push((int32_t)i->tap);
+		hashLevel(h, i->well);
+	}
+
+	h.push((int32_t)models.size());
+	for (auto i = models.begin(); i != models.end(); i++) {
+		h.push((int32_t)i->type);
+		h.push(i->variant);
+		h.push(i->name);
+		hashLevel(h, i->diff);
+		h.push((int32_t)i->bins.size());
+		for (auto j = i->bins.begin(); j != i->bins.end(); j++) {
+			h.push((int32_t)j->first);
+			h.push((int32_t)j->second);
+		}
+	}
+
+	h.push((int32_t)wires.size());
+	for (auto i = wires.begin(); i != wires.end(); i++) {
+		hashMaterial(h, *i);
+	}
+
+	h.push((int32_t)vias.size());
+	for (auto i = vias.begin(); i != vias.end(); i++) {
+		hashMaterial(h, *i);
+		hashLevel(h, i->down);
+		hashLevel(h, i->up);
+	}
+
+	h.push((int32_t)dielec.size());
+	for (auto i = dielec.begin(); i != dielec.end(); i++) {
+		hashLevel(h, i->down);
+		hashLevel(h, i->up);
+		h.push(i->thickness);
+		h.push(i->permitivity);
+	}
+
+	h.push((int32_t)rules.size());
+	for (auto i = rules.begin(); i != rules.end(); i++) {
+		h.push((int32_t)i->type);
+		hashInts(h, i->operands);
+		hashInts(h, i->params);
+	}
+	return h.value;
+}
+
 }
@@ -4,6 +4,8 @@
 #include <vector>
 #include <array>
 #include <map>
+#include <unordered_map>
+#include <cstdint>
 
 #include "vector.h"
 
@@ -173,6 +175,11 @@ struct Rule {
 		SPACING = 5,
 		ENCLOSING = 6,
 		WIDTH = 7,
+		// These fused operations are only created by Tech::optimize()
+		// operands[0] minus every other operand, the same as AND(x, NOT(y), ...)
+		DIFFERENCE = 8,
+		// INTERACT(AND(operands[0], operands[1]), operands[2])
+		AND_INTERACT = 9,
 		// TODO implement remaining DRC checks
 		// EDGES, WITH/WITHOUT_AREA, WITH/WITHOUT_LENGTH,
 		// ONGRID, GROW, SHRINK
@@ -240,13 +247,91 @@ struct Tech {
 	// information.
 	vector<Rule> rules;
 
+	// Lookup table into rules by a hash of the type and operands of each rule.
+	// This is maintained by setRule(). Call reindex() after modifying rules
+	// directly.
+	unordered_multimap<uint64_t, int> ruleIndex;
+
+	/////////////////////////////////////////////
+	// These are dense lookup tables built by freeze() so that the const
+	// queries below don't have to scan the materials and rules. Layers are
+	// indexed by slot().
+
+	enum {
+		ROUTING = 1,
+		SUBSTRATE = 2,
+		PIN = 4,
+		LABEL = 8,
+		WELL = 16,
+	};
+
+	bool frozen;
+	// the size of paint and rules when the tables were built
+	int frozenPaint;
+	int frozenRules;
+
+	// flags from the enum above, indexed by slot
+	vector<uint8_t> layerFlags;
+	// the material returned by findMaterial(), indexed by slot
+	vector<Level> layerMaterial;
+
+	unordered_map<string, int> paintNames;
+	// major << 32 | minor -> index into paint
+	unordered_map<uint64_t, int> paintNumbers;
+
+	// slot -> row and column in the check tables, -1 if the layer isn't used
+	// by any spacing, enclosing, or width rule
+	vector<int> checkIndex;
+	int checkCount;
+	// indexed by checkIndex[slot(l0)]*checkCount + checkIndex[slot(l1)]
+	vector<int> spacingTable;
+	vector<vec2i> enclosingTable;
+	// indexed by checkIndex[slot(l0)]
+	vector<int> widthTable;
+
+	// indexed by levelSlot(down)*levelCount + levelSlot(up)
+	int levelCount;
+	vector<vector<int> > viaTable;
+
+	/////////////////////////////////////////////
+
+	// Build the lookup tables. This should be called once the technology is
+	// loaded. setRule() drops the tables, and freeze() must be called again
+	// after any other modification.
+	void freeze();
+	void unfreeze();
+	// Build paintNames and paintNumbers, this is part of freeze()
+	void indexPaint();
+	// layer >= 0 maps to layer and layer < 0 maps to frozenPaint+flip(layer).
+	// Returns -1 if the tables aren't built or don't cover this layer.
+	int slot(int layer) const;
+	int levelSlot(Level level) const;
+
 	bool isLoaded() const;
 
 	// layer - paint layers or operations on them
 	// layer < 0 refers to "rules"
 	// layer >= 0 refers to "paint"
-	int findRule(int type, vector<int> operands) const;
-	int setRule(int type, vector<int> operands);
+	int findRule(int type, const vector<int> &operands) const;
+	int setRule(int type, const vector<int> &operands);
+	void reindex();
+
+	// The draw layer that an operation inherits from its first operand
+	int staticDraw(int layer) const;
+	// Put the operands of an AND or OR into canonical form. The first operand
+	// decides the draw layer of the result, and for AND the nets as well, so
+	// it stays first. For OR it may be swapped for any operand with the same
+	// static draw. The remaining operands are sorted and duplicates removed.
+	vector<int> canonical(int type, vector<int> operands) const;
+	// Shrink the rule DAG evaluated for every cell. Every rule is put into
+	// canonical form, identical subexpressions are merged, and AND/OR rules
+	// that are only used by a rule of the same type are flattened into it.
+	// Then AND(x, NOT(y)) becomes DIFFERENCE(x, y), INTERACT(AND(a, b), c)
+	// becomes AND_INTERACT(a, b, c) when nothing else uses the AND, and
+	// NOT(NOT(x)) is replaced by x. Operations that are no longer used by
+	// anything are removed and the remaining rules are renumbered, so layer
+	// ids from before this call should be looked up again.
+	void optimize();
 	int getOr(vector<int> layers) const;
 	int setOr(vector<int> layers);
 	int getAnd(vector<int> layers) const;
@@ -280,6 +365,10 @@ struct Tech {
 	// level - physical levels on the chip
 	const Material &at(Level level) const;
 	vector<int> via(Level down, Level up) const;
+
+	// A fingerprint of the layers, materials, and rules used to validate
+	// results that were cached on disk. This ignores path and lib.
+	uint64_t hash() const;
 };
 
 }
@@ -0,0 +1,311 @@
+#include "TechTables.h"
+
+#include <cstdio>
+#include <cmath>
+
+namespace phy {
+
+static string quote(string str) {
+	string result = "\"";
+	for (auto c = str.begin(); c != str.end(); c++) {
+		if (*c == '"' or *c == '\\') {
+			result += '\\';
+			result += *c;
+		} else if (*c < ' ' or *c > '~') {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\%03o", (unsigned char)*c);
+			result += buf;
+		} else {
+			result += *c;
+		}
+	}
+	return result + "\"";
+}
+
+// Hex floats are exact, so the emitted tables hash the same as the Tech they
+// came from.
+static string real(double value) {
+	if (not isfinite(value)) {
+		return "0.0";
+	}
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%a", value);
+	return buf;
+}
+
+static string real(float value) {
+	return isfinite(value) ? real((double)value) + "f" : string("0.0f");
+}
+
+static string level(Level l) {
+	return "{" + to_string(l.type) + ", " + to_string(l.idx) + "}";
+}
+
+// Write the items as a constexpr array and return the expression that
+// refers to it. Zero length arrays aren't allowed so those become nullptr.
+static string array(string &out, string type, string name, const vector<string> &items, int perLine=1) {
+	if (items.empty()) {
+		return "nullptr";
+	}
+
+	out += "inline constexpr " + type + " " + name + "[] = {";
+	for (int i = 0; i < (int)items.size(); i++) {
+		out += (i % perLine == 0) ? "\n\t" : " ";
+		out += items[i] + ",";
+	}
+	out += "\n};\n\n";
+	return name;
+}
+
+template <typename T>
+static vector<string> strings(const vector<T> &v) {
+	vector<string> result;
+	for (auto i = v.begin(); i != v.end(); i++) {
+		result.push_back(to_string(*i));
+	}
+	return result;
+}
+
+bool emitTech(const Tech &tech, string path, string name) {
+	if (not tech.frozen) {
+		printf("%s:%d error: technology must be frozen before it is emitted.\n", __FILE__, __LINE__);
+		return false;
+	}
+
+	vector<int> ints;
+	auto list = [&](const vector<int> &v) {
+		string result = to_string(ints.size()) + ", " + to_string(v.size());
+		ints.insert(ints.end(), v.begin(), v.end());
+		return result;
+	};
+	auto material = [&](const Material &m) {
+		return "{" + to_string(m.draw) + ", " + to_string(m.label) + ", " + to_string(m.pin)
+			+ ", " + list(m.mask) + ", " + list(m.excl)
+			+ ", " + real(m.thickness) + ", " + real(m.resistivity) + "}";
+	};
+
+	vector<string> paint;
+	for (auto i = tech.paint.begin(); i != tech.paint.end(); i++) {
+		paint.push_back("{" + quote(i->name) + ", " + to_string(i->major) + ", " + to_string(i->minor)
+			+ ", " + (i->fill ? "true" : "false") + ", " + list(i->out) + "}");
+	}
+
+	vector<string> subst;
+	for (auto i = tech.subst.begin(); i != tech.subst.end(); i++) {
+		subst.push_back("{" + material(*i) + ", " + to_string(i->tap) + ", " + level(i->well) + "}");
+	}
+
+	vector<string> models;
+	for (auto i = tech.models.begin(); i != tech.models.end(); i++) {
+		vector<int> bins;
+		for (auto j = i->bins.begin(); j != i->bins.end(); j++) {
+			bins.push_back(j->first);
+			bins.push_back(j->second);
+		}
+		models.push_back("{" + to_string(i->type) + ", " + quote(i->variant) + ", " + quote(i->name)
+			+ ", " + level(i->diff) + ", " + to_string(ints.size()) + ", " + to_string(i->bins.size()) + "}");
+		ints.insert(ints.end(), bins.begin(), bins.end());
+	}
+
+	vector<string> wires;
+	for (auto i = tech.wires.begin(); i != tech.wires.end(); i++) {
+		wires.push_back(material(*i));
+	}
+
+	vector<string> vias;
+	for (auto i = tech.vias.begin(); i != tech.vias.end(); i++) {
+		vias.push_back("{" + material(*i) + ", " + level(i->down) + ", " + level(i->up) + "}");
+	}
+
+	vector<string> dielec;
+	for (auto i = tech.dielec.begin(); i != tech.dielec.end(); i++) {
+		dielec.push_back("{" + level(i->down) + ", " + level(i->up) + ", " + real(i->thickness) + ", " + real(i->permitivity) + "}");
+	}
+
+	vector<string> rules;
+	for (auto i = tech.rules.begin(); i != tech.rules.end(); i++) {
+		rules.push_back("{" + to_string(i->type) + ", " + list(i->operands) + ", " + list(i->params) + ", " + list(i->out) + "}");
+	}
+
+	vector<int> layerMaterial;
+	for (auto i = tech.layerMaterial.begin(); i != tech.layerMaterial.end(); i++) {
+		layerMaterial.push_back(i->type);
+		layerMaterial.push_back(i->idx);
+	}
+
+	vector<int> enclosing;
+	for (auto i = tech.enclosingTable.begin(); i != tech.enclosingTable.end(); i++) {
+		enclosing.push_back((*i)[0]);
+		enclosing.push_back((*i)[1]);
+	}
+
+	vector<int> viaTable;
+	for (auto i = tech.viaTable.begin(); i != tech.viaTable.end(); i++) {
+		viaTable.push_back((int)ints.size());
+		ints.insert(ints.end(), i->begin(), i->end());
+	}
+	viaTable.push_back((int)ints.size());
+
+	string out;
+	out += "// Generated by emitTech() from " + tech.path + ", do not edit.\n";
+	out += "#pragma once\n\n";
+	out += "#include <phy/TechTables.h>\n\n";
+	out += "namespace " + name + " {\n\n";
+
+	string intsRef = array(out, "int", "ints", strings(ints), 16);
+	string paintRef = array(out, "phy::TechPaint", "paint", paint);
+	string substRef = array(out, "phy::TechSubstrate", "subst", subst);
+	string modelsRef = array(out, "phy::TechModel", "models", models);
+	string wiresRef = array(out, "phy::TechMaterial", "wires", wires);
+	string viasRef = array(out, "phy::TechVia", "vias", vias);
+	string dielecRef = array(out, "phy::TechDielectric", "dielec", dielec);
+	string rulesRef = array(out, "phy::TechRule", "rules", rules);
+
+	string flagsRef = array(out, "uint8_t", "layerFlags", strings(tech.layerFlags), 16);
+	string materialRef = array(out, "int", "layerMaterial", strings(layerMaterial), 16);
+	string checkRef = array(out, "int", "checkIndex", strings(tech.checkIndex), 16);
+	string spacingRef = array(out, "int", "spacingTable", strings(tech.spacingTable), tech.checkCount);
+	string enclosingRef = array(out, "int", "enclosingTable", strings(enclosing), 2*tech.checkCount);
+	string widthRef = array(out, "int", "widthTable", strings(tech.widthTable), 16);
+	string viaRef = array(out, "int", "viaTable", strings(viaTable), 16);
+
+	out += "inline constexpr phy::TechTables tables = {\n";
+	out += "\t" + real(tech.dbunit) + ", " + real(tech.scale) + ", " + to_string(tech.boundary) + ",\n";
+	out += "\t" + intsRef + ",\n";
+	out += "\t" + paintRef + ", " + to_string(tech.paint.size()) + ",\n";
+	out += "\t" + substRef + ", " + to_string(tech.subst.size()) + ",\n";
+	out += "\t" + modelsRef + ", " + to_string(tech.models.size()) + ",\n";
+	out += "\t" + wiresRef + ", " + to_string(tech.wires.size()) + ",\n";
+	out += "\t" + viasRef + ", " + to_string(tech.vias.size()) + ",\n";
+	out += "\t" + dielecRef + ", " + to_string(tech.dielec.size()) + ",\n";
+	out += "\t" + rulesRef + ", " + to_string(tech.rules.size()) + ",\n";
+	out += "\t" + flagsRef + ",\n";
+	out += "\t" + materialRef + ",\n";
+	out += "\t" + checkRef + ", " + to_string(tech.checkCount) + ",\n";
+	out += "\t" + spacingRef + ",\n";
+	out += "\t" + enclosingRef + ",\n";
+	out += "\t" + widthRef + ",\n";
+	out += "\t" + to_string(tech.levelCount) + ", " + viaRef + ",\n";
+	out += "};\n\n";
+	out += "}\n";
+
+	FILE *fptr = fopen(path.c_str(), "w");
+	if (fptr == nullptr) {
+		printf("%s:%d error: unable to open file '%s'.\n", __FILE__, __LINE__, path.c_str());
+		return false;
+	}
+	bool success = fwrite(out.data(), 1, out.size(), fptr) == out.size();
+	success = fclose(fptr) == 0 and success;
+	if (not success) {
+		printf("%s:%d error: unable to write file '%s'.\n", __FILE__, __LINE__, path.c_str());
+	}
+	return success;
+}
+
+static vector<int> list(const TechTables &src, int offset, int count) {
+	if (count <= 0) {
+		return vector<int>();
+	}
+	return vector<int>(src.ints+offset, src.ints+offset+count);
+}
+
+static Level level(const int *l) {
+	return Level(l[0], l[1]);
+}
+
+static void loadMaterial(Material &dst, const TechTables &src, const TechMaterial &mat) {
+	dst.mask = list(src, mat.mask, mat.maskCount);
+	dst.excl = list(src, mat.excl, mat.exclCount);
+}
+
+void loadTables(Tech &dst, const TechTables &src) {
+	dst.unfreeze();
+	dst.dbunit = src.dbunit;
+	dst.scale = src.scale;
+	dst.boundary = src.boundary;
+
+	dst.paint.clear();
+	for (int i = 0; i < src.paintCount; i++) {
+		const TechPaint &p = src.paint[i];
+		dst.paint.push_back(Paint(p.name, p.major, p.minor));
+		dst.paint.back().fill = p.fill;
+		dst.paint.back().out = list(src, p.out, p.outCount);
+	}
+
+	dst.subst.clear();
+	for (int i = 0; i < src.substCount; i++) {
+		const TechSubstrate &s = src.subst[i];
+		dst.subst.push_back(Substrate(s.mat.draw, s.mat.label, s.mat.pin, s.tap, level(s.well), s.mat.thickness, s.mat.resistivity));
+		loadMaterial(dst.subst.back(), src, s.mat);
+	}
+
+	dst.models.clear();
+	for (int i = 0; i < src.modelCount; i++) {
+		const TechModel &m = src.models[i];
+		vector<pair<int, int> > bins;
+		for (int j = 0; j < m.binCount; j++) {
+			bins.push_back(pair<int, int>(src.ints[m.bins+2*j], src.ints[m.bins+2*j+1]));
+		}
+		dst.models.push_back(Model(m.type, m.variant, m.name, level(m.diff), bins));
+	}
+
+	dst.wires.clear();
+	for (int i = 0; i < src.wireCount; i++) {
+		const TechMaterial &w = src.wires[i];
+		dst.wires.push_back(Routing(w.draw, w.label, w.pin, w.thickness, w.resistivity));
+		loadMaterial(dst.wires.back(), src, w);
+	}
+
+	dst.vias.clear();
+	for (int i = 0; i < src.viaCount; i++) {
+		const TechVia &v = src.vias[i];
+		dst.vias.push_back(Via(level(v.down), level(v.up), v.mat.draw, v.mat.label, v.mat.pin, v.mat.thickness, v.mat.resistivity));
+		loadMaterial(dst.vias.back(), src, v.mat);
+	}
+
+	dst.dielec.clear();
+	for (int i = 0; i < src.dielecCount; i++) {
+		const TechDielectric &d = src.dielec[i];
+		dst.dielec.push_back(Dielectric(level(d.down), level(d.up), d.thickness, d.permitivity));
+	}
+
+	dst.rules.clear();
+	for (int i = 0; i < src.ruleCount; i++) {
+		const TechRule &r = src.rules[i];
+		dst.rules.push_back(Rule(r.type, list(src, r.operands, r.operandCount), list(src, r.params, r.paramCount)));
+		dst.rules.back().out = list(src, r.out, r.outCount);
+	}
+	dst.reindex();
+
+	// The lookup tables are copied as is rather than rebuilt by freeze()
+	int slots = src.paintCount + src.ruleCount;
+	dst.layerFlags.assign(slots, 0);
+	dst.layerMaterial.assign(slots, Level());
+	dst.checkIndex.assign(slots, -1);
+	for (int i = 0; i < slots; i++) {
+		dst.layerFlags[i] = src.layerFlags[i];
+		dst.layerMaterial[i] = level(src.layerMaterial+2*i);
+		dst.checkIndex[i] = src.checkIndex[i];
+	}
+
+	dst.checkCount = src.checkCount;
+	dst.spacingTable.assign(src.spacingTable, src.spacingTable+src.checkCount*src.checkCount);
+	dst.enclosingTable.assign(src.checkCount*src.checkCount, vec2i(0, 0));
+	for (int i = 0; i < src.checkCount*src.checkCount; i++) {
+		dst.enclosingTable[i] = vec2i(src.enclosingTable[2*i], src.enclosingTable[2*i+1]);
+	}
+	dst.widthTable.assign(src.widthTable, src.widthTable+src.checkCount);
+
+	dst.levelCount = src.levelCount;
+	dst.viaTable.assign(src.levelCount*src.levelCount, vector<int>());
+	for (int i = 0; i < src.levelCount*src.levelCount; i++) {
+		dst.viaTable[i] = list(src, src.viaTable[i], src.viaTable[i+1]-src.viaTable[i]);
+	}
+
+	dst.indexPaint();
+	dst.frozenPaint = src.paintCount;
+	dst.frozenRules = src.ruleCount;
+	dst.frozen = true;
+}
+
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "Tech.h"
+
+using namespace std;
+
+namespace phy {
+
+// A Tech compiled into constant tables by emitTech() so that a binary built
+// for a fixed PDK doesn't need to run the tech script at all. Every list is
+// stored as an offset and count into TechTables::ints, and every Level as
+// {type, idx}. The generated header only depends on this file.
+
+struct TechPaint {
+	const char *name;
+	int major;
+	int minor;
+	bool fill;
+	int out;
+	int outCount;
+};
+
+struct TechMaterial {
+	int draw;
+	int label;
+	int pin;
+	int mask;
+	int maskCount;
+	int excl;
+	int exclCount;
+	float thickness;
+	float resistivity;
+};
+
+struct TechSubstrate {
+	TechMaterial mat;
+	int tap;
+	int well[2];
+};
+
+struct TechModel {
+	int type;
+	const char *variant;
+	const char *name;
+	int diff[2];
+	// pairs of min and max
+	int bins;
+	int binCount;
+};
+
+struct TechVia {
+	TechMaterial mat;
+	int down[2];
+	int up[2];
+};
+
+struct TechDielectric {
+	int down[2];
+	int up[2];
+	float thickness;
+	float permitivity;
+};
+
+struct TechRule {
+	int type;
+	int operands;
+	int operandCount;
+	int params;
+	int paramCount;
+	int out;
+	int outCount;
+};
+
+struct TechTables {
+	double dbunit;
+	double scale;
+	int boundary;
+
+	const int *ints;
+
+	const TechPaint *paint;
+	int paintCount;
+	const TechSubstrate *subst;
+	int substCount;
+	const TechModel *models;
+	int modelCount;
+	const TechMaterial *wires;
+	int wireCount;
+	const TechVia *vias;
+	int viaCount;
+	const TechDielectric *dielec;
+	int dielecCount;
+	// already optimized, see Tech::optimize()
+	const TechRule *rules;
+	int ruleCount;
+
+	/////////////////////////////////////////////
+	// The lookup tables built by Tech::freeze(), indexed the same way
+
+	const uint8_t *layerFlags;
+	// {type, idx} for each slot
+	const int *layerMaterial;
+	const int *checkIndex;
+	int checkCount;
+	const int *spacingTable;
+	// {lo, hi} for each entry
+	const int *enclosingTable;
+	const int *widthTable;
+	int levelCount;
+	// levelCount*levelCount+1 offsets into ints, the vias between level
+	// slots i and j are ints[viaTable[i*levelCount+j]] up to
+	// ints[viaTable[i*levelCount+j+1]]
+	const int *viaTable;
+
+	/////////////////////////////////////////////
+	// Same as the Tech queries of the same name. These may be evaluated at
+	// compile time.
+
+	constexpr int slot(int layer) const {
+		if (layer >= 0) {
+			return layer < paintCount ? layer : -1;
+		}
+		return -layer-1 < ruleCount ? paintCount-layer-1 : -1;
+	}
+
+	constexpr int getSpacing(int l0, int l1) const {
+		int s0 = slot(l0), s1 = slot(l1);
+		if (s0 < 0 or s1 < 0 or checkIndex[s0] < 0 or checkIndex[s1] < 0) {
+			return 0;
+		}
+		return spacingTable[checkIndex[s0]*checkCount + checkIndex[s1]];
+	}
+
+	constexpr int getWidth(int l0) const {
+		int s0 = slot(l0);
+		if (s0 < 0 or checkIndex[s0] < 0) {
+			return 0;
+		}
+		return widthTable[checkIndex[s0]];
+	}
+};
+
+// Write a header to path that defines the tables of tech as constexpr arrays
+// in namespace name, along with `constexpr phy::TechTables tables`. tech must
+// be frozen.
+bool emitTech(const Tech &tech, string path, string name);
+
+// Fill dst from tables, including the lookup tables normally built by
+// Tech::freeze(). dst is left frozen.
+void loadTables(Tech &dst, const TechTables &tables);
+
+}
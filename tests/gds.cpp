@@ -0,0 +1,226 @@
+#include <gtest/gtest.h>
+#include <phy/Gds.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+using namespace phy;
+using namespace std;
+
+static Tech makeTech() {
+	Tech tech;
+	tech.dbunit = 5e-3;
+	tech.paint.push_back(Paint("diff", 65, 20));
+	tech.paint.push_back(Paint("poly", 66, 20));
+	tech.paint.push_back(Paint("li", 67, 20));
+	tech.paint.push_back(Paint("li.lbl", 67, 5));
+	return tech;
+}
+
+// An asymmetric cell so that every orientation is distinguishable
+static Layout makeLeaf(const Tech &tech, string name) {
+	Layout cell(tech);
+	cell.name = name;
+	cell.push(0, Rect(-1, vec2i(0, 0), vec2i(40, 20)));
+	cell.push(1, Rect(-1, vec2i(5, -5), vec2i(10, 30)));
+	cell.push(2, Poly(-1, {vec2i(0, 30), vec2i(20, 30), vec2i(20, 40), vec2i(10, 50)}));
+	cell.label(3, Label(-1, vec2i(35, 5), "y"));
+	return cell;
+}
+
+// The rectangles of a layer in a canonical order
+static vector<Rect> sorted(const Layer &layer) {
+	vector<Rect> result = layer.geo;
+	sort(result.begin(), result.end(), [](const Rect &a, const Rect &b) {
+		return make_pair(make_pair(a.ll[0], a.ll[1]), make_pair(a.ur[0], a.ur[1])) < make_pair(make_pair(b.ll[0], b.ll[1]), make_pair(b.ur[0], b.ur[1]));
+	});
+	return result;
+}
+
+static bool sameRects(const vector<Rect> &a, const vector<Rect> &b) {
+	if (a.size() != b.size()) {
+		return false;
+	}
+	for (int i = 0; i < (int)a.size(); i++) {
+		if (a[i].ll != b[i].ll or a[i].ur != b[i].ur) {
+			return false;
+		}
+	}
+	return true;
+}
+
+TEST(Gds, Instances) {
+	Tech tech = makeTech();
+	Library lib(tech);
+	lib.push(makeLeaf(tech, "leaf"));
+
+	vec2i dirs[4] = {vec2i(1, 1), vec2i(-1, 1), vec2i(1, -1), vec2i(-1, -1)};
+	Layout top(tech);
+	top.name = "top";
+	for (int i = 0; i < 4; i++) {
+		top.push(Instance(0, vec2i(100*i, 7*i), dirs[i]), Rect());
+	}
+	top.push(1, Rect(-1, vec2i(-50, -50), vec2i(-20, 400)));
+
+	string path = ::testing::TempDir() + "inst.gds";
+	ASSERT_TRUE(saveGDS(path, top, &lib, "test"));
+
+	Library loaded(tech);
+	ASSERT_TRUE(loadGDS(loaded, path));
+	ASSERT_EQ(loaded.macros.size(), 2u);
+	int leaf = loaded.find("leaf");
+	ASSERT_GE(leaf, 0);
+	const Layout &cell = loaded.macros[loaded.find("top")];
+	ASSERT_EQ(cell.inst.size(), 4u);
+	for (int i = 0; i < 4; i++) {
+		EXPECT_EQ(cell.inst[i].macro, leaf);
+		EXPECT_EQ(cell.inst[i].pos, vec2i(100*i, 7*i));
+		EXPECT_EQ(cell.inst[i].dir, dirs[i]) << i;
+	}
+
+	const Layout &orig = lib.macros[0];
+	for (auto layer = orig.layers.begin(); layer != orig.layers.end(); layer++) {
+		auto pos = loaded.macros[leaf].find(layer->first);
+		ASSERT_TRUE(pos != loaded.macros[leaf].layers.end());
+		EXPECT_TRUE(sameRects(sorted(layer->second), sorted(pos->second))) << layer->first;
+		EXPECT_EQ(layer->second.poly.size(), pos->second.poly.size());
+		EXPECT_EQ(layer->second.lbl.size(), pos->second.lbl.size());
+	}
+
+	// Flattening the file matches flattening the library
+	Layout flat(tech);
+	ASSERT_TRUE(loadGDS(flat, path));
+	EXPECT_EQ(flat.name, "top");
+
+	lib.push(top);
+	FlatView view(lib, lib.macros[lib.find("top")]);
+	Layout expect(tech);
+	view.visit([&](int draw, const Rect &rect) {
+		expect.push(draw, rect);
+	});
+	for (auto layer = expect.layers.begin(); layer != expect.layers.end(); layer++) {
+		auto pos = flat.find(layer->first);
+		ASSERT_TRUE(pos != flat.layers.end());
+		EXPECT_TRUE(sameRects(sorted(layer->second), sorted(pos->second))) << layer->first;
+	}
+
+	remove(path.c_str());
+}
+
+static void put16(string &buf, int v) {
+	buf.push_back((char)((v >> 8) & 0xFF));
+	buf.push_back((char)(v & 0xFF));
+}
+
+static void put32(string &buf, int v) {
+	put16(buf, (v >> 16) & 0xFFFF);
+	put16(buf, v & 0xFFFF);
+}
+
+static void record(string &buf, int type, string data="") {
+	put16(buf, 4 + (int)data.size());
+	put16(buf, type);
+	buf += data;
+}
+
+static string int16(int v) {
+	string result;
+	put16(result, v);
+	return result;
+}
+
+static string name(string v) {
+	if (v.size()%2 != 0) {
+		v.push_back('\0');
+	}
+	return v;
+}
+
+// A file with a single L shaped path in it. The file has no units, so
+// coordinates are read as they are.
+static string pathFile(int pathtype) {
+	string buf;
+	record(buf, 0x0002, int16(600));
+	record(buf, 0x0102, string(24, '\0'));
+	record(buf, 0x0206, name("lib"));
+	record(buf, 0x0502, string(24, '\0'));
+	record(buf, 0x0606, name("path"));
+	record(buf, 0x0900);
+	record(buf, 0x0D02, int16(67));
+	record(buf, 0x0E02, int16(20));
+	record(buf, 0x2102, int16(pathtype));
+	string width;
+	put32(width, 10);
+	record(buf, 0x0F03, width);
+	string xy;
+	int points[6] = {0, 0, 100, 0, 100, 100};
+	for (int i = 0; i < 6; i++) {
+		put32(xy, points[i]);
+	}
+	record(buf, 0x1003, xy);
+	record(buf, 0x1100);
+	record(buf, 0x0700);
+	record(buf, 0x0400);
+	return buf;
+}
+
+static bool covered(const Layout &layout, int draw, vec2i p) {
+	auto layer = layout.find(draw);
+	if (layer == layout.layers.end()) {
+		return false;
+	}
+	for (auto r = layer->second.geo.begin(); r != layer->second.geo.end(); r++) {
+		if (r->ll[0] <= p[0] and p[0] < r->ur[0] and r->ll[1] <= p[1] and p[1] < r->ur[1]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+TEST(Gds, PathBends) {
+	Tech tech = makeTech();
+	for (int pathtype = 0; pathtype <= 2; pathtype += 2) {
+		string path = ::testing::TempDir() + "path.gds";
+		string data = pathFile(pathtype);
+		FILE *fptr = fopen(path.c_str(), "wb");
+		ASSERT_NE(fptr, nullptr);
+		fwrite(data.data(), 1, data.size(), fptr);
+		fclose(fptr);
+
+		Layout layout(tech);
+		ASSERT_TRUE(loadGDS(layout, path));
+
+		// along both segments
+		EXPECT_TRUE(covered(layout, 2, vec2i(50, -5)));
+		EXPECT_TRUE(covered(layout, 2, vec2i(50, 4)));
+		EXPECT_TRUE(covered(layout, 2, vec2i(95, 50)));
+		EXPECT_FALSE(covered(layout, 2, vec2i(50, 5)));
+		EXPECT_FALSE(covered(layout, 2, vec2i(94, 50)));
+		// the outer corner of the bend is always covered
+		EXPECT_TRUE(covered(layout, 2, vec2i(104, -5)));
+		EXPECT_FALSE(covered(layout, 2, vec2i(105, -5)));
+		// the ends are only extended for pathtype 2
+		EXPECT_EQ(covered(layout, 2, vec2i(-1, 0)), pathtype == 2);
+		EXPECT_EQ(covered(layout, 2, vec2i(100, 100)), pathtype == 2);
+		EXPECT_FALSE(covered(layout, 2, vec2i(-6, 0)));
+		EXPECT_FALSE(covered(layout, 2, vec2i(100, 105)));
+
+		remove(path.c_str());
+	}
+}
+
+TEST(Gds, PolygonTooLarge) {
+	Tech tech = makeTech();
+	Layout cell(tech);
+	cell.name = "big";
+	vector<vec2i> v;
+	for (int i = 0; i < 9000; i++) {
+		v.push_back(vec2i(i, i%2));
+	}
+	cell.push(0, Poly(-1, v));
+
+	string path = ::testing::TempDir() + "big.gds";
+	EXPECT_FALSE(saveGDS(path, cell));
+	remove(path.c_str());
+}
@@ -0,0 +1,106 @@
+#include <gtest/gtest.h>
+#include <phy/Loom.h>
+#include <phy/Script.h>
+
+#include <cstdio>
+#include <string>
+
+using namespace phy;
+using namespace std;
+
+// A technology script that stays within the subset that parseLoom() reads
+static const char *script = R"(import loom
+
+# layers
+diff = loom.paint("diff", 65, 20)
+poly = loom.paint("poly", 66, 20)
+licon = loom.paint("licon", 66, 44)
+li = loom.paint("li", 67, 20)
+li_lbl = loom.paint('li.lbl', 67, 5)
+li_pin = loom.paint("li.pin", 67, 16)
+nimp = loom.paint("nimp", 93, 44)
+nwell = loom.paint("nwell", 64, 20)
+bound = loom.paint("bound", 235, 4)
+
+loom.dbunit(5e-3)
+loom.scale(0.5)
+loom.fill(nimp)
+loom.bound(bound)
+
+well = loom.well(nwell, thick=1.5, resist=-2)
+ndiff = loom.subst(diff, mask=[nimp], excl=[nwell], well=well)
+p = loom.route(poly, thick=0.18)
+l = loom.route(li, label=li_lbl, pin=li_pin,
+	thick=0.1, resist=12.5)
+loom.via(p, l, licon, thick=0.9)
+loom.via(ndiff, l, licon)
+loom.dielec(p, l, 0.3, 4.1)
+loom.nmos("svt", "nfet_01v8", ndiff, bins=[(42, 84), (84, 1000)])
+
+loom.width(poly, 30)
+loom.width(li, 34)
+loom.spacing(poly, poly, 42)
+loom.spacing(li, li, 34)
+loom.spacing(loom.b_and(diff, nimp), poly, 15)
+loom.spacing(loom.b_or(li, licon, poly), diff, -3)
+loom.spacing(loom.b_not(nwell), diff, 68)
+loom.enclosing(nimp, diff, 25, 25)
+loom.enclosing(li, licon, 16)
+)";
+
+static string writeScript(string name, string prefix) {
+	string path = ::testing::TempDir() + name;
+	FILE *fptr = fopen(path.c_str(), "w");
+	if (fptr != nullptr) {
+		fputs(prefix.c_str(), fptr);
+		fputs(script, fptr);
+		fclose(fptr);
+	}
+	return path;
+}
+
+TEST(Loom, MatchesPython) {
+	string native = writeScript("loom_native.py", "");
+	// Any other import puts the script outside of the subset, so this copy is
+	// run by python
+	string python = writeScript("loom_python.py", "import sys\n");
+
+	Tech parsed(native);
+	ASSERT_TRUE(parseLoom(parsed, native));
+	parsed.optimize();
+
+	Tech fallback(python);
+	ASSERT_FALSE(parseLoom(fallback, python));
+	ASSERT_TRUE(loadTech(fallback));
+
+	EXPECT_EQ(parsed.paint.size(), 9u);
+	EXPECT_EQ(parsed.paint.size(), fallback.paint.size());
+	EXPECT_EQ(parsed.subst.size(), fallback.subst.size());
+	EXPECT_EQ(parsed.wires.size(), fallback.wires.size());
+	EXPECT_EQ(parsed.vias.size(), fallback.vias.size());
+	EXPECT_EQ(parsed.models.size(), fallback.models.size());
+	EXPECT_EQ(parsed.rules.size(), fallback.rules.size());
+	EXPECT_DOUBLE_EQ(parsed.dbunit, fallback.dbunit);
+	EXPECT_DOUBLE_EQ(parsed.scale, fallback.scale);
+	EXPECT_EQ(parsed.boundary, fallback.boundary);
+	EXPECT_EQ(parsed.hash(), fallback.hash());
+
+	remove(native.c_str());
+	remove(python.c_str());
+}
+
+TEST(Loom, RejectsOutsideSubset) {
+	const char *scripts[] = {
+		"import loom\nx = 1 + 2\n",
+		"import loom\nfor i in range(3):\n\tloom.paint(\"a\", i, 0)\n",
+		"import loom\nloom.paint(\"a\", 1, 0\n",
+		"import loom\nloom.unknown(1)\n",
+		"loom.paint(\"a\", 1, 0)\n",
+	};
+
+	for (int i = 0; i < (int)(sizeof(scripts)/sizeof(scripts[0])); i++) {
+		Tech tech;
+		LoomParser parser(tech);
+		EXPECT_FALSE(parser.parse(scripts[i])) << scripts[i];
+	}
+}
@@ -0,0 +1,178 @@
+#include <gtest/gtest.h>
+#include <phy/MappedLibrary.h>
+
+#include <cstdio>
+#include <string>
+
+using namespace phy;
+using namespace std;
+
+static Tech makeTech() {
+	Tech tech;
+	tech.paint.push_back(Paint("diff", 65, 20));
+	tech.paint.push_back(Paint("poly", 66, 20));
+	tech.paint.push_back(Paint("li", 67, 20));
+	tech.paint.push_back(Paint("li.lbl", 67, 5));
+	tech.wires.push_back(Routing(2, 3, -1));
+	tech.setSpacing(1, 1, 42);
+	return tech;
+}
+
+static Layout makeLeaf(const Tech &tech, string name, int size) {
+	Layout cell(tech);
+	cell.name = name;
+	int a = cell.netAt("a");
+	int y = cell.netAt("y");
+	cell.nets[y].isOutput = true;
+	cell.nameNet(y, "out");
+	cell.push(0, Rect(-1, vec2i(0, 0), vec2i(size, 20)));
+	cell.push(1, Rect(a, vec2i(10, -5), vec2i(15, 25)));
+	cell.push(2, Rect(y, vec2i(size-5, 0), vec2i(size, 40)));
+	cell.push(2, Poly(a, {vec2i(0, 30), vec2i(10, 30), vec2i(10, 40), vec2i(0, 35)}));
+	cell.label(3, Label(y, vec2i(size-3, 30), "y"));
+	return cell;
+}
+
+// The names of the macros instantiated by cell
+static vector<string> instanceNames(const Library &lib, const Layout &cell) {
+	vector<string> result;
+	for (auto i = cell.inst.begin(); i != cell.inst.end(); i++) {
+		result.push_back(i->macro >= 0 and i->macro < (int)lib.macros.size() ? lib.macros[i->macro].name : "");
+	}
+	return result;
+}
+
+static Library makeLibrary(const Tech &tech) {
+	Library lib(tech);
+	lib.push(makeLeaf(tech, "inv", 40));
+	lib.push(makeLeaf(tech, "nand", 60));
+
+	Layout top(tech);
+	top.name = "top";
+	int n0 = top.netAt("n0");
+	int n1 = top.netAt("n1");
+	Instance i0(1, vec2i(0, 0));
+	i0.ports = {n0, n1};
+	top.push(i0, Rect(-1, vec2i(0, 0), vec2i(60, 40)));
+	Instance i1(0, vec2i(100, 0), vec2i(-1, 1));
+	i1.ports = {n1, -1};
+	top.push(i1, Rect(-1, vec2i(60, 0), vec2i(100, 40)));
+	lib.push(top);
+	return lib;
+}
+
+TEST(Mapped, RoundTrip) {
+	Tech tech = makeTech();
+	Library lib = makeLibrary(tech);
+	string path = ::testing::TempDir() + "round.map";
+	ASSERT_TRUE(saveMapped(lib, path));
+
+	MappedLibrary mapped(tech);
+	ASSERT_TRUE(mapped.open(path));
+	ASSERT_EQ(mapped.size(), 3);
+	EXPECT_EQ(mapped.find("nand"), 1);
+	EXPECT_EQ(mapped.find("missing"), -1);
+
+	MacroView inv = mapped.macro(mapped.find("inv"));
+	EXPECT_EQ(inv.name(), "inv");
+	EXPECT_EQ(inv.hash(), lib.macros[0].hash());
+	LayerView li = inv.find(2);
+	ASSERT_EQ(li.size(), 1);
+	EXPECT_EQ(li[0].ur, vec2i(40, 40));
+	EXPECT_EQ(li.polys(), 1);
+	EXPECT_EQ(li.poly(0).v.size(), 4u);
+	EXPECT_EQ(inv.find(3).label(0).txt, "y");
+	EXPECT_EQ(inv.find(7).size(), 0);
+	ASSERT_EQ(inv.nets(), 2);
+	EXPECT_TRUE(inv.net(1).isOutput);
+	EXPECT_TRUE(inv.net(1).has("out"));
+
+	Library loaded(tech);
+	mapped.load(loaded);
+	ASSERT_EQ(loaded.macros.size(), 3u);
+	for (int i = 0; i < 3; i++) {
+		EXPECT_EQ(loaded.macros[i].hash(), lib.macros[i].hash()) << lib.macros[i].name;
+	}
+	const Layout &top = loaded.macros[loaded.find("top")];
+	ASSERT_EQ(top.inst.size(), 2u);
+	EXPECT_EQ(top.inst[1].dir, vec2i(-1, 1));
+	EXPECT_EQ(top.inst[1].pos, vec2i(100, 0));
+	EXPECT_EQ(top.inst[0].ports, vector<int>({0, 1}));
+	EXPECT_EQ(instanceNames(loaded, top), vector<string>({"nand", "inv"}));
+
+	mapped.close();
+	remove(path.c_str());
+}
+
+TEST(Mapped, LoadIntoLibrary) {
+	Tech tech = makeTech();
+	Library lib = makeLibrary(tech);
+	string path = ::testing::TempDir() + "merge.map";
+	ASSERT_TRUE(saveMapped(lib, path));
+
+	// The destination already has other macros, one with the same name as a
+	// macro in the file
+	Library dst(tech);
+	dst.push(makeLeaf(tech, "buf", 80));
+	dst.push(makeLeaf(tech, "nand", 99));
+	dst.push(makeLeaf(tech, "xor", 120));
+
+	MappedLibrary mapped(tech);
+	ASSERT_TRUE(mapped.open(path));
+	mapped.load(dst);
+
+	ASSERT_EQ(dst.macros.size(), 5u);
+	EXPECT_EQ(dst.find("buf"), 0);
+	EXPECT_EQ(dst.find("nand"), 1);
+	EXPECT_EQ(dst.find("xor"), 2);
+	EXPECT_EQ(dst.macros[dst.find("nand")].hash(), lib.macros[1].hash());
+	EXPECT_EQ(dst.macros[dst.find("inv")].hash(), lib.macros[0].hash());
+
+	const Layout &top = dst.macros[dst.find("top")];
+	EXPECT_EQ(instanceNames(dst, top), vector<string>({"nand", "inv"}));
+
+	mapped.close();
+	remove(path.c_str());
+}
+
+TEST(Mapped, Duplicates) {
+	Tech tech = makeTech();
+	Library lib(tech);
+	lib.macros.push_back(makeLeaf(tech, "inv", 40));
+	lib.macros.push_back(makeLeaf(tech, "inv", 70));
+	Layout top(tech);
+	top.name = "top";
+	top.push(Instance(1, vec2i(0, 0)), Rect(-1, vec2i(0, 0), vec2i(70, 40)));
+	lib.macros.push_back(top);
+	lib.reindex();
+
+	string path = ::testing::TempDir() + "dup.map";
+	ASSERT_TRUE(saveMapped(lib, path));
+	MappedLibrary mapped(tech);
+	ASSERT_TRUE(mapped.open(path));
+	EXPECT_EQ(mapped.find("inv"), lib.find("inv"));
+
+	// Only the first of the duplicates is loaded, and instances of the others
+	// refer to it
+	Library dst(tech);
+	mapped.load(dst);
+	ASSERT_EQ(dst.macros.size(), 2u);
+	EXPECT_EQ(dst.macros[dst.find("inv")].hash(), lib.macros[0].hash());
+	EXPECT_EQ(instanceNames(dst, dst.macros[dst.find("top")]), vector<string>({"inv"}));
+
+	mapped.close();
+	remove(path.c_str());
+}
+
+TEST(Mapped, OtherTechnology) {
+	Tech tech = makeTech();
+	Library lib = makeLibrary(tech);
+	string path = ::testing::TempDir() + "tech.map";
+	ASSERT_TRUE(saveMapped(lib, path));
+
+	Tech other = makeTech();
+	other.setSpacing(0, 0, 10);
+	MappedLibrary mapped(other);
+	EXPECT_FALSE(mapped.open(path));
+	remove(path.c_str());
+}
@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+#include <phy/Snapshot.h>
+#include <phy/Script.h>
+#include <phy/Binary.h>
+#include <phy/Loom.h>
+
+#include <cstdio>
+#include <string>
+
+using namespace phy;
+using namespace std;
+
+static Tech makeTech() {
+	Tech tech("tech.py tt", "lib");
+	tech.dbunit = 5e-3;
+	tech.scale = 0.5;
+	tech.paint.push_back(Paint("diff", 65, 20));
+	tech.paint.push_back(Paint("poly", 66, 20));
+	tech.paint.push_back(Paint("li", 67, 20));
+	tech.paint.push_back(Paint("li.lbl", 67, 5));
+	tech.paint.push_back(Paint("nimp", 93, 44));
+	tech.paint.push_back(Paint("nwell", 64, 20));
+	tech.paint[4].fill = true;
+	tech.boundary = 5;
+
+	tech.subst.push_back(Substrate(5, -1, -1, 2, Level(), 1.5f, 2.0f));
+	tech.subst.push_back(Substrate(0, -1, -1, -1, Level(Level::SUBST, 0)));
+	tech.subst.back().mask.push_back(4);
+	tech.subst.back().excl.push_back(5);
+	tech.models.push_back(Model(Model::NMOS, "svt", "nfet_01v8", Level(Level::SUBST, 1), {{42, 84}, {84, 1000}}));
+	tech.wires.push_back(Routing(1, -1, -1, 0.18f));
+	tech.wires.push_back(Routing(2, 3, -1, 0.1f, 12.5f));
+	tech.vias.push_back(Via(Level(Level::ROUTE, 0), Level(Level::ROUTE, 1), 2, -1, -1, 0.9f));
+	tech.dielec.push_back(Dielectric(Level(Level::ROUTE, 0), Level(Level::ROUTE, 1), 0.3f, 4.1f));
+
+	tech.setWidth(1, 30);
+	tech.setSpacing(1, 1, 42);
+	tech.setSpacing(tech.setAnd({0, 4}), 1, 15);
+	tech.setSpacing(tech.setNot(5), 0, 68);
+	tech.setEnclosing(4, 0, 25, 25);
+	return tech;
+}
+
+TEST(Snapshot, RoundTrip) {
+	string path = ::testing::TempDir() + "tech.snap";
+	Tech tech = makeTech();
+	ASSERT_TRUE(saveSnapshot(tech, path, 1234));
+
+	Tech loaded("other.py", "other");
+	ASSERT_TRUE(loadSnapshot(loaded, path, 1234));
+	EXPECT_EQ(loaded.hash(), tech.hash());
+	EXPECT_EQ(loaded.paint.size(), tech.paint.size());
+	EXPECT_EQ(loaded.rules.size(), tech.rules.size());
+	EXPECT_EQ(loaded.models[0].bins, tech.models[0].bins);
+	EXPECT_TRUE(loaded.paint[4].fill);
+	EXPECT_EQ(loaded.findPaint(67, 5), 3);
+	// These aren't part of the snapshot
+	EXPECT_EQ(loaded.path, "other.py");
+	EXPECT_EQ(loaded.lib, "other");
+
+	remove(path.c_str());
+}
+
+TEST(Snapshot, Rejects) {
+	string path = ::testing::TempDir() + "reject.snap";
+	Tech tech = makeTech();
+	ASSERT_TRUE(saveSnapshot(tech, path, 1234));
+
+	Tech loaded;
+	EXPECT_FALSE(loadSnapshot(loaded, path, 4321));
+	EXPECT_TRUE(loaded.paint.empty());
+	EXPECT_FALSE(loadSnapshot(loaded, ::testing::TempDir() + "missing.snap", 1234));
+
+	// Cut the file short
+	MappedFile file;
+	ASSERT_TRUE(file.open(path));
+	Writer w;
+	w.write(file.data, file.size/2);
+	file.close();
+	ASSERT_TRUE(w.save(path));
+	EXPECT_FALSE(loadSnapshot(loaded, path, 1234));
+	EXPECT_TRUE(loaded.paint.empty());
+
+	remove(path.c_str());
+}
+
+static void writeFile(string path, string text) {
+	FILE *fptr = fopen(path.c_str(), "w");
+	ASSERT_NE(fptr, nullptr);
+	fputs(text.c_str(), fptr);
+	fclose(fptr);
+}
+
+TEST(Snapshot, Interpreter) {
+	string script = ::testing::TempDir() + "snap_tech.py";
+	string path = ::testing::TempDir() + "interp.snap";
+	remove(path.c_str());
+
+	writeFile(script, "import loom\nloom.dbunit(0.005)\nm1 = loom.paint(\"m1\", 68, 20)\nloom.spacing(m1, m1, 14)\n");
+	Tech first(script);
+	ASSERT_TRUE(loadTech(first, path));
+	FILE *fptr = fopen(path.c_str(), "rb");
+	ASSERT_NE(fptr, nullptr);
+	fclose(fptr);
+
+	Tech second(script);
+	ASSERT_TRUE(loadTech(second, path));
+	EXPECT_EQ(second.hash(), first.hash());
+
+	// Changing the script invalidates the snapshot
+	writeFile(script, "import loom\nloom.dbunit(0.005)\nm1 = loom.paint(\"m1\", 68, 20)\nloom.spacing(m1, m1, 20)\n");
+	Tech third(script);
+	ASSERT_TRUE(loadTech(third, path));
+	EXPECT_NE(third.hash(), first.hash());
+
+	Tech parsed(script);
+	ASSERT_TRUE(parseLoom(parsed, script));
+	parsed.optimize();
+	EXPECT_EQ(third.hash(), parsed.hash());
+
+	remove(script.c_str());
+	remove(path.c_str());
+}
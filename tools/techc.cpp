@@ -0,0 +1,29 @@
+// Compile a technology script into a header of constexpr tables, see
+// phy/TechTables.h. A binary built against that header can fill a Tech with
+// loadTables() instead of running the script.
+//
+//   techc "<tech.py> [args...]" <output.h> [namespace]
+
+#include <phy/Tech.h>
+#include <phy/Script.h>
+#include <phy/TechTables.h>
+
+#include <cstdio>
+
+using namespace std;
+using namespace phy;
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		printf("usage: %s \"<tech.py> [args...]\" <output.h> [namespace]\n", argv[0]);
+		return 1;
+	}
+
+	Tech tech(argv[1]);
+	if (not loadTech(tech)) {
+		return 1;
+	}
+
+	string name = argc > 3 ? argv[3] : "tech";
+	return emitTech(tech, argv[2], name) ? 0 : 1;
+}